@@ -0,0 +1,514 @@
+#include "tftpserv.h"
+
+/* shared file cache: whole files kept in memory for RRQ, one contiguous
+   extent of pages per file. The cache lives in an anonymous shared mapping
+   created before the workers start, so the threads and every child they
+   fork see the same entries at the same addresses; a process-shared robust
+   mutex protects it. Entries are keyed by path and validated against the
+   device, inode, size and mtime of the file at every lookup.
+
+   Every pin of an entry, a transfer sending from it or filling it, is a
+   record of its own with the pid of the process holding it, and is what
+   cache_lookup() and cache_reserve() hand out. A child or pool process
+   that dies holding pins never releases them itself; the main process
+   releases them for it when it reaps it, see cache_reap(). */
+
+#define CACHE_PAGE 65536
+#define CACHE_ENTRIES 1024
+#define CACHE_BUCKETS 1024
+#define CACHE_PATH 256
+#define CACHE_PINS 4096
+
+enum cache_state {
+     CACHE_FREE,
+     CACHE_LOADING,                  /* being filled by the transfer that missed */
+     CACHE_READY,
+     CACHE_STALE                     /* file changed, freed once unpinned */
+};
+
+struct cache_entry {
+     char path[CACHE_PATH];
+     uint32_t hash;
+     int state;
+     int refs;                       /* transfers sending from the entry */
+
+     dev_t dev;
+     ino_t ino;
+     off_t size;
+     struct timespec mtime;
+
+     int first_page;
+     int npages;
+
+     int hnext;                      /* hash chain */
+     int lprev, lnext;               /* lru list, most recent first */
+};
+
+struct cache_pin {
+     pid_t pid;                      /* holding it, 0 when free */
+     int entry;                      /* pinned, or the next free pin */
+};
+
+struct cache {
+     pthread_mutex_t lock;
+
+     uint64_t hits;
+     uint64_t misses;
+     uint64_t evictions;
+
+     int buckets[CACHE_BUCKETS];
+     struct cache_entry entries[CACHE_ENTRIES];
+     int lru_head, lru_tail;
+
+     struct cache_pin pins[CACHE_PINS];
+     int pin_free;                   /* free list, -1 when all are taken */
+
+     int npages;
+     int limit_pages;                /* of them, the ones the settings let it use */
+     int used_pages;
+     uint64_t bitmap[];              /* one bit per page, set when allocated */
+};
+
+static struct cache *cache;
+static uint8_t *cache_pages;
+static pid_t cache_pid;              /* of this process, getpid() is a system call */
+
+static void cache_forked(void)
+{
+     cache_pid = getpid();
+}
+
+void cache_init(size_t bytes)
+{
+     pthread_mutexattr_t attr;
+     size_t npages = bytes / CACHE_PAGE, header;
+     void *mem;
+     int i;
+
+     if (npages == 0) {
+          return;
+     }
+
+     header = sizeof(struct cache) + (npages + 63) / 64 * sizeof(uint64_t);
+     header = (header + CACHE_PAGE - 1) / CACHE_PAGE * CACHE_PAGE;
+
+     mem = mmap(NULL, header + npages * CACHE_PAGE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (mem == MAP_FAILED) {
+          perror("server: mmap()");
+          exit(1);
+     }
+
+     cache = mem;
+     cache_pages = (uint8_t *) mem + header;
+     cache->npages = cache->limit_pages = npages;
+     cache->lru_head = cache->lru_tail = -1;
+
+     for (i = 0; i < CACHE_BUCKETS; i++) {
+          cache->buckets[i] = -1;
+     }
+
+     for (i = 0; i < CACHE_PINS; i++) {
+          cache->pins[i].entry = i + 1 < CACHE_PINS ? i + 1 : -1;
+     }
+
+     cache->pin_free = 0;
+     cache_pid = getpid();
+     pthread_atfork(NULL, NULL, cache_forked);
+
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&cache->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+}
+
+static void cache_lock(void)
+{
+     /* a child that died holding the lock leaves the cache consistent:
+        every update is complete before the lock is dropped */
+
+     if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+          pthread_mutex_consistent(&cache->lock);
+     }
+}
+
+static void cache_unlock(void)
+{
+     pthread_mutex_unlock(&cache->lock);
+}
+
+static uint32_t cache_hash(const char *path)
+{
+     uint32_t h = 2166136261u;
+
+     while (*path) {
+          h = (h ^ (uint8_t) *path++) * 16777619u;
+     }
+
+     return h;
+}
+
+static void lru_unlink(int e)
+{
+     struct cache_entry *ce = &cache->entries[e];
+
+     if (ce->lprev >= 0) {
+          cache->entries[ce->lprev].lnext = ce->lnext;
+     } else {
+          cache->lru_head = ce->lnext;
+     }
+
+     if (ce->lnext >= 0) {
+          cache->entries[ce->lnext].lprev = ce->lprev;
+     } else {
+          cache->lru_tail = ce->lprev;
+     }
+}
+
+static void lru_push(int e)
+{
+     struct cache_entry *ce = &cache->entries[e];
+
+     ce->lprev = -1;
+     ce->lnext = cache->lru_head;
+
+     if (cache->lru_head >= 0) {
+          cache->entries[cache->lru_head].lprev = e;
+     } else {
+          cache->lru_tail = e;
+     }
+
+     cache->lru_head = e;
+}
+
+static void hash_unlink(int e)
+{
+     struct cache_entry *ce = &cache->entries[e];
+     int *p = &cache->buckets[ce->hash % CACHE_BUCKETS];
+
+     while (*p != e) {
+          p = &cache->entries[*p].hnext;
+     }
+
+     *p = ce->hnext;
+}
+
+static void pages_set(int first, int n, int used)
+{
+     int i;
+
+     for (i = first; i < first + n; i++) {
+          if (used) {
+               cache->bitmap[i / 64] |= 1ULL << (i % 64);
+          } else {
+               cache->bitmap[i / 64] &= ~(1ULL << (i % 64));
+          }
+     }
+
+     cache->used_pages += used ? n : -n;
+}
+
+/* first fit search for n free consecutive pages, -1 if there is no such run */
+static int pages_find(int n)
+{
+     int i, run = 0;
+
+     for (i = 0; i < cache->npages; i++) {
+          if (cache->bitmap[i / 64] == ~0ULL) {
+               run = 0;
+               i |= 63;
+               continue;
+          }
+
+          if (cache->bitmap[i / 64] & (1ULL << (i % 64))) {
+               run = 0;
+          } else if (++run == n) {
+               return i - n + 1;
+          }
+     }
+
+     return -1;
+}
+
+/* release the pages of an entry that is out of the hash and the lru */
+static void entry_free(int e)
+{
+     struct cache_entry *ce = &cache->entries[e];
+
+     pages_set(ce->first_page, ce->npages, 0);
+     ce->state = CACHE_FREE;
+}
+
+/* take an entry out of service, its pages are freed once no transfer uses them */
+static void entry_drop(int e)
+{
+     struct cache_entry *ce = &cache->entries[e];
+
+     hash_unlink(e);
+     lru_unlink(e);
+
+     if (ce->refs == 0) {
+          entry_free(e);
+     } else {
+          ce->state = CACHE_STALE;
+     }
+}
+
+/* evict the least recently used entry that no transfer is sending from */
+static int cache_evict(void)
+{
+     int e;
+
+     for (e = cache->lru_tail; e >= 0; e = cache->entries[e].lprev) {
+          if (cache->entries[e].state == CACHE_READY && cache->entries[e].refs == 0) {
+               entry_drop(e);
+               cache->evictions++;
+               return 0;
+          }
+     }
+
+     return -1;
+}
+
+/* a pin of entry e for this process, -1 when there is none left; caller
+   holds the lock */
+static int pin_take(int e)
+{
+     int p = cache->pin_free;
+
+     if (p < 0) {
+          return -1;
+     }
+
+     cache->pin_free = cache->pins[p].entry;
+     cache->pins[p].pid = cache_pid;
+     cache->pins[p].entry = e;
+
+     return p;
+}
+
+/* drop pin p, freeing or abandoning what it held */
+static void pin_put(int p)
+{
+     int e = cache->pins[p].entry;
+     struct cache_entry *ce = &cache->entries[e];
+
+     cache->pins[p].pid = 0;
+     cache->pins[p].entry = cache->pin_free;
+     cache->pin_free = p;
+
+     if (ce->state == CACHE_LOADING) {
+          ce->refs = 0;
+          entry_drop(e);
+     } else if (--ce->refs == 0 && ce->state == CACHE_STALE) {
+          entry_free(e);
+     }
+}
+
+static int same_file(struct cache_entry *ce, struct stat *st)
+{
+     return ce->dev == st->st_dev && ce->ino == st->st_ino && ce->size == st->st_size &&
+          ce->mtime.tv_sec == st->st_mtim.tv_sec && ce->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* find path in the hash, dropping the entry if the file changed since it
+   was cached; caller holds the lock */
+static int cache_find(const char *path, uint32_t h, struct stat *st)
+{
+     int e;
+
+     for (e = cache->buckets[h % CACHE_BUCKETS]; e >= 0; e = cache->entries[e].hnext) {
+          if (cache->entries[e].hash == h && strcmp(cache->entries[e].path, path) == 0) {
+               break;
+          }
+     }
+
+     if (e >= 0 && cache->entries[e].state == CACHE_READY && !same_file(&cache->entries[e], st)) {
+          entry_drop(e);
+          return -1;
+     }
+
+     return e;
+}
+
+/* look path up; on a hit the entry is pinned until cache_release() and its
+   contents are returned in data. Returns the pin, -1 on a miss */
+int cache_lookup(const char *path, struct stat *st, const uint8_t **data)
+{
+     uint32_t h = cache_hash(path);
+     int e, p;
+
+     if (cache == NULL) {
+          return -1;
+     }
+
+     cache_lock();
+
+     if ((e = cache_find(path, h, st)) < 0 || cache->entries[e].state != CACHE_READY ||
+         (p = pin_take(e)) < 0) {
+          cache->misses++;
+          cache_unlock();
+          return -1;
+     }
+
+     cache->entries[e].refs++;
+     cache->hits++;
+     lru_unlink(e);
+     lru_push(e);
+
+     *data = cache_pages + (size_t) cache->entries[e].first_page * CACHE_PAGE;
+
+     cache_unlock();
+
+     return p;
+}
+
+/* after a miss, reserve an entry for the file that the caller fills through
+   data and then passes to cache_commit(), or to cache_release() to give up.
+   Returns the pin of the entry, or -1 when the file is not cached: too
+   large, already being loaded by another transfer, no room without
+   evicting pinned entries, or no pin left */
+int cache_reserve(const char *path, struct stat *st, uint8_t **data)
+{
+     uint32_t h = cache_hash(path);
+     int e, first, n = (st->st_size + CACHE_PAGE - 1) / CACHE_PAGE;
+     struct cache_entry *ce;
+
+     if (cache == NULL || strlen(path) >= CACHE_PATH || st->st_size == 0 || n > cache->limit_pages / 2) {
+          return -1;
+     }
+
+     cache_lock();
+
+     if (cache_find(path, h, st) >= 0 || cache->pin_free < 0) {
+          cache_unlock();
+          return -1;
+     }
+
+     for (e = 0; e < CACHE_ENTRIES && cache->entries[e].state != CACHE_FREE; e++)
+          ;
+
+     while (e == CACHE_ENTRIES || cache->used_pages + n > cache->limit_pages ||
+            (first = pages_find(n)) < 0) {
+          if (cache_evict() < 0) {
+               cache_unlock();
+               return -1;
+          }
+
+          if (e == CACHE_ENTRIES) {
+               for (e = 0; e < CACHE_ENTRIES && cache->entries[e].state != CACHE_FREE; e++)
+                    ;
+          }
+     }
+
+     ce = &cache->entries[e];
+     strcpy(ce->path, path);
+     ce->hash = h;
+     ce->state = CACHE_LOADING;
+     ce->refs = 1;
+     ce->dev = st->st_dev;
+     ce->ino = st->st_ino;
+     ce->size = st->st_size;
+     ce->mtime = st->st_mtim;
+     ce->first_page = first;
+     ce->npages = n;
+
+     pages_set(first, n, 1);
+
+     ce->hnext = cache->buckets[h % CACHE_BUCKETS];
+     cache->buckets[h % CACHE_BUCKETS] = e;
+     lru_push(e);
+
+     *data = cache_pages + (size_t) first * CACHE_PAGE;
+     e = pin_take(e);
+
+     cache_unlock();
+
+     return e;
+}
+
+/* a reserved entry, pin p, has been filled completely and can serve lookups */
+void cache_commit(int p)
+{
+     int e;
+
+     cache_lock();
+
+     e = cache->pins[p].entry;
+
+     if (cache->entries[e].state == CACHE_LOADING) {
+          cache->entries[e].state = CACHE_READY;
+     }
+
+     cache_unlock();
+}
+
+/* release pin p, returned by cache_lookup(), or abandon the entry reserved
+   by cache_reserve() if it was not committed */
+void cache_release(int p)
+{
+     cache_lock();
+     pin_put(p);
+     cache_unlock();
+}
+
+/* the process pid died: release the pins it held. Called before the
+   process is reaped, while its pid cannot be taken by another */
+void cache_reap(pid_t pid)
+{
+     int p;
+
+     if (cache == NULL) {
+          return;
+     }
+
+     cache_lock();
+
+     for (p = 0; p < CACHE_PINS; p++) {
+          if (cache->pins[p].pid == pid) {
+               pin_put(p);
+          }
+     }
+
+     cache_unlock();
+}
+
+/* shrink the cache to bytes, or let it grow back up to the size it was
+   created with; entries beyond the limit are evicted as far as no transfer
+   is sending from them, the others once they are released */
+void cache_limit(size_t bytes)
+{
+     size_t npages = bytes / CACHE_PAGE;
+
+     if (cache == NULL) {
+          return;
+     }
+
+     cache_lock();
+
+     cache->limit_pages = npages < (size_t) cache->npages ? npages : cache->npages;
+
+     while (cache->used_pages > cache->limit_pages && cache_evict() == 0)
+          ;
+
+     cache_unlock();
+}
+
+void report_cache(FILE *f)
+{
+     if (cache == NULL) {
+          return;
+     }
+
+     cache_lock();
+
+     fprintf(f, "cache: %lu hits, %lu misses, %lu evictions, %lu of %lu kB used\n",
+             (unsigned long) cache->hits, (unsigned long) cache->misses,
+             (unsigned long) cache->evictions,
+             (unsigned long) cache->used_pages * (CACHE_PAGE / 1024),
+             (unsigned long) cache->limit_pages * (CACHE_PAGE / 1024));
+
+     cache_unlock();
+}
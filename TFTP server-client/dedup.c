@@ -0,0 +1,513 @@
+#include "tftpserv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEDUP_X86
+#endif
+
+/* deduplicating store for uploads (-D): the writer of a WRQ cuts the data
+   into chunks where a rolling hash of the last bytes hits a pattern, so
+   that an edit only changes the chunks around it, and names each chunk
+   by its SHA-256. A chunk the store does not have yet is written to
+   store/xx/<hash>, one it has is only referred to. What replaces the
+   destination is a manifest, a header with the size of the file and a
+   line per chunk, committed like any upload; a RRQ of a manifest reads
+   the file back from its chunks as it is sent. Chunks are never removed,
+   the store only grows. Hashing runs on the SHA extensions where the cpu
+   has them */
+
+#define DEDUP_MIN 2048               /* chunk sizes: smallest, */
+#define DEDUP_BITS 13                /* 2^13 on average, */
+#define DEDUP_MAX 65536              /* and largest */
+#define DEDUP_MAGIC "tftp-dedup 1 "
+#define DEDUP_HEADER 34              /* the magic and a 20 digit size */
+#define DEDUP_LINE 72                /* hash, blank, length up to 65536, newline */
+
+struct sha256 {
+     uint32_t h[8];
+     uint64_t len;
+     uint8_t buf[64];
+     size_t used;
+};
+
+/* chunks of an upload on their way to the store */
+struct dedup_writer {
+     int fd;                         /* the manifest */
+     uint8_t *chunk;                 /* the chunk being cut, DEDUP_MAX bytes */
+     size_t len;
+     uint64_t gear;                  /* rolling hash */
+     uint64_t size;                  /* of the file */
+     uint64_t moff;                  /* of the next manifest line */
+     char lines[64 * DEDUP_LINE];    /* manifest lines not written yet */
+     size_t nlines;
+     int stored;                     /* chunks new to the store */
+};
+
+/* a manifest read back as the file, through fopencookie() */
+struct dedup_reader {
+     FILE *manifest;
+     int chunk;                      /* the chunk being read, -1 between chunks */
+     size_t left;                    /* bytes left in it */
+};
+
+static int store = -1;
+static uint64_t gear_table[256];
+static atomic_uint chunk_serial;
+
+static const uint32_t sha256_k[64] = {
+     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+     0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+     0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+     0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+     0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+     0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+     0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_scalar(struct sha256 *s, const uint8_t *p)
+{
+     uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+     int i;
+
+     for (i = 0; i < 16; i++) {
+          w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+     }
+
+     for (i = 16; i < 64; i++) {
+          w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+               w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+     }
+
+     a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+     e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+     for (i = 0; i < 64; i++) {
+          t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+          t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+          h = g; g = f; f = e; e = d + t1;
+          d = c; c = b; b = a; a = t1 + t2;
+     }
+
+     s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+     s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+#ifdef DEDUP_X86
+
+/* the same with sha256rnds2, two rounds per instruction, on the state
+   kept as ABEF and CDGH and four message words per register */
+__attribute__((target("sha,sse4.1")))
+static void sha256_ni(struct sha256 *s, const uint8_t *p)
+{
+     const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+     __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+     int i;
+
+     tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &s->h[0]), 0xb1);
+     state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &s->h[4]), 0x1b);
+     state0 = _mm_alignr_epi8(tmp, state1, 8);
+     state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+     abef = state0;
+     cdgh = state1;
+
+     for (i = 0; i < 16; i++) {
+          if (i < 4) {
+               w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), swap);
+          } else {
+               w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                                  _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)),
+                    w[(i + 3) & 3]);
+          }
+
+          msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+          state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+          state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+     }
+
+     state0 = _mm_add_epi32(state0, abef);
+     state1 = _mm_add_epi32(state1, cdgh);
+
+     tmp = _mm_shuffle_epi32(state0, 0x1b);
+     state1 = _mm_shuffle_epi32(state1, 0xb1);
+     _mm_storeu_si128((__m128i *) &s->h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+     _mm_storeu_si128((__m128i *) &s->h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#endif
+
+static void (*sha256_block)(struct sha256 *s, const uint8_t *p) = sha256_scalar;
+
+static void sha256_init(struct sha256 *s)
+{
+     static const uint32_t h0[8] = {
+          0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+     };
+
+     memcpy(s->h, h0, sizeof(h0));
+     s->len = 0;
+     s->used = 0;
+}
+
+static void sha256_update(struct sha256 *s, const uint8_t *p, size_t len)
+{
+     size_t n;
+
+     s->len += len;
+
+     while (len > 0) {
+          if (s->used == 0 && len >= 64) {
+               sha256_block(s, p);
+               p += 64;
+               len -= 64;
+               continue;
+          }
+
+          n = 64 - s->used < len ? 64 - s->used : len;
+          memcpy(s->buf + s->used, p, n);
+          s->used += n;
+          p += n;
+          len -= n;
+
+          if (s->used == 64) {
+               sha256_block(s, s->buf);
+               s->used = 0;
+          }
+     }
+}
+
+/* the digest in hex, 64 characters and a NUL */
+static void sha256_final(struct sha256 *s, char *hex)
+{
+     uint64_t bits = s->len * 8;
+     uint8_t pad[72] = { 0x80 };
+     size_t n = (s->used < 56 ? 56 : 120) - s->used;
+     int i;
+
+     for (i = 0; i < 8; i++) {
+          pad[n + i] = bits >> (56 - 8 * i);
+     }
+
+     sha256_update(s, pad, n + 8);
+
+     for (i = 0; i < 8; i++) {
+          sprintf(hex + 8 * i, "%08x", s->h[i]);
+     }
+}
+
+/* open the store at dir, with its 256 subdirectories */
+void dedup_init(const char *dir)
+{
+     char sub[3];
+     uint64_t x = 0x9e3779b97f4a7c15ULL, z;
+     int i;
+
+     if (dir == NULL) {
+          return;
+     }
+
+     if ((mkdir(dir, 0777) < 0 && errno != EEXIST) ||
+         (store = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+          perror(dir);
+          exit(1);
+     }
+
+     for (i = 0; i < 256; i++) {
+          snprintf(sub, sizeof(sub), "%02x", i);
+
+          if (mkdirat(store, sub, 0777) < 0 && errno != EEXIST) {
+               perror(dir);
+               exit(1);
+          }
+     }
+
+#ifdef DEDUP_X86
+     __builtin_cpu_init();
+
+     if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+          sha256_block = sha256_ni;
+     }
+#endif
+
+     /* the rolling hash adds a random looking value per byte, the same on
+        every run so that chunk boundaries are too (splitmix64) */
+
+     for (i = 0; i < 256; i++) {
+          z = (x += 0x9e3779b97f4a7c15ULL);
+          z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+          z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+          gear_table[i] = z ^ z >> 31;
+     }
+}
+
+/* an upload to the store, its manifest written to fd; NULL with errno
+   set on failure */
+struct dedup_writer *dedup_writer_open(int fd)
+{
+     struct dedup_writer *d;
+     char header[DEDUP_HEADER + 1];
+
+     if ((d = calloc(1, sizeof(*d))) == NULL || (d->chunk = malloc(DEDUP_MAX)) == NULL) {
+          free(d);
+          errno = ENOMEM;
+          return NULL;
+     }
+
+     /* the size is only known at the end, its header is rewritten then */
+
+     snprintf(header, sizeof(header), DEDUP_MAGIC "%020llu\n", 0ULL);
+
+     if (pwrite(fd, header, DEDUP_HEADER, 0) != DEDUP_HEADER) {
+          free(d->chunk);
+          free(d);
+          return NULL;
+     }
+
+     d->fd = fd;
+     d->moff = DEDUP_HEADER;
+
+     return d;
+}
+
+static int dedup_flush(struct dedup_writer *d)
+{
+     if (d->nlines > 0 && pwrite(d->fd, d->lines, d->nlines, d->moff) != (ssize_t) d->nlines) {
+          return -1;
+     }
+
+     d->moff += d->nlines;
+     d->nlines = 0;
+
+     return 0;
+}
+
+/* the chunk is complete: add it to the store unless it is there already,
+   then to the manifest */
+static int dedup_cut(struct dedup_writer *d)
+{
+     struct sha256 s;
+     char hex[65], name[68], tmp[96];
+     int fd;
+
+     sha256_init(&s);
+     sha256_update(&s, d->chunk, d->len);
+     sha256_final(&s, hex);
+     snprintf(name, sizeof(name), "%.2s/%s", hex, hex);
+
+     if (faccessat(store, name, F_OK, 0) == 0) {
+          worker_count(dedup_duplicates);
+          worker_add(dedup_bytes_saved, d->len);
+     } else {
+
+          /* written under a name of its own and renamed into place, a
+             reader never sees part of a chunk */
+
+          snprintf(tmp, sizeof(tmp), "%.2s/.%s.%d.%u", hex, hex, (int) getpid(),
+                   atomic_fetch_add(&chunk_serial, 1));
+
+          if ((fd = openat(store, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0) {
+               return -1;
+          }
+
+          if (write(fd, d->chunk, d->len) != (ssize_t) d->len || close(fd) < 0 ||
+              renameat(store, tmp, store, name) < 0) {
+               unlinkat(store, tmp, 0);
+               return -1;
+          }
+
+          d->stored++;
+          worker_count(dedup_chunks);
+          worker_add(dedup_bytes_stored, d->len);
+     }
+
+     if (d->nlines + DEDUP_LINE > sizeof(d->lines) && dedup_flush(d) < 0) {
+          return -1;
+     }
+
+     d->nlines += sprintf(d->lines + d->nlines, "%s %zu\n", hex, d->len);
+     d->len = 0;
+     d->gear = 0;
+
+     return 0;
+}
+
+/* the next len bytes of the file. The top bits of the rolling hash only
+   depend on the last 64 bytes, so hashing starts 64 bytes short of the
+   smallest chunk size and the bytes up to there are only copied */
+int dedup_write(struct dedup_writer *d, const uint8_t *p, size_t len)
+{
+     const uint64_t mask = ((1ULL << DEDUP_BITS) - 1) << (64 - DEDUP_BITS);
+     size_t i, n;
+     int cut;
+
+     d->size += len;
+
+     while (len > 0) {
+          n = DEDUP_MAX - d->len < len ? DEDUP_MAX - d->len : len;
+          i = d->len < DEDUP_MIN - 64 ? DEDUP_MIN - 64 - d->len : 0;
+          i = i < n ? i : n;
+
+          for (cut = 0; i < n; i++) {
+               d->gear = (d->gear << 1) + gear_table[p[i]];
+
+               if ((d->gear & mask) == 0 && d->len + i + 1 >= DEDUP_MIN) {
+                    cut = 1;
+                    i++;
+                    break;
+               }
+          }
+
+          memcpy(d->chunk + d->len, p, i);
+          d->len += i;
+          p += i;
+          len -= i;
+
+          if ((cut || d->len == DEDUP_MAX) && dedup_cut(d) < 0) {
+               return -1;
+          }
+     }
+
+     return 0;
+}
+
+/* the file is complete: store its last chunk, write the size into the
+   header, and have the new chunks on disk before the manifest is synced
+   and replaces the destination */
+int dedup_finish(struct dedup_writer *d)
+{
+     char header[DEDUP_HEADER + 1];
+
+     if ((d->len > 0 && dedup_cut(d) < 0) || dedup_flush(d) < 0) {
+          return -1;
+     }
+
+     snprintf(header, sizeof(header), DEDUP_MAGIC "%020llu\n", (unsigned long long) d->size);
+
+     if (pwrite(d->fd, header, DEDUP_HEADER, 0) != DEDUP_HEADER) {
+          return -1;
+     }
+
+     if (d->stored > 0 && config.fsync_policy != FSYNC_NONE && syncfs(store) < 0) {
+          return -1;
+     }
+
+     return 0;
+}
+
+void dedup_writer_free(struct dedup_writer *d)
+{
+     free(d->chunk);
+     free(d);
+}
+
+static ssize_t dedup_read(void *cookie, char *buf, size_t size)
+{
+     struct dedup_reader *r = cookie;
+     struct stat st;
+     char hex[65], name[68];
+     size_t len;
+     ssize_t c;
+     int n;
+
+     while (r->left == 0) {
+          if (r->chunk >= 0) {
+               close(r->chunk);
+               r->chunk = -1;
+          }
+
+          if ((n = fscanf(r->manifest, "%64s %zu\n", hex, &len)) == EOF) {
+               return ferror(r->manifest) ? -1 : 0;
+          }
+
+          /* any file may look like a manifest, so a line is only taken
+             for a chunk's hash and length as the writer puts them, and the
+             chunk is opened beneath the store whatever it names */
+
+          if (n != 2 || strlen(hex) != 64 || strspn(hex, "0123456789abcdef") != 64 ||
+              len == 0 || len > DEDUP_MAX) {
+               errno = EIO;
+               return -1;
+          }
+
+          /* a chunk that is missing or not as long as the manifest says
+             fails the transfer rather than sending a wrong file */
+
+          snprintf(name, sizeof(name), "%.2s/%s", hex, hex);
+
+          if ((r->chunk = resolve_at(store, name, O_RDONLY)) < 0 ||
+              fstat(r->chunk, &st) < 0 || (size_t) st.st_size != len) {
+               errno = r->chunk < 0 ? errno : EIO;
+               return -1;
+          }
+
+          r->left = len;
+     }
+
+     if ((c = read(r->chunk, buf, size < r->left ? size : r->left)) <= 0) {
+          errno = c == 0 ? EIO : errno;
+          return -1;
+     }
+
+     r->left -= c;
+
+     return c;
+}
+
+static int dedup_close(void *cookie)
+{
+     struct dedup_reader *r = cookie;
+
+     if (r->chunk >= 0) {
+          close(r->chunk);
+     }
+
+     fclose(r->manifest);
+     free(r);
+
+     return 0;
+}
+
+/* a RRQ opened t->fd: if it is a manifest, read the file from its chunks
+   instead, with its size in t->size. Returns -1 with errno set when the
+   manifest cannot be read */
+int dedup_open(tftp_transfer *t)
+{
+     cookie_io_functions_t io = { .read = dedup_read, .close = dedup_close };
+     struct dedup_reader *r;
+     char header[DEDUP_HEADER + 1];
+     unsigned long long size;
+     FILE *f;
+
+     if (store < 0 || pread(fileno(t->fd), header, DEDUP_HEADER, 0) != DEDUP_HEADER ||
+         strncmp(header, DEDUP_MAGIC, strlen(DEDUP_MAGIC)) != 0) {
+          return 0;
+     }
+
+     header[DEDUP_HEADER] = '\0';
+
+     if (sscanf(header + strlen(DEDUP_MAGIC), "%llu", &size) != 1 ||
+         fseek(t->fd, DEDUP_HEADER, SEEK_SET) < 0) {
+          errno = EIO;
+          return -1;
+     }
+
+     if ((r = calloc(1, sizeof(*r))) == NULL) {
+          return -1;
+     }
+
+     r->manifest = t->fd;
+     r->chunk = -1;
+
+     if ((f = fopencookie(r, "r", io)) == NULL) {
+          free(r);
+          return -1;
+     }
+
+     t->fd = f;
+     t->size = size;
+
+     return 0;
+}
@@ -0,0 +1,273 @@
+#include "tftpserv.h"
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64
+
+/* event loop state, the listener is registered with a NULL pointer and
+   every transfer with its own tftp_transfer. The retransmission and idle
+   deadlines of all transfers go on one timing wheel, which gives the
+   epoll_wait() timeout and the transfers that are due without a walk over
+   all of them. Transfers are also filed by client, to drop repeated
+   requests, and requests beyond the transfer limit wait in a queue */
+struct event_loop {
+     int ep;
+     int s;
+     tftp_transfer *transfers;
+     struct timer_wheel wheel;
+     struct session_table sessions;
+     struct request_queue queue;
+};
+
+/* put the deadlines of t on the wheel, after anything that may have
+   moved them */
+static void loop_arm(struct event_loop *l, tftp_transfer *t)
+{
+     timer_arm(&l->wheel, &t->timer, t->deadline);
+     timer_arm(&l->wheel, &t->idle_timer, t->idle_deadline);
+}
+
+static void loop_remove(struct event_loop *l, tftp_transfer *t, int status)
+{
+     if (status == TRANSFER_DONE) {
+          worker_count(completed);
+     } else {
+          worker_count(failed);
+     }
+
+     timer_cancel(&l->wheel, &t->timer);
+     timer_cancel(&l->wheel, &t->idle_timer);
+     session_del(&l->sessions, &t->requester);
+
+     epoll_ctl(l->ep, EPOLL_CTL_DEL, t->s, NULL);
+
+     if (t->wb != NULL) {
+          epoll_ctl(l->ep, EPOLL_CTL_DEL, wb_eventfd(t->wb), NULL);
+     }
+
+     if (t->prev) {
+          t->prev->next = t->next;
+     } else {
+          l->transfers = t->next;
+     }
+
+     if (t->next) {
+          t->next->prev = t->prev;
+     }
+
+     transfer_end(t);
+     free(t);
+     admit_release();
+}
+
+/* start a transfer for a request admitted against the limit */
+static void loop_start(struct event_loop *l, tftp_message *message, ssize_t len, struct sockaddr_in *client_sock)
+{
+     socklen_t slen = sizeof(*client_sock);
+     struct epoll_event ev;
+     struct session *ss;
+     tftp_transfer *t;
+     int status;
+
+     worker_count(requests);
+
+     if ((t = malloc(sizeof(*t))) == NULL) {
+          fprintf(stderr, "server: out of memory\n");
+          worker_count(failed);
+          send_error(l->s, ENOSPACE, "out of memory", client_sock, slen);
+          admit_release();
+          return;
+     }
+
+     if ((status = transfer_start(t, message, len, client_sock, slen)) != 0) {
+
+          /* a client that joined a multicast session is counted when it
+             leaves the session */
+
+          if (status < 0) {
+               worker_count(failed);
+          }
+          free(t);
+          admit_release();
+          return;
+     }
+
+     /* edge triggered, transfer_input() drains the socket unless a WRQ
+        stalls on its write-behind ring, and then reads on again when the
+        eventfd says the writer made room */
+
+     ev.events = EPOLLIN | EPOLLET;
+     ev.data.ptr = t;
+
+     status = epoll_ctl(l->ep, EPOLL_CTL_ADD, t->s, &ev);
+
+     if (status == 0 && t->wb != NULL) {
+          ev.events = EPOLLIN;
+          status = epoll_ctl(l->ep, EPOLL_CTL_ADD, wb_eventfd(t->wb), &ev);
+     }
+
+     if (status < 0) {
+          perror("server: epoll_ctl()");
+          worker_count(failed);
+          transfer_end(t);
+          free(t);
+          admit_release();
+          return;
+     }
+
+     t->prev = NULL;
+     t->next = l->transfers;
+     if (l->transfers) {
+          l->transfers->prev = t;
+     }
+     l->transfers = t;
+
+     if ((ss = session_add(&l->sessions, client_sock)) != NULL) {
+          ss->data = t;
+     }
+
+     t->timer.data = t->idle_timer.data = t;
+     loop_arm(l, t);
+}
+
+/* a request received on the listening socket */
+static void loop_request(struct event_loop *l, tftp_message *message, ssize_t len, struct sockaddr_in *client_sock)
+{
+     if (!check_request(l->s, message, len, client_sock, sizeof(*client_sock))) {
+          return;
+     }
+
+     /* the client repeated its request before our reply reached it, the
+        transfer already running, or the request waiting, answers it */
+
+     if (session_find(&l->sessions, client_sock) != NULL || queue_find(&l->queue, client_sock)) {
+          worker_count(duplicates);
+          log_event(LOG_DEBUG, LOG_MESSAGE, client_sock, "duplicate request ignored", NULL, 0, 0, 0);
+          return;
+     }
+
+     /* requests already waiting go first */
+
+     if (l->queue.count > 0 || !admit_take()) {
+          queue_hold(&l->queue, l->s, message, len, client_sock);
+          return;
+     }
+
+     loop_start(l, message, len, client_sock);
+}
+
+/* drain the listening socket, a batch of requests per system call */
+static void loop_accept(struct event_loop *l)
+{
+     tftp_message messages[RECV_BATCH];
+     struct sockaddr_in from[RECV_BATCH];
+     ssize_t lens[RECV_BATCH];
+     int i, n;
+
+     while ((n = recv_batch(l->s, (uint8_t *) messages, sizeof(*messages), RECV_BATCH, from, lens, 0)) > 0) {
+          for (i = 0; i < n; i++) {
+               loop_request(l, &messages[i], lens[i], &from[i]);
+          }
+     }
+}
+
+/* serve every transfer from this process, multiplexed over epoll */
+void event_loop(int s)
+{
+     struct event_loop l;
+     struct epoll_event ev, events[MAX_EVENTS];
+     struct queued_request r;
+     tftp_transfer *t;
+     struct timer *tm;
+     int i, j, n, status, timeout;
+
+     l.s = s;
+     l.transfers = NULL;
+     timer_init(&l.wheel, now_ms());
+     session_init(&l.sessions);
+
+     if (queue_init(&l.queue, config.queue_len) < 0) {
+          fprintf(stderr, "server: out of memory\n");
+          exit(1);
+     }
+
+     if ((l.ep = epoll_create1(0)) < 0) {
+          perror("server: epoll_create1()");
+          exit(1);
+     }
+
+     if (fcntl(s, F_SETFL, O_NONBLOCK) < 0) {
+          perror("server: fcntl()");
+          exit(1);
+     }
+
+     ev.events = EPOLLIN;
+     ev.data.ptr = NULL;
+
+     if (epoll_ctl(l.ep, EPOLL_CTL_ADD, s, &ev) < 0) {
+          perror("server: epoll_ctl()");
+          exit(1);
+     }
+
+     while (1) {
+
+          /* sleep until the earliest deadline, or look again soon for
+             room for the requests waiting */
+
+          timeout = timer_next(&l.wheel, now_ms());
+
+          if (l.queue.count > 0 && (timeout < 0 || timeout > QUEUE_POLL)) {
+               timeout = QUEUE_POLL;
+          }
+
+          if ((n = epoll_wait(l.ep, events, MAX_EVENTS, timeout)) < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               perror("server: epoll_wait()");
+               exit(1);
+          }
+
+          for (i = 0; i < n; i++) {
+               t = events[i].data.ptr;
+
+               if (events[i].events == 0) {
+                    continue;
+               }
+
+               if (t == NULL) {
+                    loop_accept(&l);
+               } else if ((status = transfer_input(t)) == TRANSFER_RUNNING) {
+                    loop_arm(&l, t);
+               } else {
+                    loop_remove(&l, t, status);
+
+                    /* a WRQ has its socket and its eventfd in the set, drop
+                       a second event for the transfer just freed */
+
+                    for (j = i + 1; j < n; j++) {
+                         if (events[j].data.ptr == t) {
+                              events[j].events = 0;
+                         }
+                    }
+               }
+          }
+
+          /* a transfer is taken off the wheel when one of its timers
+               expires and armed again, or removed, right after */
+
+          while ((tm = timer_expired(&l.wheel, now_ms())) != NULL) {
+               t = tm->data;
+
+               if ((status = transfer_timeout(t)) == TRANSFER_RUNNING) {
+                    loop_arm(&l, t);
+               } else {
+                    loop_remove(&l, t, status);
+               }
+          }
+
+          while (queue_next(&l.queue, &r)) {
+               loop_start(&l, &r.m, r.len, &r.from);
+          }
+
+     }
+}
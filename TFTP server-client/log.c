@@ -0,0 +1,384 @@
+#include "tftpserv.h"
+
+/* asynchronous logger. A transfer does not format or write anything: it
+   fills a fixed size record with the event, the client and a few numbers
+   and queues it on a bounded lock-free ring in shared memory, so children
+   forked by a worker log to the same ring as the event loops. A thread of
+   the main process takes the records off the ring, formats them as text,
+   json or leaves them binary, and writes them out in batches. When the
+   ring is full records are dropped and counted, logging never blocks.
+
+   A process killed between claiming a slot and publishing its record
+   would hold the flusher at that slot for good, and with it every
+   process once the ring filled. A slot claimed and left unpublished for
+   LOG_STUCK ms is skipped and counted as dropped; the publishing store
+   and the skip race on the slot's sequence, so a producer that was only
+   slow loses its record rather than the ring its order */
+
+#define LOG_BATCH (64 << 10)
+#define LOG_STUCK 100
+
+struct log_ring {
+     _Atomic uint64_t head;          /* next slot producers claim */
+     char pad1[56];
+     uint64_t tail;                  /* next slot the flusher reads */
+     char pad2[56];
+     _Atomic uint64_t dropped;
+     _Atomic uint64_t sampled;       /* info events seen, for sampling */
+     int level;
+     int sample;
+     int format;
+     struct log_record slots[LOG_SLOTS];
+};
+
+static struct log_ring *ring;
+static int log_fd = -1;
+static pthread_t flusher;
+static atomic_int stopping;
+static pid_t log_pid;                /* of this process, getpid() is a system call */
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+static const char *kind_names[] = {
+     "message", "request", "completed", "peer_error", "bad_opcode", "mcast"
+};
+
+static uint64_t log_now(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* queue an event for the client at addr, if its level is enabled; info
+   events are sampled one in log_sample. Strings are truncated to fit */
+void log_event(int level, int kind, struct sockaddr_in *addr, const char *text, const char *arg,
+               uint64_t a, uint64_t b, uint64_t c)
+{
+     struct log_record *r;
+     struct timespec ts;
+     uint64_t pos, seq, claimed;
+
+     if (ring == NULL || level > ring->level) {
+          return;
+     }
+
+     if (level == LOG_INFO && ring->sample > 1 &&
+         atomic_fetch_add_explicit(&ring->sampled, 1, memory_order_relaxed) % ring->sample != 0) {
+          return;
+     }
+
+     /* claim a slot: it is free when its sequence is the position that
+        claims it, and still holds an unread record one turn behind */
+
+     pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+     while (1) {
+          r = &ring->slots[pos % LOG_SLOTS];
+          seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+
+          if (seq == pos) {
+               if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                         memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+               }
+          } else if ((int64_t) (seq - pos) < 0) {
+               atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+               return;
+          } else {
+               pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+          }
+     }
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+
+     r->time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+     r->a = a;
+     r->b = b;
+     r->c = c;
+     r->addr = addr != NULL ? addr->sin_addr.s_addr : 0;
+     r->port = addr != NULL ? addr->sin_port : 0;
+     r->level = level;
+     r->kind = kind;
+     r->pid = log_pid;
+
+     r->text[0] = r->arg[0] = '\0';
+
+     if (text != NULL) {
+          strncat(r->text, text, sizeof(r->text) - 1);
+     }
+
+     if (arg != NULL) {
+          strncat(r->arg, arg, sizeof(r->arg) - 1);
+     }
+
+     claimed = pos;
+     atomic_compare_exchange_strong_explicit(&r->seq, &claimed, pos + 1, memory_order_release,
+                                             memory_order_relaxed);
+}
+
+/* the message of a record, as the server always printed it */
+static int format_message(struct log_record *r, char *out, size_t size)
+{
+     struct in_addr group;
+
+     switch (r->kind) {
+     case LOG_REQUEST:
+          return snprintf(out, size, "request received: %s '%s' %s",
+                          r->a == RRQ ? "get" : "put", r->text, r->arg);
+     case LOG_COMPLETED:
+          return snprintf(out, size, "transfer completed, %llu bytes in %.3f s (%.1f KB/s), "
+                          "%llu packets resent", (unsigned long long) r->a, r->b / 1e6,
+                          r->b ? r->a * 1e6 / 1024 / r->b : 0, (unsigned long long) r->c);
+     case LOG_PEER_ERROR:
+          return snprintf(out, size, "error message received: %llu %s",
+                          (unsigned long long) r->a, r->text);
+     case LOG_BAD_OPCODE:
+          return snprintf(out, size, "invalid request received: opcode %llu",
+                          (unsigned long long) r->a);
+     case LOG_MCAST:
+          group.s_addr = r->a;
+          return snprintf(out, size, "%s %s:%llu", r->text, inet_ntoa(group),
+                          (unsigned long long) r->b);
+     default:
+          return snprintf(out, size, "%s", r->text);
+     }
+}
+
+/* s as a json string, quoted and escaped */
+static int json_string(const char *s, char *out, size_t size)
+{
+     size_t o = 0;
+
+     out[o++] = '"';
+
+     for (; *s != '\0' && o + 8 < size; s++) {
+          if (*s == '"' || *s == '\\') {
+               out[o++] = '\\';
+               out[o++] = *s;
+          } else if ((uint8_t) *s < 0x20) {
+               o += sprintf(out + o, "\\u%04x", (uint8_t) *s);
+          } else {
+               out[o++] = *s;
+          }
+     }
+
+     out[o++] = '"';
+     out[o] = '\0';
+
+     return o;
+}
+
+/* the fields of a json record beyond its message */
+static int json_fields(struct log_record *r, char *out, size_t size)
+{
+     char quoted[LOG_TEXT * 6 + 2];
+
+     switch (r->kind) {
+     case LOG_REQUEST:
+          json_string(r->text, quoted, sizeof(quoted));
+          return snprintf(out, size, ",\"op\":\"%s\",\"file\":%s,\"mode\":\"%s\"",
+                          r->a == RRQ ? "get" : "put", quoted, r->arg);
+     case LOG_COMPLETED:
+          return snprintf(out, size, ",\"bytes\":%llu,\"duration_us\":%llu,\"resent\":%llu",
+                          (unsigned long long) r->a, (unsigned long long) r->b,
+                          (unsigned long long) r->c);
+     case LOG_PEER_ERROR:
+          return snprintf(out, size, ",\"code\":%llu", (unsigned long long) r->a);
+     case LOG_BAD_OPCODE:
+          return snprintf(out, size, ",\"opcode\":%llu", (unsigned long long) r->a);
+     default:
+          out[0] = '\0';
+          return 0;
+     }
+}
+
+/* append record r to out in the configured format; returns its length */
+static size_t format_record(struct log_record *r, char *out, size_t size)
+{
+     char msg[512], quoted[sizeof(msg) * 6 + 2], fields[LOG_TEXT * 6 + 128];
+     struct in_addr addr = { r->addr };
+     int n;
+
+     if (ring->format == LOG_FORMAT_BINARY) {
+          memcpy(out, r, sizeof(*r));
+          return sizeof(*r);
+     }
+
+     format_message(r, msg, sizeof(msg));
+
+     if (ring->format == LOG_FORMAT_TEXT) {
+          n = snprintf(out, size, "%s.%u: %s\n", inet_ntoa(addr), ntohs(r->port), msg);
+     } else {
+          json_string(msg, quoted, sizeof(quoted));
+          json_fields(r, fields, sizeof(fields));
+          n = snprintf(out, size, "{\"time\":%llu.%06llu,\"level\":\"%s\",\"pid\":%d,"
+                       "\"client\":\"%s:%u\",\"event\":\"%s\",\"message\":%s%s}\n",
+                       (unsigned long long) r->time_us / 1000000,
+                       (unsigned long long) r->time_us % 1000000, level_names[r->level],
+                       (int) r->pid, inet_ntoa(addr), ntohs(r->port), kind_names[r->kind],
+                       quoted, fields);
+     }
+
+     return n < size ? n : size - 1;
+}
+
+static void write_all(const char *buf, size_t len)
+{
+     ssize_t c;
+
+     while (len > 0) {
+          if ((c = write(log_fd, buf, len)) < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               return;
+          }
+          buf += c;
+          len -= c;
+     }
+}
+
+/* take what the ring holds and write it out, a batch per write() */
+static size_t log_drain(char *batch)
+{
+     struct log_record *r;
+     uint64_t dropped, seq, now;
+     static uint64_t reported, stuck_tail, stuck_since;
+     size_t len = 0, n = 0;
+
+     while (1) {
+          r = &ring->slots[ring->tail % LOG_SLOTS];
+
+          if ((seq = atomic_load_explicit(&r->seq, memory_order_acquire)) != ring->tail + 1) {
+
+               /* claimed and not published: wait for it a while, then
+                  take the slot back unless it is published meanwhile */
+
+               if (seq != ring->tail ||
+                   atomic_load_explicit(&ring->head, memory_order_relaxed) == ring->tail) {
+                    break;
+               }
+
+               now = log_now();
+
+               if (stuck_since == 0 || stuck_tail != ring->tail) {
+                    stuck_tail = ring->tail;
+                    stuck_since = now;
+                    break;
+               }
+
+               if (now - stuck_since < LOG_STUCK) {
+                    break;
+               }
+
+               if (!atomic_compare_exchange_strong_explicit(&r->seq, &seq, ring->tail + LOG_SLOTS,
+                                                            memory_order_release,
+                                                            memory_order_relaxed)) {
+                    continue;
+               }
+
+               atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+               ring->tail++;
+               stuck_since = 0;
+               continue;
+          }
+
+          len += format_record(r, batch + len, LOG_BATCH - len);
+          n++;
+
+          atomic_store_explicit(&r->seq, ring->tail + LOG_SLOTS, memory_order_release);
+          ring->tail++;
+
+          if (LOG_BATCH - len < 2048) {
+               write_all(batch, len);
+               len = 0;
+          }
+     }
+
+     dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+     if (dropped != reported && ring->format != LOG_FORMAT_BINARY) {
+          len += snprintf(batch + len, LOG_BATCH - len, "log: %llu records dropped\n",
+                          (unsigned long long) (dropped - reported));
+          reported = dropped;
+     }
+
+     if (len > 0) {
+          write_all(batch, len);
+     }
+
+     return n;
+}
+
+static void *log_main(void *arg)
+{
+     struct timespec nap = { 0, 2000000 };
+     char *batch = malloc(LOG_BATCH);
+
+     if (batch == NULL) {
+          return NULL;
+     }
+
+     while (log_drain(batch) > 0 || !atomic_load(&stopping)) {
+          nanosleep(&nap, NULL);
+     }
+
+     free(batch);
+
+     return NULL;
+}
+
+static void log_forked(void)
+{
+     log_pid = getpid();
+}
+
+/* set up the ring, before any worker starts or forks, and the thread
+   that writes it out to fd */
+void log_init(int fd, int level, int sample, int format)
+{
+     uint64_t i;
+
+     ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (ring == MAP_FAILED) {
+          perror("server: mmap()");
+          exit(1);
+     }
+
+     for (i = 0; i < LOG_SLOTS; i++) {
+          atomic_init(&ring->slots[i].seq, i);
+     }
+
+     log_pid = getpid();
+     pthread_atfork(NULL, NULL, log_forked);
+
+     ring->level = level;
+     ring->sample = sample;
+     ring->format = format;
+     log_fd = fd;
+
+     if (pthread_create(&flusher, NULL, log_main, NULL) != 0) {
+          fprintf(stderr, "server: cannot start the logger\n");
+          exit(1);
+     }
+}
+
+/* write out everything queued so far and stop the logger */
+void log_stop(void)
+{
+     if (ring == NULL) {
+          return;
+     }
+
+     atomic_store(&stopping, 1);
+     pthread_join(flusher, NULL);
+}
+
+/* records dropped because the ring was full */
+uint64_t log_dropped(void)
+{
+     return ring != NULL ? atomic_load_explicit(&ring->dropped, memory_order_relaxed) : 0;
+}
@@ -0,0 +1,111 @@
+#include "tftpserv.h"
+
+/* logging microbenchmark: what a transfer pays to log a request, through
+   log_event() and through the line buffered printf() with inet_ntoa() the
+   server used before, both writing to /dev/null. Events come in bursts a
+   share of the ring long with a pause between them, as transfers log, and
+   only the bursts are timed; a record the flusher could not keep up with
+   would be dropped and counted */
+
+#define EVENTS (200 * BURST)
+#define BURST 1024
+
+static FILE *old_log;
+static struct sockaddr_in client;
+
+static uint64_t bench_ns(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct run {
+     int ring;                       /* log_event(), or printf() */
+     pthread_t thread;
+     uint64_t ns;                    /* spent logging */
+};
+
+static void *run_events(void *arg)
+{
+     struct run *r = arg;
+     struct timespec pause = { 0, 4000000 };
+     uint64_t start;
+     int i, k;
+
+     for (i = 0; i < EVENTS; i += BURST) {
+          start = bench_ns();
+
+          for (k = 0; k < BURST; k++) {
+               if (r->ring) {
+                    log_event(LOG_INFO, LOG_REQUEST, &client, "images/boot/vmlinuz-6.1.0",
+                              "octet", RRQ, 0, 0);
+               } else {
+                    fprintf(old_log, "%s.%u: request received: %s '%s' %s\n",
+                            inet_ntoa(client.sin_addr), ntohs(client.sin_port), "get",
+                            "images/boot/vmlinuz-6.1.0", "octet");
+               }
+          }
+
+          r->ns += bench_ns() - start;
+          nanosleep(&pause, NULL);
+     }
+
+     return NULL;
+}
+
+/* ns per event with n threads logging at once */
+static double run(int ring, int n)
+{
+     struct run runs[4] = { { 0 } };
+     uint64_t ns = 0;
+     int i;
+
+     for (i = 0; i < n; i++) {
+          runs[i].ring = ring;
+          pthread_create(&runs[i].thread, NULL, run_events, &runs[i]);
+     }
+
+     for (i = 0; i < n; i++) {
+          pthread_join(runs[i].thread, NULL);
+          ns += runs[i].ns;
+     }
+
+     return (double) ns / n / EVENTS;
+}
+
+int main(void)
+{
+     int null = open("/dev/null", O_WRONLY), n;
+     double ring, old;
+     uint64_t dropped;
+
+     if (null < 0 || (old_log = fdopen(dup(null), "w")) == NULL) {
+          perror("logbench: /dev/null");
+          return 1;
+     }
+
+     setvbuf(old_log, NULL, _IOLBF, 0);
+     inet_aton("192.168.1.20", &client.sin_addr);
+     client.sin_port = htons(40123);
+
+     log_init(null, LOG_INFO, 1, LOG_FORMAT_TEXT);
+
+     printf("%d events per thread\n", EVENTS);
+     printf("%-8s %12s %12s %12s\n", "threads", "ring ns", "printf ns", "dropped");
+
+     for (n = 1; n <= 4; n *= 2) {
+          dropped = log_dropped();
+          ring = run(1, n);
+          dropped = log_dropped() - dropped;
+          old = run(0, n);
+
+          printf("%-8d %12.1f %12.1f %12llu\n", n, ring, old, (unsigned long long) dropped);
+     }
+
+     log_stop();
+
+     return 0;
+}
@@ -0,0 +1,272 @@
+#include "tftpserv.h"
+
+/* multicast tftp, rfc 2090. A RRQ with the multicast option starts a
+   session that sends every block once, to a multicast group. One client at
+   a time is the master: its acks drive the transfer exactly as in unicast.
+   Clients asking for the same file while it runs join the session and pick
+   up blocks as they go by; when the master has the whole file the next
+   client is promoted and acks what it holds, so the blocks it missed are
+   sent again. Sessions belong to the event loop of one worker thread */
+
+struct mcast_session {
+     struct sockaddr_in group;
+     char *filename;
+     tftp_transfer *t;               /* the transfer sending to the group */
+
+     struct sockaddr_in *clients;    /* in order of arrival, clients[0] is the master */
+     int nclients;
+     int maxclients;
+
+     struct mcast_session *next;
+};
+
+static __thread struct mcast_session *sessions;
+static atomic_uint next_group;
+
+static int mcast_find(struct mcast_session *m, struct sockaddr_in *addr)
+{
+     int i;
+
+     for (i = 0; i < m->nclients; i++) {
+          if (m->clients[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+              m->clients[i].sin_port == addr->sin_port) {
+               break;
+          }
+     }
+
+     return i;
+}
+
+static int mcast_add(struct mcast_session *m, struct sockaddr_in *addr)
+{
+     struct sockaddr_in *c;
+
+     if (m->nclients == m->maxclients) {
+          if ((c = realloc(m->clients, 2 * m->maxclients * sizeof(*c))) == NULL) {
+               return -1;
+          }
+          m->clients = c;
+          m->maxclients *= 2;
+     }
+
+     m->clients[m->nclients++] = *addr;
+
+     return 0;
+}
+
+static void mcast_remove(struct mcast_session *m, int i)
+{
+     memmove(&m->clients[i], &m->clients[i + 1], (m->nclients - i - 1) * sizeof(*m->clients));
+     m->nclients--;
+}
+
+/* append the multicast option, "addr,port,mc", to an oack */
+static ssize_t mcast_option(struct mcast_session *m, char *oack, ssize_t olen, size_t size, int master)
+{
+     char group[INET_ADDRSTRLEN];
+
+     inet_ntop(AF_INET, &m->group.sin_addr, group, sizeof(group));
+     olen += snprintf(oack + olen, size - olen, "multicast%c%s,%u,%d",
+                      '\0', group, ntohs(m->group.sin_port), master) + 1;
+
+     return olen < size ? olen : -1;
+}
+
+static void mcast_log(struct mcast_session *m, struct sockaddr_in *addr, const char *what)
+{
+     log_event(LOG_INFO, LOG_MCAST, addr, what, NULL, m->group.sin_addr.s_addr,
+               ntohs(m->group.sin_port), 0);
+}
+
+/* add the client of t to session m and send it an oack naming the group,
+   from the session's transfer id; t is not run */
+static int mcast_join(struct mcast_session *m, tftp_transfer *t, char *oack, ssize_t olen, size_t size)
+{
+     int i = mcast_find(m, &t->client_sock);
+
+     /* a master repeating its request gets the session's own oack when the
+        retransmission timer fires */
+
+     if (i == 0) {
+          return 1;
+     }
+
+     if ((olen = mcast_option(m, oack, olen, size, 0)) < 0) {
+          send_error(t->s, EOPTNEG, "invalid option", &t->client_sock, t->slen);
+          return -1;
+     }
+
+     if (i == m->nclients && mcast_add(m, &t->client_sock) < 0) {
+          fprintf(stderr, "server: out of memory\n");
+          send_error(t->s, ENOSPACE, "out of memory", &t->client_sock, t->slen);
+          return -1;
+     }
+
+     ((tftp_message *) t->pkt)->opcode = htons(OACK);
+     memcpy(t->pkt + 2, oack, olen);
+
+     if (sendto(m->t->s, t->pkt, 2 + olen, 0, (struct sockaddr *) &t->client_sock, t->slen) < 0) {
+          perror("server: sendto()");
+     }
+
+     mcast_log(m, &t->client_sock, "joined multicast session on");
+
+     return 1;
+}
+
+/* a RRQ carried the multicast option: join the session already sending
+   the file with the same block and window sizes, or start one with t as
+   its transfer. Returns 1 when t joined a session and has nothing left to
+   do, 0 when t is to be run, with the option added to its oack unless it
+   is served by unicast, and -1 on error */
+int mcast_start(tftp_transfer *t, const char *filename, char *oack, ssize_t *olen, size_t size)
+{
+     struct mcast_session *m;
+     unsigned char ttl = MCAST_TTL, loop = 1;
+     ssize_t len;
+
+     /* blocks a promoted master is missing are resent by offset, so the
+        file must be mapped or cached, and block numbers must not wrap */
+
+     if (t->opcode != RRQ || t->map == NULL || t->size / t->blksize + 1 > 65535) {
+          return 0;
+     }
+
+     for (m = sessions; m; m = m->next) {
+          if (strcmp(m->filename, filename) == 0 && m->t->size == t->size &&
+              m->t->blksize == t->blksize && m->t->windowsize == t->windowsize) {
+               return mcast_join(m, t, oack, *olen, size);
+          }
+     }
+
+     if ((m = calloc(1, sizeof(*m))) == NULL ||
+         (m->filename = strdup(filename)) == NULL ||
+         (m->clients = malloc(4 * sizeof(*m->clients))) == NULL) {
+          if (m != NULL) {
+               free(m->filename);
+               free(m);
+          }
+          return 0;
+     }
+
+     m->maxclients = 4;
+     m->group.sin_family = AF_INET;
+     m->group.sin_addr.s_addr = htonl(ntohl(config.mcast_group.s_addr) +
+                                      atomic_fetch_add(&next_group, 1) % MCAST_GROUPS);
+     m->group.sin_port = htons(config.mcast_port);
+
+     if (setsockopt(t->s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+         setsockopt(t->s, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+         (config.mcast_if.s_addr != INADDR_ANY &&
+          setsockopt(t->s, IPPROTO_IP, IP_MULTICAST_IF, &config.mcast_if, sizeof(config.mcast_if)) < 0)) {
+          perror("server: setsockopt()");
+          len = -1;
+     } else {
+          len = mcast_option(m, oack, *olen, size, 1);
+     }
+
+     if (len < 0) {
+          free(m->clients);
+          free(m->filename);
+          free(m);
+          return 0;
+     }
+
+     *olen = len;
+     m->clients[m->nclients++] = t->client_sock;
+     m->t = t;
+     m->next = sessions;
+     sessions = m;
+
+     t->mcast = m;
+     t->data_to = &m->group;
+
+     mcast_log(m, &t->client_sock, "multicast session on");
+
+     return 0;
+}
+
+/* a datagram from a client other than the master. These never ack; an
+   error means the client has given up and leaves the session */
+int mcast_packet(tftp_transfer *t, uint8_t *buf, ssize_t c, struct sockaddr_in *from)
+{
+     struct mcast_session *m = t->mcast;
+     tftp_message *msg = (tftp_message *) buf;
+     int i = mcast_find(m, from);
+     uint16_t code;
+
+     if (i == m->nclients) {
+          send_error(t->s, EBADID, "unknown transfer id", from, sizeof(*from));
+          return TRANSFER_RUNNING;
+     }
+
+     if (c >= 4 && ntohs(msg->opcode) == ERROR) {
+          code = ntohs(msg->error.error_code);
+          worker_count(errors_received[code < ERROR_CODES ? code : EUNDEF]);
+          mcast_log(m, from, "left multicast session on");
+          mcast_remove(m, i);
+          worker_count(failed);
+     }
+
+     return TRANSFER_RUNNING;
+}
+
+/* the master is done with status: promote the next client, which is sent
+   the session's oack with mc set and answers with an ack of the last
+   block it holds in order. Returns status once no client is left */
+int mcast_next(tftp_transfer *t, int status)
+{
+     struct mcast_session *m = t->mcast;
+
+     if (m->nclients == 1) {
+          return status;
+     }
+
+     if (status == TRANSFER_DONE) {
+          worker_count(completed);
+     } else {
+          worker_count(failed);
+     }
+
+     mcast_remove(m, 0);
+     t->client_sock = m->clients[0];
+
+     /* a new client, a new round trip time */
+
+     t->oack_pending = 1;
+     t->countdown = t->cfg->retries;
+     t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+     t->rtt_start = 0;
+
+     if (!t->rto_fixed) {
+          t->srtt = t->rttvar = 0;
+          t->rto = RTO_INIT < t->cfg->rto_max ? RTO_INIT : t->cfg->rto_max;
+     }
+
+     mcast_log(m, &t->client_sock, "multicast master on");
+
+     if (sendto(t->s, t->pkt, t->last_len, 0, (struct sockaddr *) &t->client_sock, t->slen) < 0) {
+          perror("server: sendto()");
+          return TRANSFER_FAILED;
+     }
+
+     t->deadline = now_ms() + t->rto;
+
+     return TRANSFER_RUNNING;
+}
+
+void mcast_end(tftp_transfer *t)
+{
+     struct mcast_session **p;
+
+     for (p = &sessions; *p != t->mcast; p = &(*p)->next)
+          ;
+
+     *p = t->mcast->next;
+
+     free(t->mcast->clients);
+     free(t->mcast->filename);
+     free(t->mcast);
+     t->mcast = NULL;
+     t->data_to = &t->client_sock;
+}
@@ -0,0 +1,214 @@
+#include "tftpserv.h"
+#include <stddef.h>
+#include <limits.h>
+
+/* metrics in the prometheus text format. Transfers count into the stats
+   of their worker with relaxed atomics and never take a lock; the main
+   thread adds up the workers when it writes the metrics out, to a file
+   that is replaced as a whole so a collector never reads half of it */
+
+static const char *error_names[ERROR_CODES] = {
+     "undefined", "not_found", "access_violation", "disk_full", "illegal_operation",
+     "unknown_transfer_id", "file_exists", "no_such_user", "option_negotiation"
+};
+
+/* count value in the first bucket it fits in */
+void metrics_observe(struct histogram *h, uint64_t value)
+{
+     int i = value > 1 ? 64 - __builtin_clzll(value - 1) : 0;
+
+     i = i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+
+     atomic_fetch_add_explicit(&h->bucket[i], 1, memory_order_relaxed);
+     atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+     atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+/* a transfer completed: its duration and throughput */
+void metrics_transfer_done(tftp_transfer *t)
+{
+     uint64_t us = now_us() - t->start_us;
+
+     us = us > 0 ? us : 1;
+
+     worker_observe(duration, us);
+     worker_observe(throughput, t->bytes * 1000000 / us);
+}
+
+static uint64_t load(_Atomic uint64_t *v)
+{
+     return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+/* a counter or gauge, summed over the workers at offset off of their stats */
+static void report_sum(FILE *f, const char *name, const char *type, const char *help, size_t off)
+{
+     uint64_t sum = 0;
+     int i;
+
+     for (i = 0; i < config.workers; i++) {
+          sum += load((_Atomic uint64_t *) ((uint8_t *) worker_stats(i) + off));
+     }
+
+     fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+             (unsigned long long) sum);
+}
+
+/* a single value of the main process */
+static void report_value(FILE *f, const char *name, const char *type, const char *help, double v)
+{
+     fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, v);
+}
+
+static void report_errors(FILE *f, const char *name, const char *help, size_t off)
+{
+     _Atomic uint64_t *errors;
+     uint64_t sum;
+     int code, i;
+
+     fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+     for (code = 0; code < ERROR_CODES; code++) {
+          for (i = 0, sum = 0; i < config.workers; i++) {
+               errors = (_Atomic uint64_t *) ((uint8_t *) worker_stats(i) + off);
+               sum += load(&errors[code]);
+          }
+          fprintf(f, "%s{code=\"%d\",type=\"%s\"} %llu\n", name, code, error_names[code],
+                  (unsigned long long) sum);
+     }
+}
+
+/* a histogram kept in units of 1 / scale, with cumulative buckets as the
+   format wants them; the ones above the largest value seen are left out */
+static void report_histogram(FILE *f, const char *name, const char *help, size_t off, double scale)
+{
+     struct histogram *h;
+     uint64_t buckets[HIST_BUCKETS] = { 0 }, sum = 0, count = 0, cum = 0;
+     int b, i, top = 0;
+
+     for (i = 0; i < config.workers; i++) {
+          h = (struct histogram *) ((uint8_t *) worker_stats(i) + off);
+
+          for (b = 0; b < HIST_BUCKETS; b++) {
+               buckets[b] += load(&h->bucket[b]);
+          }
+          sum += load(&h->sum);
+          count += load(&h->count);
+     }
+
+     for (b = 0; b < HIST_BUCKETS - 1; b++) {
+          top = buckets[b] ? b : top;
+     }
+
+     fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+     for (b = 0; b <= top && b < HIST_BUCKETS - 1; b++) {
+          cum += buckets[b];
+          fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, (double) (1ULL << b) / scale,
+                  (unsigned long long) cum);
+     }
+
+     fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+     fprintf(f, "%s_sum %g\n", name, sum / scale);
+     fprintf(f, "%s_count %llu\n", name, (unsigned long long) count);
+}
+
+#define STAT(field) offsetof(struct worker_stats, field)
+
+void report_metrics(FILE *f)
+{
+     struct settings_stats st;
+
+     report_sum(f, "tftp_requests_total", "counter", "Requests accepted.", STAT(requests));
+     report_sum(f, "tftp_duplicate_requests_total", "counter",
+                "Requests repeated while their transfer was running, dropped.", STAT(duplicates));
+     report_sum(f, "tftp_requests_queued_total", "counter",
+                "Requests that waited for a transfer to end.", STAT(queued));
+     report_sum(f, "tftp_requests_rejected_total", "counter",
+                "Requests turned away with the queue full.", STAT(rejected));
+     report_sum(f, "tftp_requests_denied_total", "counter",
+                "Requests refused by an access rule.", STAT(denied));
+     report_sum(f, "tftp_transfers_completed_total", "counter", "Transfers completed.", STAT(completed));
+     report_sum(f, "tftp_transfers_failed_total", "counter", "Transfers failed.", STAT(failed));
+     report_sum(f, "tftp_transfers_active", "gauge", "Transfers in progress.", STAT(active));
+     report_sum(f, "tftp_bytes_sent_total", "counter",
+                "DATA payload bytes sent, retransmissions included.", STAT(bytes_sent));
+     report_sum(f, "tftp_bytes_received_total", "counter",
+                "DATA payload bytes received.", STAT(bytes_received));
+     report_sum(f, "tftp_retransmits_total", "counter",
+                "Blocks, oacks and acks sent again.", STAT(retransmits));
+     report_sum(f, "tftp_timeouts_total", "counter",
+                "Retransmission timer expirations.", STAT(timeouts));
+     report_sum(f, "tftp_paced_total", "counter",
+                "Sends of DATA held back by a rate limit.", STAT(paced));
+     report_sum(f, "tftp_send_drops_total", "counter",
+                "DATA blocks dropped with the socket buffer full, left to the retransmit timer.",
+                STAT(send_drops));
+     report_sum(f, "tftp_relay_fetches_total", "counter",
+                "Files fetched from the upstream server.", STAT(relay_fetches));
+     report_sum(f, "tftp_relay_joined_total", "counter",
+                "Requests served from a fetch already running.", STAT(relay_joined));
+     report_sum(f, "tftp_relay_failed_total", "counter",
+                "Fetches from the upstream server that failed.", STAT(relay_failed));
+     report_sum(f, "tftp_vfile_hits_total", "counter",
+                "Virtual files taken from the render cache.", STAT(vfile_hits));
+     report_sum(f, "tftp_vfile_renders_total", "counter",
+                "Virtual files rendered from their template.", STAT(vfile_renders));
+     report_sum(f, "tftp_dedup_chunks_stored_total", "counter",
+                "Chunks of uploads new to the deduplicating store.", STAT(dedup_chunks));
+     report_sum(f, "tftp_dedup_chunks_duplicate_total", "counter",
+                "Chunks of uploads the store already had.", STAT(dedup_duplicates));
+     report_sum(f, "tftp_dedup_bytes_stored_total", "counter",
+                "Bytes of uploads written to the store.", STAT(dedup_bytes_stored));
+     report_sum(f, "tftp_dedup_bytes_saved_total", "counter",
+                "Bytes of uploads not written, the store having them.", STAT(dedup_bytes_saved));
+     report_sum(f, "tftp_disk_reads_total", "counter",
+                "RRQ sends and reads from a file.", STAT(disk_reads));
+     report_sum(f, "tftp_disk_stalls_total", "counter",
+                "Disk reads that waited for the disk.", STAT(disk_stalls));
+     report_errors(f, "tftp_errors_sent_total", "ERROR packets sent, by code.", STAT(errors_sent));
+     report_errors(f, "tftp_errors_received_total", "ERROR packets received from clients, by code.",
+                   STAT(errors_received));
+     report_histogram(f, "tftp_transfer_duration_seconds", "Duration of completed transfers.",
+                      STAT(duration), 1e6);
+     report_histogram(f, "tftp_block_rtt_seconds", "Round trip time of timed blocks.",
+                      STAT(rtt), 1e6);
+     report_histogram(f, "tftp_transfer_throughput_bytes_per_second",
+                      "Throughput of completed transfers.", STAT(throughput), 1);
+     report_histogram(f, "tftp_vfile_render_seconds",
+                      "Time to produce a virtual file, rendered or from the cache.",
+                      STAT(vfile_render), 1e9);
+
+     settings_report(&st);
+     report_value(f, "tftp_settings_generation", "gauge",
+                  "Settings in force, counted from 1 and bumped by every reload.", st.generation);
+     report_value(f, "tftp_settings_reloads_total", "counter",
+                  "Reloads of the settings file put in force.", st.reloads);
+     report_value(f, "tftp_settings_reload_failures_total", "counter",
+                  "Reloads of the settings file refused as not valid.", st.failures);
+     report_value(f, "tftp_settings_last_reload_seconds", "gauge",
+                  "Time the last reload took.", st.last_us / 1e6);
+     report_value(f, "tftp_settings_last_reload_success", "gauge",
+                  "Whether the last reload was put in force.", st.last_ok);
+}
+
+/* write the metrics to path through a temporary file renamed over it */
+void write_metrics(const char *path)
+{
+     char tmp[PATH_MAX];
+     FILE *f;
+
+     snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+     if ((f = fopen(tmp, "w")) == NULL) {
+          perror("server: fopen()");
+          return;
+     }
+
+     report_metrics(f);
+
+     if (fclose(f) != 0 || rename(tmp, path) < 0) {
+          perror("server: write_metrics()");
+          unlink(tmp);
+     }
+}
@@ -0,0 +1,219 @@
+#include "tftpserv.h"
+
+/* netascii microbenchmark: the translation in netascii.c, with each
+   scanner the cpu supports, against a byte at a time translation. Text is
+   pushed through a block at a time as a transfer does, and every result
+   is checked against the byte at a time one */
+
+#define TEXT_BYTES (32 << 20)
+#define ROUNDS 3
+
+/* byte at a time reference, same streaming rules as netascii.c */
+static size_t ref_encode(struct netascii *n, const uint8_t *in, size_t *inlen, uint8_t *out, size_t outlen)
+{
+     size_t i = 0, o = 0;
+
+     if (n->pending >= 0 && o < outlen) {
+          out[o++] = n->pending;
+          n->pending = -1;
+     }
+
+     for (; i < *inlen && o < outlen; i++) {
+          if (in[i] == '\n' || in[i] == '\r') {
+               out[o++] = '\r';
+               if (o < outlen) {
+                    out[o++] = in[i] == '\n' ? '\n' : '\0';
+               } else {
+                    n->pending = in[i] == '\n' ? '\n' : '\0';
+               }
+          } else {
+               out[o++] = in[i];
+          }
+     }
+
+     *inlen = i;
+
+     return o;
+}
+
+static size_t ref_decode(struct netascii *n, const uint8_t *in, size_t len, uint8_t *out)
+{
+     size_t i, o = 0;
+
+     for (i = 0; i < len; i++) {
+          if (n->cr) {
+               n->cr = 0;
+               if (in[i] == '\n') {
+                    out[o++] = '\n';
+                    continue;
+               }
+               out[o++] = '\r';
+               if (in[i] == '\0') {
+                    continue;
+               }
+          }
+          if (in[i] == '\r') {
+               n->cr = 1;
+          } else {
+               out[o++] = in[i];
+          }
+     }
+
+     return o;
+}
+
+typedef size_t (*encode_fn)(struct netascii *, const uint8_t *, size_t *, uint8_t *, size_t);
+typedef size_t (*decode_fn)(struct netascii *, const uint8_t *, size_t, uint8_t *);
+
+/* random printable lines of about avg bytes, a few of them ending in CR LF */
+static void make_text(uint8_t *text, size_t size, int avg)
+{
+     size_t i = 0;
+     int len;
+
+     srand(1);
+
+     while (i < size) {
+          for (len = rand() % (2 * avg); len > 0 && i < size; len--) {
+               text[i++] = ' ' + rand() % 95;
+          }
+          if (i < size && rand() % 100 == 0) {
+               text[i++] = '\r';
+          }
+          if (i < size) {
+               text[i++] = '\n';
+          }
+     }
+}
+
+/* encode text block by block into wire; returns its length */
+static size_t run_encode(encode_fn encode, const uint8_t *text, size_t size, uint8_t *wire, size_t blksize)
+{
+     struct netascii n;
+     size_t in, pos = 0, len = 0, blk;
+
+     netascii_reset(&n);
+
+     do {
+          blk = 0;
+          while (blk < blksize && (pos < size || n.pending >= 0)) {
+               in = size - pos < blksize ? size - pos : blksize;
+               blk += encode(&n, text + pos, &in, wire + len + blk, blksize - blk);
+               pos += in;
+          }
+          len += blk;
+     } while (blk == blksize);
+
+     return len;
+}
+
+static size_t run_decode(decode_fn decode, const uint8_t *wire, size_t size, uint8_t *text, size_t blksize)
+{
+     struct netascii n;
+     size_t pos, len = 0, blk;
+
+     netascii_reset(&n);
+
+     for (pos = 0; pos < size; pos += blk) {
+          blk = size - pos < blksize ? size - pos : blksize;
+          len += decode(&n, wire + pos, blk, text + len);
+     }
+
+     return len + netascii_flush(&n, text + len);
+}
+
+static uint64_t bench_us(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double mb_per_s(uint64_t us, size_t bytes)
+{
+     return (double) bytes * ROUNDS / us;
+}
+
+int main(void)
+{
+     static const int avgs[] = { 8, 40, 200 };
+     static const size_t blksizes[] = { 512, 1428, 8192 };
+     static const int isas[] = { NETASCII_SCALAR, NETASCII_SSE2, NETASCII_AVX2 };
+     uint8_t *text = malloc(TEXT_BYTES), *wire = malloc(2 * TEXT_BYTES + 1);
+     uint8_t *ref = malloc(2 * TEXT_BYTES + 1), *back = malloc(TEXT_BYTES + 1);
+     size_t wlen, rlen, blen;
+     const char *name, *prev;
+     uint64_t start, enc, dec;
+     int a, b, i, r;
+
+     if (text == NULL || wire == NULL || ref == NULL || back == NULL) {
+          fprintf(stderr, "nabench: out of memory\n");
+          return 1;
+     }
+
+     printf("%-10s %-8s %8s %12s %12s\n", "line avg", "impl", "blksize", "encode MB/s", "decode MB/s");
+
+     for (a = 0; a < sizeof(avgs) / sizeof(avgs[0]); a++) {
+          make_text(text, TEXT_BYTES, avgs[a]);
+
+          for (b = 0; b < sizeof(blksizes) / sizeof(blksizes[0]); b++) {
+
+               /* the byte at a time version first, as the reference */
+
+               start = bench_us();
+               for (r = 0; r < ROUNDS; r++) {
+                    rlen = run_encode(ref_encode, text, TEXT_BYTES, ref, blksizes[b]);
+               }
+               enc = bench_us() - start;
+
+               start = bench_us();
+               for (r = 0; r < ROUNDS; r++) {
+                    blen = run_decode(ref_decode, ref, rlen, back, blksizes[b]);
+               }
+               dec = bench_us() - start;
+
+               if (blen != TEXT_BYTES || memcmp(back, text, TEXT_BYTES) != 0) {
+                    fprintf(stderr, "nabench: byte at a time round trip differs\n");
+                    return 1;
+               }
+
+               printf("%-10d %-8s %8zu %12.0f %12.0f\n", avgs[a], "bytewise", blksizes[b],
+                      mb_per_s(enc, TEXT_BYTES), mb_per_s(dec, TEXT_BYTES));
+
+               for (i = 0, prev = NULL; i < sizeof(isas) / sizeof(isas[0]); i++) {
+
+                    /* a scanner the cpu lacks falls back to the one before */
+
+                    if (prev != NULL && strcmp(name = netascii_init(isas[i]), prev) == 0) {
+                         continue;
+                    }
+                    prev = name = netascii_init(isas[i]);
+
+                    start = bench_us();
+                    for (r = 0; r < ROUNDS; r++) {
+                         wlen = run_encode(netascii_encode, text, TEXT_BYTES, wire, blksizes[b]);
+                    }
+                    enc = bench_us() - start;
+
+                    start = bench_us();
+                    for (r = 0; r < ROUNDS; r++) {
+                         blen = run_decode(netascii_decode, wire, wlen, back, blksizes[b]);
+                    }
+                    dec = bench_us() - start;
+
+                    if (wlen != rlen || memcmp(wire, ref, rlen) != 0 ||
+                        blen != TEXT_BYTES || memcmp(back, text, TEXT_BYTES) != 0) {
+                         fprintf(stderr, "nabench: %s translation differs from the reference\n", name);
+                         return 1;
+                    }
+
+                    printf("%-10d %-8s %8zu %12.0f %12.0f\n", avgs[a], name, blksizes[b],
+                           mb_per_s(enc, TEXT_BYTES), mb_per_s(dec, TEXT_BYTES));
+               }
+          }
+     }
+
+     return 0;
+}
@@ -0,0 +1,201 @@
+#include "tftpserv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NETASCII_X86
+#endif
+
+/* netascii translation, rfc 1350 and rfc 764: on the wire every line ends
+   with CR LF and a bare CR is sent as CR NUL. Text between line ends is
+   copied as a whole; the line ends themselves are found by scanning 16 or
+   32 bytes at a time where the cpu can, a byte at a time otherwise. Both
+   directions work a block at a time and keep the state of a pair split
+   over a block boundary in struct netascii */
+
+typedef const uint8_t *(*scan_fn)(const uint8_t *p, const uint8_t *end, int lf);
+
+/* first CR, or LF too when lf is set, in p to end; end if there is none */
+static const uint8_t *scan_scalar(const uint8_t *p, const uint8_t *end, int lf)
+{
+     for (; p < end; p++) {
+          if (*p == '\r' || (lf && *p == '\n')) {
+               break;
+          }
+     }
+
+     return p;
+}
+
+#ifdef NETASCII_X86
+
+__attribute__((target("sse2")))
+static const uint8_t *scan_sse2(const uint8_t *p, const uint8_t *end, int lf)
+{
+     __m128i cr = _mm_set1_epi8('\r'), nl = _mm_set1_epi8(lf ? '\n' : '\r'), v;
+     int mask;
+
+     for (; end - p >= 16; p += 16) {
+          v = _mm_loadu_si128((const __m128i *) p);
+          mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, nl)));
+
+          if (mask) {
+               return p + __builtin_ctz(mask);
+          }
+     }
+
+     return scan_scalar(p, end, lf);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_avx2(const uint8_t *p, const uint8_t *end, int lf)
+{
+     __m256i cr = _mm256_set1_epi8('\r'), nl = _mm256_set1_epi8(lf ? '\n' : '\r'), v;
+     unsigned int mask;
+
+     for (; end - p >= 32; p += 32) {
+          v = _mm256_loadu_si256((const __m256i *) p);
+          mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, nl)));
+
+          if (mask) {
+               return p + __builtin_ctz(mask);
+          }
+     }
+
+     return scan_sse2(p, end, lf);
+}
+
+#endif
+
+static scan_fn scan = scan_scalar;
+
+static const char *isa_names[] = { "scalar", "sse2", "avx2" };
+
+/* pick the widest scanner the cpu supports, up to isa; returns its name */
+const char *netascii_init(int isa)
+{
+     int level = NETASCII_SCALAR;
+
+#ifdef NETASCII_X86
+     __builtin_cpu_init();
+
+     if (isa >= NETASCII_AVX2 && __builtin_cpu_supports("avx2")) {
+          scan = scan_avx2;
+          level = NETASCII_AVX2;
+     } else if (isa >= NETASCII_SSE2 && __builtin_cpu_supports("sse2")) {
+          scan = scan_sse2;
+          level = NETASCII_SSE2;
+     } else {
+          scan = scan_scalar;
+     }
+#endif
+
+     return isa_names[level];
+}
+
+void netascii_reset(struct netascii *n)
+{
+     n->pending = -1;
+     n->cr = 0;
+}
+
+/* translate up to *inlen bytes of local text in into at most outlen bytes
+   of netascii in out. Stops when out is full, possibly half way through a
+   pair whose second byte is then kept and sent first next time; *inlen is
+   set to the bytes consumed. Returns the bytes written */
+size_t netascii_encode(struct netascii *n, const uint8_t *in, size_t *inlen, uint8_t *out, size_t outlen)
+{
+     const uint8_t *p = in, *end = in + *inlen, *q;
+     uint8_t *o = out, *oend = out + outlen;
+     size_t run;
+
+     if (n->pending >= 0 && o < oend) {
+          *o++ = n->pending;
+          n->pending = -1;
+     }
+
+     while (p < end && o < oend) {
+          run = end - p < oend - o ? end - p : oend - o;
+          q = scan(p, p + run, 1);
+
+          memcpy(o, p, q - p);
+          o += q - p;
+          p = q;
+
+          if (p == end || o == oend) {
+               break;
+          }
+
+          /* LF becomes CR LF, CR becomes CR NUL */
+
+          *o++ = '\r';
+
+          if (o < oend) {
+               *o++ = *p == '\n' ? '\n' : '\0';
+          } else {
+               n->pending = *p == '\n' ? '\n' : '\0';
+          }
+
+          p++;
+     }
+
+     *inlen = p - in;
+
+     return o - out;
+}
+
+/* translate len bytes of netascii in into local text in out, which has
+   room for len + 1 bytes: a CR that ended the previous block comes out
+   ahead of this one. Returns the bytes written */
+size_t netascii_decode(struct netascii *n, const uint8_t *in, size_t len, uint8_t *out)
+{
+     const uint8_t *p = in, *end = in + len, *q;
+     uint8_t *o = out;
+
+     while (p < end) {
+          if (!n->cr) {
+               q = scan(p, end, 0);
+
+               memcpy(o, p, q - p);
+               o += q - p;
+               p = q;
+
+               if (p == end) {
+                    break;
+               }
+
+               n->cr = 1;
+               p++;
+               continue;
+          }
+
+          /* CR LF is a line end, CR NUL a CR; a CR followed by anything
+             else is kept as it is */
+
+          n->cr = 0;
+
+          if (*p == '\n') {
+               *o++ = '\n';
+               p++;
+          } else if (*p == '\0') {
+               *o++ = '\r';
+               p++;
+          } else {
+               *o++ = '\r';
+          }
+     }
+
+     return o - out;
+}
+
+/* the transfer is over: a CR left over from the last block, if any */
+size_t netascii_flush(struct netascii *n, uint8_t *out)
+{
+     if (!n->cr) {
+          return 0;
+     }
+
+     n->cr = 0;
+     *out = '\r';
+
+     return 1;
+}
@@ -0,0 +1,285 @@
+#include "tftpserv.h"
+
+/* traffic control: DATA is paced to a global rate, a rate per client
+   address and a rate per subnet, and transfers beyond a limit wait in a
+   queue or are turned away. Every limit is shared by all workers and
+   forked children, so the state lives in shared memory and is only
+   touched with atomics.
+
+   A rate is a token bucket kept as a single timestamp, the time at which
+   it would be full again (the generic cell rate algorithm): sending n
+   bytes moves it n / rate later, and a send that would move it further
+   than the burst ahead of now has to wait. A bucket whose timestamp has
+   passed is full and holds no state, so the slot of a client or subnet
+   that went quiet is simply taken over by the next one hashed there */
+
+#define PACE_SLOTS 4096              /* buckets per table, a power of two */
+#define PACE_PROBES 8
+#define PACE_BURST_MS 10             /* burst allowed at each rate, at least two largest blocks */
+
+struct pace_slot {
+     _Atomic uint32_t key;           /* address or subnet plus one, 0 when free */
+     _Atomic uint64_t full_at;       /* in ns */
+};
+
+struct pace_state {
+     _Atomic int running;            /* transfers admitted and not ended */
+     _Atomic uint64_t global;
+     struct pace_slot clients[PACE_SLOTS];
+     struct pace_slot subnets[PACE_SLOTS];
+};
+
+static struct pace_state *pace;
+
+void pace_init(void)
+{
+     pace = mmap(NULL, sizeof(*pace), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (pace == MAP_FAILED) {
+          perror("server: mmap()");
+          exit(1);
+     }
+}
+
+static uint64_t pace_now(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t pace_cost(uint64_t rate, size_t bytes)
+{
+     return bytes * 1000000000ULL / rate;
+}
+
+static uint64_t pace_burst(uint64_t rate)
+{
+     uint64_t burst = rate * PACE_BURST_MS / 1000;
+
+     if (burst < 2 * (4 + MAX_BLKSIZE)) {
+          burst = 2 * (4 + MAX_BLKSIZE);
+     }
+
+     return pace_cost(rate, burst);
+}
+
+/* take bytes from the bucket; 0 if they may go now, otherwise the ns to
+   wait, with nothing taken */
+static uint64_t bucket_take(_Atomic uint64_t *full_at, uint64_t rate, size_t bytes, uint64_t now)
+{
+     uint64_t old = atomic_load_explicit(full_at, memory_order_relaxed), next;
+     uint64_t cost = pace_cost(rate, bytes), burst = pace_burst(rate);
+
+     do {
+          next = (old > now ? old : now) + cost;
+
+          if (next - now > burst) {
+               return next - now - burst;
+          }
+     } while (!atomic_compare_exchange_weak_explicit(full_at, &old, next,
+                                                     memory_order_relaxed, memory_order_relaxed));
+
+     return 0;
+}
+
+static void bucket_return(_Atomic uint64_t *full_at, uint64_t rate, size_t bytes)
+{
+     atomic_fetch_sub_explicit(full_at, pace_cost(rate, bytes), memory_order_relaxed);
+}
+
+/* the bucket of key in table, claiming a free or full slot near its home
+   for it; when all of them are busy the key shares its home slot */
+static _Atomic uint64_t *bucket_find(struct pace_slot *table, uint32_t key, uint64_t now)
+{
+     struct pace_slot *s;
+     uint32_t old;
+     size_t home = (key * 2654435761U) & (PACE_SLOTS - 1), i;
+
+     for (i = 0; i < PACE_PROBES; i++) {
+          s = &table[(home + i) & (PACE_SLOTS - 1)];
+          old = atomic_load_explicit(&s->key, memory_order_relaxed);
+
+          if (old == key) {
+               return &s->full_at;
+          }
+
+          if ((old == 0 || atomic_load_explicit(&s->full_at, memory_order_relaxed) <= now) &&
+              atomic_compare_exchange_strong(&s->key, &old, key)) {
+               return &s->full_at;
+          }
+     }
+
+     return &table[home].full_at;
+}
+
+/* may bytes of DATA for client go out now, under the rates of s? 0 if
+   they may, and are taken from every bucket, otherwise the ns until they
+   can */
+uint64_t pace_take(struct settings *s, struct sockaddr_in *client, size_t bytes)
+{
+     _Atomic uint64_t *client_bucket = NULL, *subnet_bucket;
+     uint32_t addr = ntohl(client->sin_addr.s_addr), mask;
+     uint64_t now, wait;
+
+     if (s->rate_global == 0 && s->rate_client == 0 && s->rate_subnet == 0) {
+          return 0;
+     }
+
+     now = pace_now();
+
+     if (s->rate_global && (wait = bucket_take(&pace->global, s->rate_global, bytes, now))) {
+          return wait;
+     }
+
+     if (s->rate_client) {
+          client_bucket = bucket_find(pace->clients, addr + 1, now);
+
+          if ((wait = bucket_take(client_bucket, s->rate_client, bytes, now))) {
+               client_bucket = NULL;
+               goto refused;
+          }
+     }
+
+     if (s->rate_subnet) {
+          mask = s->subnet_prefix ? ~0U << (32 - s->subnet_prefix) : 0;
+          subnet_bucket = bucket_find(pace->subnets, (addr & mask) + 1, now);
+
+          if ((wait = bucket_take(subnet_bucket, s->rate_subnet, bytes, now))) {
+               goto refused;
+          }
+     }
+
+     return 0;
+
+refused:
+
+     /* the buckets already passed get back what they gave */
+
+     if (s->rate_global) {
+          bucket_return(&pace->global, s->rate_global, bytes);
+     }
+
+     if (client_bucket != NULL) {
+          bucket_return(client_bucket, s->rate_client, bytes);
+     }
+
+     return wait;
+}
+
+/* count a transfer in against the limit in force; 0 when it is full */
+int admit_take(void)
+{
+     struct settings *s = settings_get();
+     int n = atomic_load(&pace->running), max = s->max_transfers;
+
+     settings_put(s);
+
+     do {
+          if (max && n >= max) {
+               return 0;
+          }
+     } while (!atomic_compare_exchange_weak(&pace->running, &n, n + 1));
+
+     return 1;
+}
+
+void admit_release(void)
+{
+     atomic_fetch_sub(&pace->running, 1);
+}
+
+/* the requests a worker holds back until a transfer ends, oldest first */
+int queue_init(struct request_queue *q, int size)
+{
+     q->entries = size > 0 ? calloc(size, sizeof(*q->entries)) : NULL;
+     q->size = q->entries != NULL ? size : 0;
+     q->head = q->count = 0;
+
+     return q->size == size ? 0 : -1;
+}
+
+/* is a request from sock already waiting? */
+int queue_find(struct request_queue *q, struct sockaddr_in *sock)
+{
+     struct queued_request *r;
+     int i;
+
+     for (i = 0; i < q->count; i++) {
+          r = &q->entries[(q->head + i) % q->size];
+
+          if (r->from.sin_addr.s_addr == sock->sin_addr.s_addr && r->from.sin_port == sock->sin_port) {
+               return 1;
+          }
+     }
+
+     return 0;
+}
+
+static int queue_push(struct request_queue *q, tftp_message *m, ssize_t len, struct sockaddr_in *from)
+{
+     struct queued_request *r;
+
+     if (q->count == q->size) {
+          return -1;
+     }
+
+     r = &q->entries[(q->head + q->count++) % q->size];
+     memcpy(&r->m, m, len);
+     r->len = len;
+     r->from = *from;
+     r->since = now_ms();
+
+     return 0;
+}
+
+/* a request beyond the transfer limit waits in q, or is turned away when
+   q is full */
+void queue_hold(struct request_queue *q, int s, tftp_message *m, ssize_t len, struct sockaddr_in *from)
+{
+     if (queue_push(q, m, len, from) == 0) {
+          worker_count(queued);
+          log_event(LOG_DEBUG, LOG_MESSAGE, from, "request queued", NULL, 0, 0, 0);
+          return;
+     }
+
+     worker_count(rejected);
+     log_event(LOG_WARN, LOG_MESSAGE, from, "request rejected, too many transfers", NULL, 0, 0, 0);
+     send_error(s, EUNDEF, "server busy, try again later", from, sizeof(*from));
+}
+
+static void queue_pop(struct request_queue *q)
+{
+     q->head = (q->head + 1) % q->size;
+     q->count--;
+}
+
+/* take the next request that may start now off q, into r; 0 when there
+   is none or the limit is still reached. Requests that waited so long
+   that their client has likely given up are dropped */
+int queue_next(struct request_queue *q, struct queued_request *r)
+{
+     struct queued_request *head;
+
+     while (q->count > 0) {
+          head = &q->entries[q->head];
+
+          if (now_ms() - head->since > QUEUE_TIMEOUT) {
+               queue_pop(q);
+               continue;
+          }
+
+          if (!admit_take()) {
+               return 0;
+          }
+
+          *r = *head;
+          queue_pop(q);
+
+          return 1;
+     }
+
+     return 0;
+}
@@ -0,0 +1,130 @@
+#include "tftpserv.h"
+
+/* read-ahead for RRQ: the kernel is asked to read the part of the file
+   that the next windows will send, well before the sender gets there, so
+   a cold file is read while earlier blocks are in flight rather than when
+   their acks come back. Every send from disk is checked against the page
+   cache first, and counted as a stall when it has to wait for a read */
+
+static long page_size;
+static atomic_int have_nowait = 1;
+
+/* start reading ahead a regular file opened for a RRQ */
+void prefetch_start(tftp_transfer *t)
+{
+     struct stat st;
+     size_t ahead = (size_t) 4 * t->windowsize * t->blksize;
+
+     if (t->fd == NULL || fstat(fileno(t->fd), &st) < 0 || !S_ISREG(st.st_mode)) {
+          return;
+     }
+
+     if (page_size == 0) {
+          page_size = sysconf(_SC_PAGESIZE);
+     }
+
+     t->ra_size = ahead > READAHEAD_BYTES ? ahead : READAHEAD_BYTES;
+     t->ra_end = st.st_size;
+     t->ra_next = 0;
+
+     prefetch_advance(t, 0);
+}
+
+/* the sender has reached offset off: keep a read-ahead window of ra_size
+   bytes beyond it in flight, asking for the next one half way through */
+void prefetch_advance(tftp_transfer *t, uint64_t off)
+{
+     if (t->ra_size == 0 || t->ra_next >= t->ra_end || off + t->ra_size / 2 < t->ra_next) {
+          return;
+     }
+
+     if (t->ra_next < off) {
+          t->ra_next = off;
+     }
+
+     posix_fadvise(fileno(t->fd), t->ra_next, t->ra_size, POSIX_FADV_WILLNEED);
+     t->ra_next += t->ra_size;
+}
+
+/* a send from the mapping is about to copy len bytes at off: count it,
+   and count a stall if any of its pages is not in memory */
+void prefetch_check(tftp_transfer *t, uint64_t off, size_t len)
+{
+     unsigned char vec[256];
+     uint64_t start, end, i, n;
+
+     if (t->ra_size == 0 || t->mapping == NULL || len == 0) {
+          return;
+     }
+
+     worker_count(disk_reads);
+
+     start = off / page_size * page_size;
+     end = off + len < t->size ? off + len : t->size;
+
+     /* a window is a few hundred pages at most, larger ones are sampled
+        from their start */
+
+     n = (end - start + page_size - 1) / page_size;
+     n = n < sizeof(vec) ? n : sizeof(vec);
+
+     if (mincore((uint8_t *) t->mapping + start, n * page_size, vec) < 0) {
+          return;
+     }
+
+     for (i = 0; i < n; i++) {
+          if (!(vec[i] & 1)) {
+               worker_count(disk_stalls);
+               return;
+          }
+     }
+}
+
+/* read the len bytes at off of a file sent without a mapping, counting a
+   stall when they are not all in the page cache yet; files that are not
+   read ahead, pipes and devices among them, are read in sequence instead */
+ssize_t prefetch_read(tftp_transfer *t, void *buf, size_t len, uint64_t off)
+{
+     struct iovec iov;
+     ssize_t c, more;
+
+     if (t->ra_size == 0) {
+          c = fread(buf, 1, len, t->fd);
+          return c < (ssize_t) len && ferror(t->fd) ? -1 : c;
+     }
+
+     prefetch_advance(t, off);
+     worker_count(disk_reads);
+
+     if (atomic_load_explicit(&have_nowait, memory_order_relaxed)) {
+          iov.iov_base = buf;
+          iov.iov_len = len;
+
+          /* all of it, or all there is up to the end of the file, without
+             waiting for the disk */
+
+          if ((c = preadv2(fileno(t->fd), &iov, 1, off, RWF_NOWAIT)) == len ||
+              (c >= 0 && off + c >= t->ra_end)) {
+               return c;
+          }
+
+          if (c >= 0 || errno == EAGAIN) {
+               worker_count(disk_stalls);
+               c = c < 0 ? 0 : c;
+
+               if ((more = pread(fileno(t->fd), (uint8_t *) buf + c, len - c, off + c)) < 0) {
+                    return -1;
+               }
+
+               return c + more;
+          }
+
+          if (errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+               return -1;
+          }
+
+          atomic_store(&have_nowait, 0);
+     }
+
+     return pread(fileno(t->fd), buf, len, off);
+}
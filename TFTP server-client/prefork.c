@@ -0,0 +1,375 @@
+#include "tftpserv.h"
+#include <stddef.h>
+#include <sys/prctl.h>
+
+/* process pool: instead of forking a child per request, a worker starts
+   config.prefork processes up front and hands requests to them. A request
+   goes out as one message on a unix SOCK_SEQPACKET socket pair whose far
+   end all the processes of the worker read, so whichever is idle takes it.
+   Each process serves one transfer at a time, opening and binding the
+   socket of the next one while it waits, and tells the worker when it
+   takes a request and when the transfer has ended, so that the worker
+   forgets its session and gives its admission back.
+
+   The worker counts the requests sent and not taken yet against the idle
+   processes. When a burst leaves requests waiting it starts spare
+   processes, up to PREFORK_MAX, which end after PREFORK_IDLE ms without a
+   request; with all of them busy, a request is turned away at once rather
+   than waiting longer than its client would. A process that dies is
+   replaced, and the session and admission of the request it was serving
+   are released; only a process killed between taking a request and
+   saying so loses them */
+
+/* a request handed to a process, sent only up to the end of the message */
+struct prefork_request {
+     struct sockaddr_in from;
+     uint64_t since;                 /* when it arrived, in ms */
+     tftp_message m;
+};
+
+#define PREFORK_HEADER offsetof(struct prefork_request, m)
+
+/* what a process tells its worker */
+enum prefork_event {
+     PREFORK_TAKEN,                  /* it took the request of from */
+     PREFORK_DONE,                   /* and is done with it */
+     PREFORK_EXIT                    /* a spare leaving, idle */
+};
+
+struct prefork_note {
+     pid_t pid;
+     int event;
+     struct sockaddr_in from;
+};
+
+/* the processes of a worker: config.prefork kept, then the spares */
+struct prefork_pool {
+     pid_t *pids;                    /* 0 in a free slot */
+     int max;
+     int procs;
+     int busy;                       /* serving a request */
+     int pending;                    /* requests sent and not taken yet */
+};
+
+static void prefork_tell(int q, int event, struct sockaddr_in *from)
+{
+     struct prefork_note note = { .pid = getpid(), .event = event };
+
+     if (from != NULL) {
+          note.from = *from;
+     }
+
+     while (send(q, &note, sizeof(note), 0) < 0 && errno == EINTR)
+          ;
+}
+
+/* serve the requests read from q until the worker goes away, or, for a
+   spare, until none came for a while */
+static void prefork_process(int q, int spare)
+{
+     struct pollfd pfd = { .fd = q, .events = POLLIN };
+     struct prefork_request r;
+     ssize_t n;
+
+     while (1) {
+          transfer_prepare();
+
+          if (spare && poll(&pfd, 1, PREFORK_IDLE) == 0) {
+               prefork_tell(q, PREFORK_EXIT, NULL);
+               exit(0);
+          }
+
+          /* a spare woken for a request another process took goes back
+             to waiting */
+
+          if ((n = recv(q, &r, sizeof(r), spare ? MSG_DONTWAIT : 0)) < 0 &&
+              (errno == EINTR || errno == EAGAIN)) {
+               continue;
+          }
+
+          if (n <= (ssize_t) PREFORK_HEADER) {
+               exit(0);
+          }
+
+          prefork_tell(q, PREFORK_TAKEN, &r.from);
+
+          /* a request that waited for a process so long that its client
+             has likely given up is dropped, as from the admission queue */
+
+          if (now_ms() - r.since <= QUEUE_TIMEOUT) {
+               transfer_serve(&r.m, n - PREFORK_HEADER, &r.from, sizeof(r.from));
+          }
+
+          prefork_tell(q, PREFORK_DONE, &r.from);
+     }
+}
+
+/* fork process i of the pool into its slot; it dies with the server */
+static void prefork_spawn(struct prefork_pool *pool, int i, int s, int listener, int q)
+{
+     pid_t parent = getpid(), pid;
+     sigset_t none;
+
+     if ((pid = fork()) == 0) {
+          if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent) {
+               exit(0);
+          }
+
+          /* a SIGHUP for the whole group reloads the settings in the
+             main process, it is not meant to end this one */
+
+          signal(SIGHUP, SIG_IGN);
+          sigemptyset(&none);
+          pthread_sigmask(SIG_SETMASK, &none, NULL);
+          close(s);
+          close(listener);
+          prefork_process(q, i >= config.prefork);
+     }
+
+     if (pid < 0) {
+          perror("server: fork()");
+     }
+
+     if (pool->pids[i] <= 0 && pid > 0) {
+          pool->procs++;
+     } else if (pool->pids[i] > 0 && pid <= 0) {
+          pool->procs--;
+     }
+
+     pool->pids[i] = pid;
+}
+
+/* start spares while more requests wait than processes are idle */
+static void prefork_grow(struct prefork_pool *pool, int s, int listener, int q)
+{
+     int i;
+
+     for (i = config.prefork; i < pool->max && pool->pending > pool->procs - pool->busy; i++) {
+          if (pool->pids[i] <= 0) {
+               log_event(LOG_DEBUG, LOG_MESSAGE, NULL, "process pool busy, starting a spare",
+                         NULL, 0, 0, 0);
+               prefork_spawn(pool, i, s, listener, q);
+          }
+     }
+}
+
+/* the client's transfer is over or lost with its process: forget its
+   session and give its admission back, once */
+static void prefork_release(struct session_table *sessions, struct sockaddr_in *from)
+{
+     if (session_find(sessions, from) != NULL) {
+          session_del(sessions, from);
+          admit_release();
+     }
+}
+
+/* a process that died: what it was serving is released, and one of the
+   kept processes is replaced */
+static void prefork_reap(struct prefork_pool *pool, struct session_table *sessions, int i,
+                         int s, int listener, int q)
+{
+     struct sockaddr_in from = { .sin_family = AF_INET };
+     struct session *e;
+     size_t k;
+
+     for (k = 0; k < sessions->size; k++) {
+          e = &sessions->slots[k];
+
+          if (e->addr != 0 && e->pid == pool->pids[i]) {
+               from.sin_addr.s_addr = e->addr;
+               from.sin_port = e->port;
+               pool->busy--;
+               prefork_release(sessions, &from);
+               break;
+          }
+     }
+
+     if (i < config.prefork) {
+          log_event(LOG_WARN, LOG_MESSAGE, NULL, "pool process gone, starting another", NULL, 0, 0, 0);
+          prefork_spawn(pool, i, s, listener, q);
+     } else {
+          pool->pids[i] = 0;
+          pool->procs--;
+     }
+}
+
+/* account for what a process told the worker */
+static void prefork_heard(struct prefork_pool *pool, struct session_table *sessions, struct prefork_note *n)
+{
+     struct session *e;
+     int i;
+
+     switch (n->event) {
+     case PREFORK_TAKEN:
+          if ((e = session_find(sessions, &n->from)) != NULL && e->pid == 0) {
+               e->pid = n->pid;
+               pool->pending--;
+               pool->busy++;
+          }
+          break;
+
+     case PREFORK_DONE:
+          if ((e = session_find(sessions, &n->from)) != NULL && e->pid == n->pid) {
+               pool->busy--;
+               prefork_release(sessions, &n->from);
+          }
+          break;
+
+     case PREFORK_EXIT:
+          for (i = config.prefork; i < pool->max; i++) {
+               if (pool->pids[i] == n->pid) {
+                    pool->pids[i] = 0;
+                    pool->procs--;
+               }
+          }
+          break;
+     }
+}
+
+/* pass a request admitted against the limit to the pool. It is turned away
+   when no process could take it soon: all of them are busy and the pool
+   cannot grow, or the socket is full */
+static void prefork_dispatch(int s, int listener, struct prefork_pool *pool, struct session_table *sessions,
+                             tftp_message *m, ssize_t len, struct sockaddr_in *from, uint64_t since)
+{
+     struct prefork_request r;
+     struct session *e;
+
+     worker_count(requests);
+
+     r.from = *from;
+     r.since = since;
+     memcpy(&r.m, m, len);
+
+     if (pool->procs == pool->max && pool->pending >= pool->procs - pool->busy) {
+          errno = EBUSY;
+          e = NULL;
+     } else if ((e = session_add(sessions, from)) != NULL &&
+                send(listener, &r, PREFORK_HEADER + len, MSG_DONTWAIT) < 0) {
+          session_del(sessions, from);
+          e = NULL;
+     }
+
+     if (e == NULL) {
+          if (errno != EAGAIN && errno != EBUSY) {
+               perror("server: send()");
+          }
+
+          admit_release();
+          worker_count(rejected);
+          log_event(LOG_WARN, LOG_MESSAGE, from, "request rejected, process pool busy",
+                    NULL, 0, 0, 0);
+          send_error(s, EUNDEF, "server busy, try again later", from, sizeof(*from));
+          return;
+     }
+
+     pool->pending++;
+}
+
+/* read requests from s and hand them to the processes of a pool */
+void prefork_loop(int s)
+{
+     tftp_message messages[RECV_BATCH];
+     struct sockaddr_in from[RECV_BATCH];
+     ssize_t lens[RECV_BATCH];
+     struct session_table sessions;
+     struct request_queue queue;
+     struct queued_request r;
+     struct prefork_pool pool = { 0 };
+     struct prefork_note note;
+     struct pollfd pfd[2];
+     uint64_t check_at;
+     int sv[2], i, n;
+
+     session_init(&sessions);
+     pool.max = config.prefork > PREFORK_MAX ? config.prefork : PREFORK_MAX;
+     pool.pids = calloc(pool.max, sizeof(*pool.pids));
+
+     if (queue_init(&queue, config.queue_len) < 0 || pool.pids == NULL) {
+          fprintf(stderr, "server: out of memory\n");
+          exit(1);
+     }
+
+     if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 || fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) {
+          perror("server: socketpair()");
+          exit(1);
+     }
+
+     for (i = 0; i < config.prefork; i++) {
+          prefork_spawn(&pool, i, s, sv[0], sv[1]);
+     }
+
+     check_at = now_ms() + PREFORK_CHECK;
+
+     pfd[0].fd = s;
+     pfd[0].events = POLLIN;
+     pfd[1].fd = sv[0];
+     pfd[1].events = POLLIN;
+
+     while (1) {
+
+          /* with requests waiting, look for room for them now and then */
+
+          if ((n = poll(pfd, 2, queue.count > 0 ? QUEUE_POLL : PREFORK_CHECK)) < 0) {
+               if (errno != EINTR) {
+                    perror("server: poll()");
+                    exit(1);
+               }
+               continue;
+          }
+
+          /* requests taken, transfers ended and spares gone */
+
+          if (pfd[1].revents & POLLIN) {
+               while (recv(sv[0], &note, sizeof(note), 0) == sizeof(note)) {
+                    prefork_heard(&pool, &sessions, &note);
+               }
+          }
+
+          n = pfd[0].revents & POLLIN ?
+               recv_batch(s, (uint8_t *) messages, sizeof(*messages), RECV_BATCH, from, lens, 0) : 0;
+
+          for (i = 0; i < n; i++) {
+
+               if (!check_request(s, &messages[i], lens[i], &from[i], sizeof(from[i]))) {
+                    continue;
+               }
+
+               if (session_find(&sessions, &from[i]) != NULL || queue_find(&queue, &from[i])) {
+                    worker_count(duplicates);
+                    log_event(LOG_DEBUG, LOG_MESSAGE, &from[i], "duplicate request ignored",
+                              NULL, 0, 0, 0);
+                    continue;
+               }
+
+               if (queue.count > 0 || !admit_take()) {
+                    queue_hold(&queue, s, &messages[i], lens[i], &from[i]);
+                    continue;
+               }
+
+               prefork_dispatch(s, sv[0], &pool, &sessions, &messages[i], lens[i], &from[i], now_ms());
+               prefork_grow(&pool, s, sv[0], sv[1]);
+          }
+
+          while (queue_next(&queue, &r)) {
+               prefork_dispatch(s, sv[0], &pool, &sessions, &r.m, r.len, &r.from, r.since);
+               prefork_grow(&pool, s, sv[0], sv[1]);
+          }
+
+          /* the main thread reaps a process that died, kill() cannot find
+             it from then on */
+
+          if (now_ms() >= check_at) {
+               for (i = 0; i < pool.max; i++) {
+                    if (i < config.prefork && pool.pids[i] <= 0) {
+                         prefork_spawn(&pool, i, s, sv[0], sv[1]);
+                    } else if (pool.pids[i] > 0 && kill(pool.pids[i], 0) < 0 && errno == ESRCH) {
+                         prefork_reap(&pool, &sessions, i, s, sv[0], sv[1]);
+                    }
+               }
+
+               prefork_grow(&pool, s, sv[0], sv[1]);
+               check_at = now_ms() + PREFORK_CHECK;
+          }
+     }
+}
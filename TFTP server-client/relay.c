@@ -0,0 +1,576 @@
+#include "tftpserv.h"
+#include <sys/file.h>
+
+/* relay mode (-U): an octet RRQ for a file missing from the base directory
+   is fetched from an upstream tftp server into the base directory, which
+   is the relay's cache on disk from then on (and the shared file cache,
+   with -m, in memory). Misses are coalesced through the file system, so
+   they are across workers, forked children and pool processes alike: the
+   fetch writes to a hidden partial file next to the destination, which it
+   keeps locked for as long as it runs, and every transfer of the file
+   streams from the partial file as it grows. The partial file is renamed
+   into place when the fetch completes and unlinked when it fails, with
+   the directories made for it that are still empty. One
+   that nobody holds the lock of was left by a fetch that died, and the
+   file is fetched again. Like every other path, these are resolved
+   beneath the base directory: the directory of the destination is opened
+   through the resolver and the files in it are opened, linked and renamed
+   relative to it */
+
+struct relay_fetch {
+     int fd;                         /* the partial file, locked */
+     int dfd;                        /* the directory of both */
+     char *path;                     /* destination, as upstream names it */
+     char *leaf;                     /* its last component */
+     char *partial;                  /* in dfd */
+     int made;                       /* see relay_mkdirs() */
+     struct worker *worker;          /* of the request that started it */
+};
+
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_done = PTHREAD_COND_INITIALIZER;
+static int fetches;                  /* running in this process */
+static atomic_uint relay_serial;
+
+/* the partial file of path: a hidden name in the same directory */
+static char *relay_partial(const char *path)
+{
+     const char *slash = strrchr(path, '/');
+     int n = slash != NULL ? slash + 1 - path : 0;
+     char *partial;
+
+     if (asprintf(&partial, "%.*s.%s.relay", n, path, path + n) < 0) {
+          return NULL;
+     }
+
+     return partial;
+}
+
+/* create the directories leading to path, as upstream has them, each in
+   its parent as the resolver opens it; returns the depth of the first one
+   created, 1 for the top, or 0 when they were all there */
+static int relay_mkdirs(const char *path)
+{
+     const char *leaf;
+     char *p, *dir = strdup(path);
+     int depth = 0, made = 0, dfd;
+
+     if (dir == NULL) {
+          return 0;
+     }
+
+     for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+          *p = '\0';
+          depth++;
+
+          if ((dfd = resolve_dir(dir, &leaf)) >= 0) {
+               if (mkdirat(dfd, leaf, 0777) == 0 && made == 0) {
+                    made = depth;
+               }
+               close(dfd);
+          }
+
+          *p = '/';
+     }
+
+     free(dir);
+
+     return made;
+}
+
+/* remove the directories relay_mkdirs() created for path, from the
+   deepest up to depth made and as far as they are still empty, so that a
+   request for a file upstream does not have leaves no tree behind */
+static void relay_rmdirs(const char *path, int made)
+{
+     const char *leaf;
+     char *p, *dir = strdup(path);
+     int depth = 0, gone, dfd;
+
+     if (dir == NULL || made == 0) {
+          free(dir);
+          return;
+     }
+
+     for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+          depth++;
+     }
+
+     for (; depth >= made; depth--) {
+          *strrchr(dir, '/') = '\0';
+          gone = 0;
+
+          if ((dfd = resolve_dir(dir, &leaf)) >= 0) {
+               gone = unlinkat(dfd, leaf, AT_REMOVEDIR) == 0;
+               close(dfd);
+          }
+
+          if (!gone) {
+               break;
+          }
+     }
+
+     free(dir);
+}
+
+/* send the request or an ack, kept in pkt for retransmission */
+static void relay_send(int s, uint8_t *pkt, size_t len, struct sockaddr_in *to)
+{
+     if (sendto(s, pkt, len, 0, (struct sockaddr *) to, sizeof(*to)) < 0) {
+          perror("server: relay sendto()");
+     }
+}
+
+static size_t relay_ack(uint8_t *pkt, uint64_t block)
+{
+     ((uint16_t *) pkt)[0] = htons(ACK);
+     ((uint16_t *) pkt)[1] = htons((uint16_t) block);
+
+     return 4;
+}
+
+/* the blksize and windowsize upstream granted in its oack, which ends
+   with a NUL */
+static void relay_options(char *opt, char *end, int *blksize, int *windowsize)
+{
+     char *name, *value;
+     long n;
+
+     while (opt < end) {
+          name = opt;
+          value = strchr(name, '\0') + 1;
+
+          if (value >= end) {
+               return;
+          }
+
+          opt = strchr(value, '\0') + 1;
+          n = strtol(value, NULL, 10);
+
+          if (strcasecmp(name, "blksize") == 0 && n >= MIN_BLKSIZE && n <= MAX_BLKSIZE) {
+               *blksize = n;
+          } else if (strcasecmp(name, "windowsize") == 0 && n >= 1 && n <= MAX_WINDOWSIZE) {
+               *windowsize = n;
+          }
+     }
+}
+
+/* fetch f->path from upstream into the partial file, a block at a time in
+   order so that its size is always what can be sent on. Upstream block
+   numbers are taken to wrap around to 0. Returns 0 once the last block is
+   written */
+static int relay_get(struct relay_fetch *f)
+{
+     struct sockaddr_in peer = config.relay_upstream, from;
+     struct pollfd pfd;
+     socklen_t flen;
+     uint8_t buf[4 + MAX_BLKSIZE], pkt[sizeof(tftp_message) + 64];
+     uint64_t expected = 1;
+     size_t len;
+     ssize_t c;
+     int s, blksize = SEGSIZE, windowsize = 1, in_window = 0, gap = 0, have_tid = 0, retries = 0;
+     int status = -1;
+
+     if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+          perror("server: relay socket()");
+          return -1;
+     }
+
+     /* the request asks for large blocks and a window, upstream answers
+        with an oack or, not knowing the options, with block 1 */
+
+     ((uint16_t *) pkt)[0] = htons(RRQ);
+     len = 2;
+     len += snprintf((char *) pkt + len, sizeof(pkt) - len, "%s", f->path) + 1;
+     len += snprintf((char *) pkt + len, sizeof(pkt) - len, "octet") + 1;
+     len += snprintf((char *) pkt + len, sizeof(pkt) - len, "blksize%c%d", '\0', RELAY_BLKSIZE) + 1;
+     len += snprintf((char *) pkt + len, sizeof(pkt) - len, "windowsize%c%d", '\0', RELAY_WINDOWSIZE) + 1;
+
+     relay_send(s, pkt, len, &peer);
+
+     pfd.fd = s;
+     pfd.events = POLLIN;
+
+     while (1) {
+          if ((c = poll(&pfd, 1, RELAY_TIMEOUT)) < 0 && errno == EINTR) {
+               continue;
+          }
+
+          if (c <= 0) {
+               if (c < 0 || ++retries > RECV_RETRIES) {
+                    log_event(LOG_WARN, LOG_MESSAGE, &peer, "upstream timed out", NULL, 0, 0, 0);
+                    break;
+               }
+               relay_send(s, pkt, len, &peer);
+               continue;
+          }
+
+          flen = sizeof(from);
+
+          if ((c = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *) &from, &flen)) < 4) {
+               continue;
+          }
+
+          /* the first reply names upstream's transfer socket */
+
+          if (!have_tid && from.sin_addr.s_addr == peer.sin_addr.s_addr) {
+               peer = from;
+               have_tid = 1;
+          } else if (from.sin_addr.s_addr != peer.sin_addr.s_addr || from.sin_port != peer.sin_port) {
+               continue;
+          }
+
+          switch (ntohs(((uint16_t *) buf)[0])) {
+          case ERROR:
+               buf[c - 1] = '\0';
+               log_event(LOG_WARN, LOG_PEER_ERROR, &peer, (char *) buf + 4, NULL,
+                         ntohs(((uint16_t *) buf)[1]), 0, 0);
+               goto done;
+
+          case OACK:
+               if (expected == 1 && buf[c - 1] == '\0') {
+                    relay_options((char *) buf + 2, (char *) buf + c, &blksize, &windowsize);
+                    retries = 0;
+                    len = relay_ack(pkt, 0);
+                    relay_send(s, pkt, len, &peer);
+               }
+               break;
+
+          case DATA:
+
+               /* out of order: ack the last block in order, once per gap,
+                  for upstream to resend from there */
+
+               if (ntohs(((uint16_t *) buf)[1]) != (uint16_t) expected) {
+                    if (!gap) {
+                         gap = 1;
+                         in_window = 0;
+                         len = relay_ack(pkt, expected - 1);
+                         relay_send(s, pkt, len, &peer);
+                    }
+                    break;
+               }
+
+               if (pwrite(f->fd, buf + 4, c - 4, (expected - 1) * blksize) != c - 4) {
+                    perror("server: relay pwrite()");
+                    goto done;
+               }
+
+               expected++;
+               gap = 0;
+               retries = 0;
+
+               if (c - 4 < blksize) {
+                    len = relay_ack(pkt, expected - 1);
+                    relay_send(s, pkt, len, &peer);
+                    status = 0;
+                    goto done;
+               }
+
+               if (++in_window == windowsize) {
+                    in_window = 0;
+                    len = relay_ack(pkt, expected - 1);
+                    relay_send(s, pkt, len, &peer);
+               }
+               break;
+          }
+     }
+
+done:
+     close(s);
+
+     return status;
+}
+
+static void *relay_main(void *arg)
+{
+     struct relay_fetch *f = arg;
+     int ok;
+
+     current_worker = f->worker;
+
+     ok = relay_get(f) == 0 && renameat(f->dfd, f->partial, f->dfd, f->leaf) == 0;
+
+     if (!ok) {
+          unlinkat(f->dfd, f->partial, 0);
+          relay_rmdirs(f->path, f->made);
+          worker_count(relay_failed);
+     }
+
+     log_event(ok ? LOG_INFO : LOG_WARN, LOG_MESSAGE, &config.relay_upstream,
+               ok ? "relay fetch completed" : "relay fetch failed", NULL, 0, 0, 0);
+
+     /* the lock goes with the descriptor, followers see the end */
+
+     close(f->fd);
+     close(f->dfd);
+     free(f->path);
+     free(f->partial);
+     free(f);
+
+     pthread_mutex_lock(&fetch_lock);
+     fetches--;
+     pthread_cond_broadcast(&fetch_done);
+     pthread_mutex_unlock(&fetch_lock);
+
+     return NULL;
+}
+
+/* start fetching path, leaf in dfd, into partial, which must not exist;
+   returns a descriptor to read it from, or -1 with errno EEXIST when
+   another fetch just started. The partial file only appears under its
+   name locked */
+static int relay_fetch(int dfd, const char *path, const char *leaf, const char *partial, int made)
+{
+     struct relay_fetch *f;
+     pthread_attr_t attr;
+     pthread_t thread;
+     char *tmp = NULL;
+     int fd = -1, e;
+
+     if ((f = calloc(1, sizeof(*f))) == NULL) {
+          return -1;
+     }
+
+     f->fd = -1;
+
+     if ((f->dfd = dup(dfd)) < 0) {
+          free(f);
+          return -1;
+     }
+
+     if ((f->path = strdup(path)) == NULL || (f->leaf = strdup(leaf)) == NULL ||
+         (f->partial = strdup(partial)) == NULL ||
+         asprintf(&tmp, "%s.%d.%u", partial, (int) getpid(), atomic_fetch_add(&relay_serial, 1)) < 0) {
+          tmp = NULL;
+          errno = ENOMEM;
+          goto fail;
+     }
+
+     if ((f->fd = openat(dfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666)) < 0 ||
+         flock(f->fd, LOCK_EX) < 0) {
+          goto fail;
+     }
+
+     if (linkat(dfd, tmp, dfd, partial, 0) < 0) {
+          goto fail;
+     }
+
+     unlinkat(dfd, tmp, 0);
+
+     /* a descriptor of its own, so that the follower's lock checks do
+        not touch the fetch's lock */
+
+     if ((fd = openat(dfd, partial, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+          unlinkat(dfd, partial, 0);
+          goto fail;
+     }
+
+     f->made = made;
+     f->worker = current_worker;
+
+     pthread_mutex_lock(&fetch_lock);
+     fetches++;
+     pthread_mutex_unlock(&fetch_lock);
+
+     pthread_attr_init(&attr);
+     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+     e = pthread_create(&thread, &attr, relay_main, f);
+     pthread_attr_destroy(&attr);
+
+     if (e != 0) {
+          pthread_mutex_lock(&fetch_lock);
+          fetches--;
+          pthread_mutex_unlock(&fetch_lock);
+          unlinkat(dfd, partial, 0);
+          close(fd);
+          fd = -1;
+          errno = e;
+          goto fail;
+     }
+
+     log_event(LOG_INFO, LOG_MESSAGE, &config.relay_upstream, "relay fetch started", NULL, 0, 0, 0);
+     free(tmp);
+
+     return fd;
+
+fail:
+     e = errno;
+
+     if (f->fd >= 0) {
+          close(f->fd);
+          unlinkat(dfd, tmp, 0);
+     }
+
+     close(f->dfd);
+     free(f->path);
+     free(f->leaf);
+     free(f->partial);
+     free(f);
+     free(tmp);
+     errno = e;
+
+     return -1;
+}
+
+/* a RRQ for filename, missing from the base directory: follow the fetch
+   of it already running or start one. Returns 0 with t->fd open on the
+   partial file, or on the file itself if a fetch completed meanwhile, and
+   -1 with errno set otherwise */
+int relay_open(tftp_transfer *t, const char *filename)
+{
+     const char *leaf, *pleaf;
+     char *partial;
+     int dfd, fd = -1, tries, made = 0, e;
+
+     if (config.relay_upstream.sin_port == 0 || t->mode != OCTET ||
+         *filename == '\0' || filename[strlen(filename) - 1] == '/') {
+          errno = ENOENT;
+          return -1;
+     }
+
+     if ((partial = relay_partial(filename)) == NULL) {
+          errno = ENOMEM;
+          return -1;
+     }
+
+     /* the directory is created as upstream has it, beneath the base
+        directory only, and removed again unless a fetch into it starts */
+
+     if ((dfd = resolve_dir(filename, &leaf)) < 0 && errno == ENOENT) {
+          made = relay_mkdirs(filename);
+          dfd = resolve_dir(filename, &leaf);
+     }
+
+     if (dfd < 0) {
+          e = errno;
+          relay_rmdirs(filename, made);
+          free(partial);
+          errno = e;
+          return -1;
+     }
+
+     pleaf = partial + (leaf - filename);
+
+     for (tries = 0; tries < 3; tries++) {
+
+          /* a fetch running holds the lock */
+
+          if ((fd = openat(dfd, pleaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+               if (flock(fd, LOCK_SH | LOCK_NB) < 0) {
+                    worker_count(relay_joined);
+                    break;
+               }
+
+               close(fd);
+               fd = -1;
+               unlinkat(dfd, pleaf, 0);
+               continue;
+          }
+
+          if (errno != ENOENT) {
+               break;
+          }
+
+          /* the file itself, should a fetch have completed meanwhile */
+
+          if ((fd = openat(dfd, leaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) >= 0 || errno != ENOENT) {
+               if (fd >= 0 && (t->fd = fdopen(fd, "r")) == NULL) {
+                    close(fd);
+                    fd = -1;
+               }
+               close(dfd);
+               free(partial);
+               return fd >= 0 ? 0 : -1;
+          }
+
+          if ((fd = relay_fetch(dfd, filename, leaf, pleaf, made)) >= 0) {
+               worker_count(relay_fetches);
+               break;
+          }
+
+          if (errno != EEXIST) {
+               break;
+          }
+     }
+
+     close(dfd);
+
+     if (fd < 0 || (t->fd = fdopen(fd, "r")) == NULL) {
+          e = errno == EEXIST ? EBUSY : errno;
+          if (fd >= 0) {
+               close(fd);
+          } else {
+               relay_rmdirs(filename, made);
+          }
+          free(partial);
+          errno = e;
+          return -1;
+     }
+
+     t->relay = partial;
+
+     return 0;
+}
+
+/* may a transfer following a fetch send the file up to offset end? 1 when
+   the fetch has got that far or completed, 0 while it has not, and -1
+   when it failed or died */
+int relay_ready(tftp_transfer *t, uint64_t end)
+{
+     struct stat st, p;
+     const char *leaf;
+     int fd = fileno(t->fd), dfd, same = 0;
+
+     if (fstat(fd, &st) < 0) {
+          return -1;
+     }
+
+     t->ra_end = st.st_size;
+
+     if ((uint64_t) st.st_size >= end) {
+          return 1;
+     }
+
+     if (flock(fd, LOCK_SH | LOCK_NB) < 0) {
+          return 0;
+     }
+
+     flock(fd, LOCK_UN);
+
+     /* the fetch has ended, a complete file was renamed away from the
+        partial name, maybe with more written since the size above */
+
+     if (fstat(fd, &st) < 0 || st.st_nlink == 0) {
+          return -1;
+     }
+
+     if ((dfd = resolve_dir(t->relay, &leaf)) >= 0) {
+          same = fstatat(dfd, leaf, &p, AT_SYMLINK_NOFOLLOW) == 0 && p.st_ino == st.st_ino &&
+               p.st_dev == st.st_dev;
+          close(dfd);
+     }
+
+     if (same) {
+          return -1;
+     }
+
+     t->ra_end = st.st_size;
+     free(t->relay);
+     t->relay = NULL;
+
+     return 1;
+}
+
+/* fork mode: a child exits only once the fetches it started are done,
+   for the transfers following them elsewhere */
+void relay_wait(void)
+{
+     pthread_mutex_lock(&fetch_lock);
+
+     while (fetches > 0) {
+          pthread_cond_wait(&fetch_done, &fetch_lock);
+     }
+
+     pthread_mutex_unlock(&fetch_lock);
+}
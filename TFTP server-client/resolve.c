@@ -0,0 +1,383 @@
+#include "tftpserv.h"
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+/* files are opened beneath the base directory only. The server holds a
+   descriptor of the base directory from startup and opens every path
+   relative to it, with openat2() and RESOLVE_BENEATH where the kernel has
+   it, so that neither "..", an absolute symlink nor a symlink climbing out
+   of the tree can lead outside of it, whatever the cwd. Without openat2()
+   the path is walked a component at a time with openat() and O_NOFOLLOW,
+   which refuses symlinks altogether.
+
+   With the event loop or a prefork pool, whose threads serve request
+   after request, each thread keeps a small cache of the names it
+   resolved; a child forked per request would only throw it away. Names
+   that do not exist are remembered for a moment, as clients probing for
+   files they might have (pxelinux tries a dozen names for its config)
+   make up much of a request storm, and so are the directories files were
+   found in, kept open, so that the next file from one of them is a single
+   openat() of its last component whatever the depth. An entry only ever
+   outlives what it was made for by RESOLVE_TTL ms, or RESOLVE_NEGATIVE_TTL
+   ms for a name that was missing */
+
+#define RESOLVE_SLOTS 256            /* per thread, a power of two */
+#define RESOLVE_NAMELEN 128          /* longer names are not cached */
+#define RESOLVE_TTL 1000
+#define RESOLVE_NEGATIVE_TTL 200
+
+/* entries without a directory: the name is missing, or its last component
+   is a symlink, which only the full resolution may follow */
+#define RESOLVE_MISSING -1
+#define RESOLVE_SYMLINK -2
+
+struct resolve_entry {
+     char name[RESOLVE_NAMELEN];     /* empty in a free slot */
+     uint32_t hash;
+     int dfd;                        /* the directory opened, or RESOLVE_MISSING or RESOLVE_SYMLINK */
+     uint64_t expires;               /* in ms */
+};
+
+static int base_fd = -1;
+static int use_openat2;
+static int use_cache;
+
+static __thread struct resolve_entry resolve_cache[RESOLVE_SLOTS];
+
+static uint64_t resolve_now(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t resolve_hash(const char *name, size_t len)
+{
+     uint32_t h = 2166136261u;
+
+     while (len-- > 0) {
+          h = (h ^ (uint8_t) *name++) * 16777619u;
+     }
+
+     return h;
+}
+
+static void entry_clear(struct resolve_entry *e)
+{
+     if (e->name[0] != '\0' && e->dfd >= 0) {
+          close(e->dfd);
+     }
+
+     e->name[0] = '\0';
+}
+
+/* the live entry of the first len bytes of name, NULL if there is none */
+static struct resolve_entry *entry_find(const char *name, size_t len, uint32_t h, uint64_t now)
+{
+     struct resolve_entry *e = &resolve_cache[h & (RESOLVE_SLOTS - 1)];
+
+     if (e->name[0] != '\0' && e->hash == h && now < e->expires &&
+         strncmp(e->name, name, len) == 0 && e->name[len] == '\0') {
+          return e;
+     }
+
+     return NULL;
+}
+
+static void entry_set(const char *name, size_t len, uint32_t h, int dfd, uint64_t expires)
+{
+     struct resolve_entry *e = &resolve_cache[h & (RESOLVE_SLOTS - 1)];
+
+     entry_clear(e);
+     memcpy(e->name, name, len);
+     e->name[len] = '\0';
+     e->hash = h;
+     e->dfd = dfd;
+     e->expires = expires;
+}
+
+/* hold dir as the base directory from now on, resolving with mode and
+   caching lookups if cache is set; returns how paths are resolved */
+const char *resolve_init(const char *dir, int mode, int cache)
+{
+     struct open_how how = { .flags = O_PATH | O_CLOEXEC, .resolve = RESOLVE_BENEATH };
+     int i, fd;
+
+     for (i = 0; i < RESOLVE_SLOTS; i++) {
+          entry_clear(&resolve_cache[i]);
+     }
+
+     if (base_fd >= 0) {
+          close(base_fd);
+     }
+
+     if ((base_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+          perror("server: open()");
+          exit(1);
+     }
+
+     use_cache = cache;
+     use_openat2 = 0;
+
+     if (mode == RESOLVER_OPENAT2) {
+          if ((fd = syscall(SYS_openat2, base_fd, ".", &how, sizeof(how))) >= 0) {
+               close(fd);
+               use_openat2 = 1;
+          } else {
+               fprintf(stderr, "server: openat2() not supported, paths are walked instead\n");
+          }
+     }
+
+     return use_openat2 ? "openat2" : "walk";
+}
+
+/* the name of a requested file relative to the base directory: an
+   absolute name must lie under base, and no component may be ".."; NULL
+   when the name is not acceptable */
+const char *resolve_name(const char *name, const char *base)
+{
+     size_t n = strlen(base);
+     const char *p, *e;
+
+     if (name[0] == '/') {
+          while (n > 0 && base[n - 1] == '/') {
+               n--;
+          }
+
+          if (strncmp(name, base, n) != 0 || (name[n] != '/' && name[n] != '\0')) {
+               return NULL;
+          }
+
+          name += n;
+     }
+
+     while (*name == '/') {
+          name++;
+     }
+
+     for (p = name; *p != '\0'; p = *e != '\0' ? e + 1 : e) {
+          e = strchrnul(p, '/');
+
+          if (e - p == 2 && p[0] == '.' && p[1] == '.') {
+               return NULL;
+          }
+     }
+
+     return name;
+}
+
+/* open name beneath dfd, one component after the other */
+static int resolve_walk(int dfd, const char *name, int flags)
+{
+     char part[NAME_MAX + 1];
+     const char *p = name, *e;
+     int fd = dfd, next;
+
+     while (1) {
+          while (*p == '/') {
+               p++;
+          }
+
+          e = strchrnul(p, '/');
+
+          if (e == p) {
+               errno = ENOENT;
+               next = -1;
+          } else if (e - p > NAME_MAX) {
+               errno = ENAMETOOLONG;
+               next = -1;
+          } else if (e - p == 2 && p[0] == '.' && p[1] == '.') {
+               errno = EXDEV;
+               next = -1;
+          } else {
+               memcpy(part, p, e - p);
+               part[e - p] = '\0';
+
+               /* the last component is opened as asked, the others as
+                  directories to go on from */
+
+               while (*e == '/') {
+                    e++;
+               }
+
+               next = openat(fd, part, *e == '\0' ? flags | O_NOFOLLOW | O_CLOEXEC :
+                             O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          }
+
+          if (fd != dfd) {
+               close(fd);
+          }
+
+          if (next < 0 || *e == '\0') {
+               return next;
+          }
+
+          fd = next;
+          p = e;
+     }
+}
+
+/* open name beneath the directory dfd, the way the base directory is
+   resolved; EACCES if it leads out of it */
+int resolve_at(int dfd, const char *name, int flags)
+{
+     struct open_how how = { .flags = flags | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+     int fd;
+
+     fd = use_openat2 ? syscall(SYS_openat2, dfd, name, &how, sizeof(how)) :
+          resolve_walk(dfd, name, flags);
+
+     if (fd < 0 && (errno == EXDEV || errno == ELOOP)) {
+          errno = EACCES;
+     }
+
+     return fd;
+}
+
+/* open name beneath the base directory, EACCES if it leads out of it */
+static int resolve_full(const char *name, int flags)
+{
+     return resolve_at(base_fd, name, flags);
+}
+
+/* open name, relative to the base directory and never outside of it, with
+   flags; -1 with errno set on failure, EACCES for a name leading out of
+   the base directory */
+int resolve_open(const char *name, int flags)
+{
+     struct resolve_entry *e;
+     const char *slash = strrchr(name, '/');
+     char dir[RESOLVE_NAMELEN];
+     size_t len = strlen(name), dlen = 0;
+     uint64_t now;
+     uint32_t h, dh = 0;
+     int fd, dfd;
+
+     if (!use_cache || len >= RESOLVE_NAMELEN) {
+          return resolve_full(name, flags);
+     }
+
+     now = resolve_now();
+     h = resolve_hash(name, len);
+
+     if ((e = entry_find(name, len, h, now)) != NULL && e->dfd == RESOLVE_MISSING) {
+          errno = ENOENT;
+          return -1;
+     }
+
+     if (e != NULL && e->dfd == RESOLVE_SYMLINK) {
+          return resolve_full(name, flags);
+     }
+
+     /* a file in a directory found before is opened from there */
+
+     if (slash != NULL && slash > name && slash[1] != '\0' && strcmp(slash + 1, "..") != 0) {
+          dlen = slash - name;
+          dh = resolve_hash(name, dlen);
+
+          if ((e = entry_find(name, dlen, dh, now)) != NULL && e->dfd >= 0) {
+               if ((fd = openat(e->dfd, slash + 1, flags | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+                    return fd;
+               }
+
+               if (errno == ENOENT) {
+                    entry_set(name, len, h, RESOLVE_MISSING, now + RESOLVE_NEGATIVE_TTL);
+                    errno = ENOENT;
+                    return -1;
+               }
+
+               if (errno != ELOOP) {
+                    return -1;
+               }
+
+               entry_set(name, len, h, RESOLVE_SYMLINK, now + RESOLVE_TTL);
+
+               return resolve_full(name, flags);
+          }
+     }
+
+     if ((fd = resolve_full(name, flags)) < 0) {
+          if (errno == ENOENT) {
+               entry_set(name, len, h, RESOLVE_MISSING, now + RESOLVE_NEGATIVE_TTL);
+               errno = ENOENT;
+          }
+
+          return -1;
+     }
+
+     if (dlen > 0) {
+          memcpy(dir, name, dlen);
+          dir[dlen] = '\0';
+
+          if ((dfd = resolve_full(dir, O_PATH | O_DIRECTORY)) >= 0) {
+               entry_set(dir, dlen, dh, dfd, now + RESOLVE_TTL);
+          }
+     }
+
+     return fd;
+}
+
+/* open the directory name is in, as a directory that can be synced, and
+   point leaf to the last component of name */
+int resolve_dir(const char *name, const char **leaf)
+{
+     const char *slash = strrchr(name, '/');
+     char dir[PATH_MAX];
+
+     *leaf = slash != NULL ? slash + 1 : name;
+
+     if (slash == NULL) {
+          return openat(base_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     }
+
+     if (slash - name >= PATH_MAX) {
+          errno = ENAMETOOLONG;
+          return -1;
+     }
+
+     memcpy(dir, name, slash - name);
+     dir[slash - name] = '\0';
+
+     return resolve_full(dir, O_RDONLY | O_DIRECTORY);
+}
+
+/* forget what the cache of this thread knows of name, which the thread is
+   about to create */
+void resolve_forget(const char *name)
+{
+     struct resolve_entry *e;
+     size_t len = strlen(name);
+     uint32_t h;
+
+     if (!use_cache || len >= RESOLVE_NAMELEN) {
+          return;
+     }
+
+     h = resolve_hash(name, len);
+
+     if ((e = entry_find(name, len, h, 0)) != NULL) {
+          entry_clear(e);
+     }
+}
+
+/* a stdio stream of name opened for reading, see resolve_open() */
+FILE *resolve_fopen(const char *name)
+{
+     FILE *f;
+     int fd, e;
+
+     if ((fd = resolve_open(name, O_RDONLY)) < 0) {
+          return NULL;
+     }
+
+     if ((f = fdopen(fd, "r")) == NULL) {
+          e = errno;
+          close(fd);
+          errno = e;
+     }
+
+     return f;
+}
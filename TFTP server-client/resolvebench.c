@@ -0,0 +1,252 @@
+#include "tftpserv.h"
+#include <stdarg.h>
+
+/* path resolution microbenchmark: what opening a requested file costs,
+   with the string checks and fopen() relative to the cwd the server used
+   before, and through resolve.c with openat2() or a walk of the path, each
+   with and without the lookup cache. Two request storms run over the same
+   small tree: pxe, many clients booting at once, each probing pxelinux.cfg
+   for its mac, uuid and address before it takes the default config and
+   its kernel, most of which are missing; and hot, a handful of popular
+   files and misses asked for over and over. Every open is timed alone, the
+   counts of files found must match */
+
+#define CLIENTS 512
+#define ROUNDS 20
+#define HOT_OPENS (CLIENTS * 14)
+
+static const char *files[] = {
+     "pxelinux.0", "ldlinux.c32", "pxelinux.cfg/default", "boot/x86_64/vmlinuz",
+     "boot/x86_64/initrd.img", "images/rescue/efi/grubx64.efi"
+};
+
+#define FILES (sizeof(files) / sizeof(files[0]))
+
+static const char *dirs[] = {
+     "pxelinux.cfg", "boot", "boot/x86_64", "images", "images/rescue", "images/rescue/efi"
+};
+
+#define DIRS (sizeof(dirs) / sizeof(dirs[0]))
+
+static const char *hot[] = {
+     "pxelinux.0", "ldlinux.c32", "pxelinux.cfg/default", "boot/x86_64/vmlinuz",
+     "boot/x86_64/initrd.img", "images/rescue/efi/grubx64.efi", "pxelinux.cfg/C0A8",
+     "pxelinux.cfg/C0A80", "pxelinux.cfg/C", "menu.c32"
+};
+
+#define HOT (sizeof(hot) / sizeof(hot[0]))
+
+enum variant {
+     OLD,                            /* string checks, fopen() from the cwd */
+     OPENAT2,
+     WALK
+};
+
+static char **names;
+static int nnames;
+static uint64_t *samples;
+
+static uint64_t bench_ns(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_name(const char *fmt, ...)
+{
+     va_list ap;
+
+     va_start(ap, fmt);
+
+     if (vasprintf(&names[nnames++], fmt, ap) < 0) {
+          exit(1);
+     }
+
+     va_end(ap);
+}
+
+/* each client in turn asks for its next name, as pxelinux does */
+static void pxe_storm(void)
+{
+     int c, step, k;
+     uint32_t addr;
+
+     for (step = 0; step < 14; step++) {
+          for (c = 0; c < CLIENTS; c++) {
+               addr = 0xc0a80000 + 10 + c;
+
+               if (step == 0) {
+                    add_name("pxelinux.0");
+               } else if (step == 1) {
+                    add_name("pxelinux.cfg/%08x-1c2d-4e5f-8a9b-%012x", 0x4c4c4544 + c, c);
+               } else if (step == 2) {
+                    add_name("pxelinux.cfg/01-52-54-00-%02x-%02x-%02x", c >> 16, (c >> 8) & 0xff,
+                             c & 0xff);
+               } else if (step < 11) {
+                    k = 8 - (step - 3);
+                    add_name("pxelinux.cfg/%.*X", k, addr);
+               } else if (step == 11) {
+                    add_name("pxelinux.cfg/default");
+               } else if (step == 12) {
+                    add_name("boot/x86_64/vmlinuz");
+               } else {
+                    add_name("boot/x86_64/initrd.img");
+               }
+          }
+     }
+}
+
+static void hot_storm(void)
+{
+     int i;
+
+     for (i = 0; i < HOT_OPENS; i++) {
+          add_name("%s", hot[(i * 7) % HOT]);
+     }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+     uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+     return x < y ? -1 : x > y;
+}
+
+/* open and close every name ROUNDS times; returns the files found */
+static int run(int variant, const char *base)
+{
+     const char *name;
+     uint64_t start;
+     FILE *f;
+     int found = 0, r, i;
+
+     for (r = 0; r < ROUNDS; r++) {
+          for (i = 0; i < nnames; i++) {
+               name = names[i];
+               start = bench_ns();
+
+               if (variant == OLD) {
+                    if (strncmp(name, "../", 3) == 0 || strstr(name, "/../") != NULL ||
+                        (name[0] == '/' && strncmp(name, base, strlen(base)) != 0)) {
+                         f = NULL;
+                    } else {
+                         f = fopen(name, "r");
+                    }
+               } else {
+                    f = (name = resolve_name(name, base)) != NULL ? resolve_fopen(name) : NULL;
+               }
+
+               if (f != NULL) {
+                    fclose(f);
+                    found++;
+               }
+
+               samples[r * nnames + i] = bench_ns() - start;
+          }
+     }
+
+     return found / ROUNDS;
+}
+
+static void report(const char *storm, const char *impl, int found)
+{
+     size_t n = (size_t) ROUNDS * nnames, i;
+     uint64_t sum = 0;
+
+     for (i = 0; i < n; i++) {
+          sum += samples[i];
+     }
+
+     qsort(samples, n, sizeof(*samples), cmp_u64);
+
+     printf("%-6s %-16s %6d %10.0f %10llu %10llu\n", storm, impl, found, (double) sum / n,
+            (unsigned long long) samples[n / 2], (unsigned long long) samples[n * 99 / 100]);
+}
+
+static void storm(const char *label, void (*fill)(void), const char *base)
+{
+     static const struct {
+          const char *impl;
+          int variant, cache;
+     } runs[] = {
+          { "fopen (before)", OLD, 0 },
+          { "openat2", OPENAT2, 0 },
+          { "openat2+cache", OPENAT2, 1 },
+          { "walk", WALK, 0 },
+          { "walk+cache", WALK, 1 }
+     };
+     const char *used;
+     int found, expect = -1, i;
+
+     nnames = 0;
+     fill();
+
+     for (i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i++) {
+          used = resolve_init(base, runs[i].variant == WALK ? RESOLVER_WALK : RESOLVER_OPENAT2,
+                              runs[i].cache);
+
+          if (runs[i].variant == OPENAT2 && strcmp(used, "openat2") != 0) {
+               continue;
+          }
+
+          found = run(runs[i].variant, base);
+          report(label, runs[i].impl, found);
+
+          if (expect >= 0 && found != expect) {
+               fprintf(stderr, "resolvebench: %d files found, %d before\n", found, expect);
+               exit(1);
+          }
+
+          expect = found;
+     }
+
+     for (i = 0; i < nnames; i++) {
+          free(names[i]);
+     }
+}
+
+int main(void)
+{
+     char base[] = "/tmp/resolvebench.XXXXXX";
+     size_t i;
+     int fd;
+
+     names = malloc(CLIENTS * 14 * sizeof(*names));
+     samples = malloc((size_t) ROUNDS * CLIENTS * 14 * sizeof(*samples));
+
+     if (names == NULL || samples == NULL || mkdtemp(base) == NULL || chdir(base) < 0) {
+          fprintf(stderr, "resolvebench: cannot set up %s\n", base);
+          return 1;
+     }
+
+     for (i = 0; i < DIRS; i++) {
+          mkdir(dirs[i], 0755);
+     }
+
+     for (i = 0; i < FILES; i++) {
+          if ((fd = open(files[i], O_WRONLY | O_CREAT, 0644)) >= 0) {
+               close(fd);
+          }
+     }
+
+     printf("%d opens per run, each timed, %d rounds\n", CLIENTS * 14, ROUNDS);
+     printf("%-6s %-16s %6s %10s %10s %10s\n", "storm", "impl", "found", "mean ns", "p50 ns", "p99 ns");
+
+     storm("pxe", pxe_storm, base);
+     storm("hot", hot_storm, base);
+
+     for (i = 0; i < FILES; i++) {
+          unlink(files[i]);
+     }
+
+     for (i = DIRS; i > 0; i--) {
+          rmdir(dirs[i - 1]);
+     }
+
+     rmdir(base);
+
+     return 0;
+}
@@ -1,24 +1,250 @@
 #include "tftpserv.h"
+#include <limits.h>
+ 
+static const char *log_levels[] = { "error", "warn", "info", "debug" };
+
+static void usage(char *prog)
+{
+     printf("usage:\n\t%s [-e] [-w workers] [-c] [-t min rto] [-T max rto] [-m cache mb] [-M group:port] [-i address] [-F fsync] [-P metrics file] [-L level] [-S n] [-O format] [-B rate] [-C rate] [-N rate/prefix] [-A transfers] [-Q requests] [-p processes] [-R 0|1] [-U host:port] [-V table] [-D store] [-f settings] [base directory] [port]\n", prog);
+     printf("\t-e\tserve all transfers from one process with an event loop\n");
+     printf("\t-w\tnumber of worker threads, each with its own SO_REUSEPORT socket\n");
+     printf("\t-c\tpin each worker to its own cpu\n");
+     printf("\t-t\tlower bound of the retransmission timeout, in ms (default %d)\n", RTO_MIN);
+     printf("\t-T\tupper bound of the retransmission timeout, in ms (default %d)\n", RTO_MAX);
+     printf("\t-m\tsize of the shared in-memory file cache, in MB (default 0, disabled)\n");
+     printf("\t-M\tserve the rfc 2090 multicast option from this group on, needs -e\n");
+     printf("\t-i\taddress of the interface multicast is sent from\n");
+     printf("\t-F\twhen uploads are synced: none, commit (default) or every given MB\n");
+     printf("\t-P\twrite metrics in the prometheus text format to this file every second\n");
+     printf("\t-L\tlog level: error, warn, info (default) or debug\n");
+     printf("\t-S\tlog only one in this many requests and completed transfers\n");
+     printf("\t-O\tlog format: text (default), json or binary\n");
+     printf("\t-B\tlimit the rate DATA is sent at, in bytes per second with an optional K, M or G\n");
+     printf("\t-C\tlimit it per client address\n");
+     printf("\t-N\tlimit it per subnet, /24 unless the prefix length is given\n");
+     printf("\t-A\tmost transfers at once, the next requests wait (default no limit)\n");
+     printf("\t-Q\trequests each worker holds waiting before it turns them away (default %d)\n",
+            config.queue_len);
+     printf("\t-p\tkeep this many processes per worker ready to serve requests, instead of a fork each\n");
+     printf("\t-R\tblock number after 65535 for clients that do not negotiate it, 0 (default) or 1\n");
+     printf("\t-U\trelay mode: fetch files missing here from this server, and keep them\n");
+     printf("\t-V\ttable of virtual files, rendered per client from templates and host tables\n");
+     printf("\t-D\tkeep uploads as manifests of chunks in this deduplicating store\n");
+     printf("\t-f\tsettings file applied over the options above, read again on SIGHUP\n");
+     exit(1);
+}
  
 int main(int argc, char *argv[])
 {
-     int s;
      uint16_t port = 0;
-     struct protoent *pp;
-     struct servent *ss;
+     struct servent *ss = NULL;
      struct sockaddr_in server_sock;
+     sigset_t sigs;
+     struct timespec wait = { 1, 0 };
+     struct settings *cfg;
+     siginfo_t child;
+     uint64_t next_metrics = 0;
+     int opt, sig, status, i;
+     char *prog = argv[0], *p, cwd[PATH_MAX];
  
-     if (argc < 2) {
-          printf("usage:\n\t%s [base directory] [port]\n", argv[0]);
+     while ((opt = getopt(argc, argv, "ew:ct:T:m:M:i:F:P:L:S:O:B:C:N:A:Q:p:R:U:V:D:f:")) != -1) {
+          switch (opt) {
+          case 'e':
+               config.event_mode = 1;
+               break;
+          case 'w':
+               if ((config.workers = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'c':
+               config.pin_cpus = 1;
+               break;
+          case 't':
+               if ((config.rto_min = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'T':
+               if ((config.rto_max = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'm':
+               if ((config.cache_mb = atoi(optarg)) < 0) {
+                    usage(prog);
+               }
+               break;
+          case 'M':
+               if ((p = strchr(optarg, ':')) == NULL) {
+                    usage(prog);
+               }
+               *p = '\0';
+               if (inet_aton(optarg, &config.mcast_group) == 0 ||
+                   !IN_MULTICAST(ntohl(config.mcast_group.s_addr)) ||
+                   (config.mcast_port = atoi(p + 1)) < 1 || config.mcast_port > 65535) {
+                    usage(prog);
+               }
+               break;
+          case 'i':
+               if (inet_aton(optarg, &config.mcast_if) == 0) {
+                    usage(prog);
+               }
+               break;
+          case 'F':
+               if (strcmp(optarg, "none") == 0) {
+                    config.fsync_policy = FSYNC_NONE;
+               } else if (strcmp(optarg, "commit") == 0) {
+                    config.fsync_policy = FSYNC_COMMIT;
+               } else if ((config.fsync_mb = atoi(optarg)) > 0) {
+                    config.fsync_policy = FSYNC_PERIODIC;
+               } else {
+                    usage(prog);
+               }
+               break;
+          case 'P':
+
+               /* the server changes to the base directory below */
+
+               if (optarg[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+                    if (asprintf(&config.metrics_path, "%s/%s", cwd, optarg) < 0) {
+                         exit(1);
+                    }
+               } else {
+                    config.metrics_path = optarg;
+               }
+               break;
+          case 'L':
+               for (i = 0; i < 4 && strcmp(optarg, log_levels[i]) != 0; i++)
+                    ;
+               if (i == 4) {
+                    usage(prog);
+               }
+               config.log_level = i;
+               break;
+          case 'S':
+               if ((config.log_sample = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'O':
+               if (strcmp(optarg, "text") == 0) {
+                    config.log_format = LOG_FORMAT_TEXT;
+               } else if (strcmp(optarg, "json") == 0) {
+                    config.log_format = LOG_FORMAT_JSON;
+               } else if (strcmp(optarg, "binary") == 0) {
+                    config.log_format = LOG_FORMAT_BINARY;
+               } else {
+                    usage(prog);
+               }
+               break;
+          case 'B':
+               if ((config.rate_global = parse_rate(optarg, &p)) == 0 || *p != '\0') {
+                    usage(prog);
+               }
+               break;
+          case 'C':
+               if ((config.rate_client = parse_rate(optarg, &p)) == 0 || *p != '\0') {
+                    usage(prog);
+               }
+               break;
+          case 'N':
+               if ((config.rate_subnet = parse_rate(optarg, &p)) == 0 ||
+                   (*p == '/' && ((config.subnet_prefix = atoi(p + 1)) < 0 || config.subnet_prefix > 32)) ||
+                   (*p != '/' && *p != '\0')) {
+                    usage(prog);
+               }
+               break;
+          case 'A':
+               if ((config.max_transfers = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'Q':
+               if ((config.queue_len = atoi(optarg)) < 0) {
+                    usage(prog);
+               }
+               break;
+          case 'p':
+               if ((config.prefork = atoi(optarg)) < 1) {
+                    usage(prog);
+               }
+               break;
+          case 'R':
+               if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0) {
+                    usage(prog);
+               }
+               config.rollover = optarg[0] - '0';
+               break;
+          case 'U':
+               if ((p = strchr(optarg, ':')) == NULL) {
+                    usage(prog);
+               }
+               *p = '\0';
+               config.relay_upstream.sin_family = AF_INET;
+               if (inet_aton(optarg, &config.relay_upstream.sin_addr) == 0 ||
+                   (i = atoi(p + 1)) < 1 || i > 65535) {
+                    usage(prog);
+               }
+               config.relay_upstream.sin_port = htons(i);
+               break;
+          case 'V':
+               config.vfile_table = optarg;
+               break;
+          case 'D':
+               config.dedup_store = optarg;
+               break;
+          case 'f':
+               config.settings_file = optarg;
+               break;
+          default:
+               usage(prog);
+          }
+     }
+ 
+     if (config.rto_min > config.rto_max) {
+          fprintf(stderr, "error: minimum rto above maximum\n");
           exit(1);
      }
  
+     if (config.mcast_group.s_addr != INADDR_ANY && !config.event_mode) {
+          fprintf(stderr, "error: multicast needs the event loop (-e)\n");
+          exit(1);
+     }
+
+     if (config.prefork > 0 && config.event_mode) {
+          fprintf(stderr, "error: the process pool (-p) replaces forking, it does not go with -e\n");
+          exit(1);
+     }
+
+     argc -= optind - 1;
+     argv += optind - 1;
+ 
+     if (argc < 2) {
+          usage(prog);
+     }
+ 
      base_directory = argv[1];
  
+     /* line buffered so forked children don't repeat pending output */
+     setvbuf(stdout, NULL, _IOLBF, 0);
+ 
+     /* a relative -V table, -D store or -f file is found from where the
+        server was started */
+
+     settings_init(config.settings_file);
+     vfile_init(config.vfile_table);
+     dedup_init(config.dedup_store);
+
      if (chdir(base_directory) < 0) {
           perror("server: chdir()");
           exit(1);
      }
+
+     /* a forked child would throw the lookup cache away with every
+        request, it is only kept by processes that live on */
+
+     resolve_init(".", RESOLVER_OPENAT2, config.event_mode || config.prefork > 0);
  
      if (argc > 2) {
           if (sscanf(argv[2], "%hu", &port)) {
@@ -35,72 +261,84 @@ int main(int argc, char *argv[])
  
      }
  
-     if ((pp = getprotobyname("udp")) == 0) {
-          fprintf(stderr, "server: getprotobyname() error\n");
-          exit(1);
-     }
- 
-     if ((s = socket(AF_INET, SOCK_DGRAM, pp->p_proto)) == -1) {
-          perror("server: socket() error");
-          exit(1);
-     }
- 
      server_sock.sin_family = AF_INET;
      server_sock.sin_addr.s_addr = htonl(INADDR_ANY);
      server_sock.sin_port = port ? port : ss->s_port;
  
-     if (bind(s, (struct sockaddr *) &server_sock, sizeof(server_sock)) == -1) {
-          perror("server: bind()");
-          close(s);
-          exit(1);
-     }
+     /* workers inherit this mask, signals are only taken by sigwait() below */
+ 
+     sigemptyset(&sigs);
+     sigaddset(&sigs, SIGCHLD);
+     sigaddset(&sigs, SIGUSR1);
+     sigaddset(&sigs, SIGHUP);
+     sigaddset(&sigs, SIGINT);
+     sigaddset(&sigs, SIGTERM);
+     pthread_sigmask(SIG_BLOCK, &sigs, NULL);
  
-     signal(SIGCLD, (void *) cld_handlertf) ;
+     /* the logger's thread takes the same mask, and its ring must exist
+        before a worker forks */
+
+     log_init(STDOUT_FILENO, config.log_level, config.log_sample, config.log_format);
+     pace_init();
+     cfg = settings_get();
+     netascii_init(NETASCII_AVX2);
+     cache_init((size_t) cfg->cache_mb << 20);
+     settings_put(cfg);
+     start_workers(&server_sock);
  
      printf("tftp server: listening on %d\n", ntohs(server_sock.sin_port));
  
      while (1) {
-          struct sockaddr_in client_sock;
-          socklen_t slen = sizeof(client_sock);
-          ssize_t len;
- 
-          tftp_message message;
-          uint16_t opcode;
- 
-          if ((len = recv_message(s, &message, &client_sock, &slen)) < 0) {
-               continue;
-          }
- 
-          if (len < 4) { 
-               printf("%s.%u: request with invalid size received\n",
-                      inet_ntoa(client_sock.sin_addr), ntohs(client_sock.sin_port));
-               send_error(s, 0, "invalid request size", &client_sock, slen);
+
+          /* with metrics to write, wake up at least once a second */
+
+          if (config.metrics_path != NULL) {
+               sig = sigtimedwait(&sigs, NULL, &wait);
+
+               if (now_ms() >= next_metrics) {
+                    write_metrics(config.metrics_path);
+                    next_metrics = now_ms() + 1000;
+               }
+
+               if (sig < 0) {
+                    continue;
+               }
+          } else if (sigwait(&sigs, &sig) != 0) {
                continue;
           }
  
-          opcode = ntohs(message.opcode);
- 
-          if (opcode == RRQ || opcode == WRQ) {
- 
-               /* spawn a child process to handle the request */
- 
-               if (fork() == 0) {
-                    handle_request(&message, len, &client_sock, slen);
-                    exit(0);
+          if (sig == SIGCHLD) {
+
+               /* each child served a transfer admitted by its worker;
+                  a process of a pool gives its place back after each one.
+                  The cache pins a child held are released while it is
+                  still a zombie, before its pid can be reused */
+
+               while ((child.si_pid = 0, waitid(P_ALL, 0, &child, WEXITED | WNOHANG | WNOWAIT)) == 0 &&
+                      child.si_pid != 0) {
+                    cache_reap(child.si_pid);
+                    waitpid(child.si_pid, &status, 0);
+
+                    if (config.prefork == 0) {
+                         admit_release();
+                    }
                }
- 
-          }
- 
-          else {
-               printf("%s.%u: invalid request received: opcode \n", 
-                      inet_ntoa(client_sock.sin_addr), ntohs(client_sock.sin_port),
-                      opcode);
-               send_error(s, 0, "invalid opcode", &client_sock, slen);
+          } else if (sig == SIGHUP) {
+               settings_reload();
+          } else if (sig == SIGUSR1) {
+               report_workers(stdout);
+               report_cache(stdout);
+          } else {
+               log_stop();
+               report_workers(stdout);
+               report_cache(stdout);
+               if (config.metrics_path != NULL) {
+                    write_metrics(config.metrics_path);
+               }
+               break;
           }
  
      }
  
-     close(s);
- 
      return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,154 @@
+#include "tftpserv.h"
+
+/* the clients a worker is serving, by address and port. A client that
+   repeats its request because our first reply is slow to arrive finds
+   its tuple here and the repeat is dropped, instead of starting a second
+   transfer of the same file to it. Open addressing with linear probing,
+   deletion shifts the entries after a freed slot back, so a lookup stops
+   at the first free slot */
+
+#define SESSIONS_INIT 256
+
+static size_t session_hash(uint32_t addr, uint16_t port)
+{
+     uint64_t k = ((uint64_t) addr << 16 | port) * 0x9e3779b97f4a7c15ULL;
+
+     return k >> 32;
+}
+
+void session_init(struct session_table *st)
+{
+     st->slots = calloc(SESSIONS_INIT, sizeof(*st->slots));
+     st->size = st->slots != NULL ? SESSIONS_INIT : 0;
+     st->count = 0;
+     st->sweep_at = SESSIONS_INIT / 4;
+}
+
+/* the slot of addr:port, or the free one it would go in */
+static struct session *session_slot(struct session_table *st, uint32_t addr, uint16_t port)
+{
+     size_t i = session_hash(addr, port) & (st->size - 1);
+
+     while (st->slots[i].addr != 0 && (st->slots[i].addr != addr || st->slots[i].port != port)) {
+          i = (i + 1) & (st->size - 1);
+     }
+
+     return &st->slots[i];
+}
+
+struct session *session_find(struct session_table *st, struct sockaddr_in *sock)
+{
+     struct session *s;
+
+     if (st->size == 0) {
+          return NULL;
+     }
+
+     s = session_slot(st, sock->sin_addr.s_addr, sock->sin_port);
+
+     return s->addr != 0 ? s : NULL;
+}
+
+/* move the entries to a table of size slots */
+static int session_resize(struct session_table *st, size_t size)
+{
+     struct session *old = st->slots, *s;
+     size_t i, n = st->size;
+
+     if ((st->slots = calloc(size, sizeof(*st->slots))) == NULL) {
+          st->slots = old;
+          return -1;
+     }
+
+     st->size = size;
+
+     for (i = 0; i < n; i++) {
+          if (old[i].addr != 0) {
+               s = session_slot(st, old[i].addr, old[i].port);
+               *s = old[i];
+          }
+     }
+
+     free(old);
+
+     return 0;
+}
+
+/* file addr:port, which must not be in the table yet; NULL when there is
+   no memory for it, the request is then served without the check */
+struct session *session_add(struct session_table *st, struct sockaddr_in *sock)
+{
+     struct session *s;
+
+     if (2 * (st->count + 1) > st->size &&
+         session_resize(st, st->size ? 2 * st->size : SESSIONS_INIT) < 0 && st->count + 1 >= st->size) {
+          return NULL;
+     }
+
+     s = session_slot(st, sock->sin_addr.s_addr, sock->sin_port);
+     s->addr = sock->sin_addr.s_addr;
+     s->port = sock->sin_port;
+     s->pid = 0;
+     s->data = NULL;
+     st->count++;
+
+     return s;
+}
+
+void session_del(struct session_table *st, struct sockaddr_in *sock)
+{
+     struct session *s = session_find(st, sock);
+     size_t i, j, k, mask = st->size - 1;
+
+     if (s == NULL) {
+          return;
+     }
+
+     /* an entry after the hole moves into it unless its home slot lies
+        cyclically between the two */
+
+     for (i = j = s - st->slots; ; ) {
+          j = (j + 1) & mask;
+
+          if (st->slots[j].addr == 0) {
+               break;
+          }
+
+          k = session_hash(st->slots[j].addr, st->slots[j].port) & mask;
+
+          if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+               st->slots[i] = st->slots[j];
+               i = j;
+          }
+     }
+
+     st->slots[i].addr = 0;
+     st->count--;
+}
+
+/* fork mode: drop the entries of children that have exited. A child is
+   reaped by the main thread, so it is gone once kill() cannot find it */
+void session_sweep(struct session_table *st)
+{
+     struct session *old = st->slots, *s;
+     size_t i, n = st->size;
+
+     if ((st->slots = calloc(n, sizeof(*st->slots))) == NULL) {
+          st->slots = old;
+          return;
+     }
+
+     st->count = 0;
+
+     for (i = 0; i < n; i++) {
+          if (old[i].addr != 0 && (kill(old[i].pid, 0) == 0 || errno != ESRCH)) {
+               s = session_slot(st, old[i].addr, old[i].port);
+               *s = old[i];
+               st->count++;
+          }
+     }
+
+     free(old);
+
+     st->sweep_at = 2 * st->count > SESSIONS_INIT / 4 ? 2 * st->count : SESSIONS_INIT / 4;
+}
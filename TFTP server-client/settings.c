@@ -0,0 +1,442 @@
+#include "tftpserv.h"
+#include <stddef.h>
+#include <limits.h>
+
+/* settings that can change while the server runs: timeouts and retries,
+   option limits, the cache size, rate limits and access rules. They start
+   from the command line, the -f file is applied on top, and SIGHUP reads
+   the file again. A reload is parsed and checked as a whole before it
+   replaces anything, so a bad file leaves the settings in force alone.
+
+   The settings in force live in shared memory with a generation that
+   every reload bumps. Each process keeps a refcounted copy of the latest
+   generation it has seen, and a transfer holds a reference from its start
+   to its end: new transfers pick a reload up at once, in any worker or
+   process, while the ones already running finish under the settings they
+   started with */
+
+#define SETTINGS_LINE 256
+
+struct settings_shared {
+     pthread_mutex_t lock;
+     _Atomic uint64_t generation;
+     struct settings current;
+};
+
+static struct settings_shared *shared;
+static char *settings_path;
+
+/* this process's copy, which holds a reference of its own */
+static struct settings *local;
+static pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reloads so far, only ever done by the main thread */
+static struct settings_stats stats;
+
+/* the numeric settings, by name, and the values they accept */
+static const struct {
+     const char *name;
+     size_t offset;
+     long min, max;
+} numbers[] = {
+     { "rto_min", offsetof(struct settings, rto_min), 1, 3600000 },
+     { "rto_max", offsetof(struct settings, rto_max), 1, 3600000 },
+     { "retries", offsetof(struct settings, retries), 1, 1000 },
+     { "idle_timeout", offsetof(struct settings, idle_timeout), 1000, 86400000 },
+     { "blksize_max", offsetof(struct settings, blksize_max), MIN_BLKSIZE, MAX_BLKSIZE },
+     { "windowsize_max", offsetof(struct settings, windowsize_max), 1, MAX_WINDOWSIZE },
+     { "cache_mb", offsetof(struct settings, cache_mb), 0, 1 << 20 },
+     { "max_transfers", offsetof(struct settings, max_transfers), 0, INT_MAX }
+};
+
+#define NUMBERS (sizeof(numbers) / sizeof(numbers[0]))
+
+/* a rate in bytes per second, with a K, M or G suffix; 0 if invalid */
+uint64_t parse_rate(const char *s, char **end)
+{
+     uint64_t rate = strtoull(s, end, 10);
+
+     switch (**end) {
+     case 'G':
+          rate <<= 10;
+          /* fall through */
+     case 'M':
+          rate <<= 10;
+          /* fall through */
+     case 'K':
+          rate <<= 10;
+          (*end)++;
+     }
+
+     return rate;
+}
+
+/* the settings given on the command line */
+static void settings_defaults(struct settings *s)
+{
+     memset(s, 0, sizeof(*s));
+     s->rto_min = config.rto_min;
+     s->rto_max = config.rto_max;
+     s->retries = RECV_RETRIES;
+     s->idle_timeout = IDLE_TIMEOUT;
+     s->blksize_max = MAX_BLKSIZE;
+     s->windowsize_max = MAX_WINDOWSIZE;
+     s->cache_mb = config.cache_mb;
+     s->rate_global = config.rate_global;
+     s->rate_client = config.rate_client;
+     s->rate_subnet = config.rate_subnet;
+     s->subnet_prefix = config.subnet_prefix;
+     s->max_transfers = config.max_transfers;
+}
+
+/* "allow|deny read|write|any [address[/prefix]|any]" */
+static int settings_rule(struct settings *s, char **arg, int n, char *err, size_t size)
+{
+     struct access_rule *r;
+     struct in_addr addr = { 0 };
+     char *p;
+     int prefix = 0;
+
+     if (n < 2 || n > 3) {
+          snprintf(err, size, "%s takes an operation and an address", arg[0]);
+          return -1;
+     }
+
+     if (s->rules == ACCESS_RULES) {
+          snprintf(err, size, "more than %d access rules", ACCESS_RULES);
+          return -1;
+     }
+
+     r = &s->rule[s->rules];
+     r->allow = strcmp(arg[0], "allow") == 0;
+
+     if (strcmp(arg[1], "read") == 0) {
+          r->ops = 1 << RRQ;
+     } else if (strcmp(arg[1], "write") == 0) {
+          r->ops = 1 << WRQ;
+     } else if (strcmp(arg[1], "any") == 0) {
+          r->ops = 1 << RRQ | 1 << WRQ;
+     } else {
+          snprintf(err, size, "unknown operation %s", arg[1]);
+          return -1;
+     }
+
+     if (n == 3 && strcmp(arg[2], "any") != 0) {
+          if ((p = strchr(arg[2], '/')) != NULL) {
+               *p++ = '\0';
+          }
+
+          prefix = p != NULL ? atoi(p) : 32;
+
+          if (inet_aton(arg[2], &addr) == 0 || prefix < 0 || prefix > 32 ||
+              (p != NULL && strspn(p, "0123456789") != strlen(p))) {
+               snprintf(err, size, "invalid address %s", arg[2]);
+               return -1;
+          }
+     }
+
+     r->mask = prefix ? ~0U << (32 - prefix) : 0;
+     r->net = ntohl(addr.s_addr) & r->mask;
+     s->rules++;
+
+     return 0;
+}
+
+/* apply one line of a settings file to s; -1 with the reason in err if it
+   is not valid */
+static int settings_line(struct settings *s, char *line, char *err, size_t size)
+{
+     char *arg[4], *p, *save;
+     uint64_t rate;
+     size_t i;
+     long v;
+     int n = 0;
+
+     if ((p = strchr(line, '#')) != NULL) {
+          *p = '\0';
+     }
+
+     for (p = strtok_r(line, " \t\r\n", &save); p != NULL; p = strtok_r(NULL, " \t\r\n", &save)) {
+          if (n == 4) {
+               snprintf(err, size, "too many values");
+               return -1;
+          }
+          arg[n++] = p;
+     }
+
+     if (n == 0) {
+          return 0;
+     }
+
+     if (strcmp(arg[0], "allow") == 0 || strcmp(arg[0], "deny") == 0) {
+          return settings_rule(s, arg, n, err, size);
+     }
+
+     if (n != 2) {
+          snprintf(err, size, "%s takes one value", arg[0]);
+          return -1;
+     }
+
+     for (i = 0; i < NUMBERS; i++) {
+          if (strcmp(arg[0], numbers[i].name) == 0) {
+               v = strtol(arg[1], &p, 10);
+
+               if (*p != '\0' || p == arg[1] || v < numbers[i].min || v > numbers[i].max) {
+                    snprintf(err, size, "%s must be from %ld to %ld", arg[0], numbers[i].min,
+                             numbers[i].max);
+                    return -1;
+               }
+
+               *(int *) ((uint8_t *) s + numbers[i].offset) = v;
+               return 0;
+          }
+     }
+
+     /* rates of 0 turn a limit off */
+
+     if (strcmp(arg[0], "rate") == 0 || strcmp(arg[0], "client_rate") == 0 ||
+         strcmp(arg[0], "subnet_rate") == 0) {
+          rate = parse_rate(arg[1], &p);
+
+          if (p == arg[1] || (*p != '\0' && (arg[0][0] != 's' || *p != '/'))) {
+               snprintf(err, size, "invalid rate %s", arg[1]);
+               return -1;
+          }
+
+          if (arg[0][0] == 'r') {
+               s->rate_global = rate;
+          } else if (arg[0][0] == 'c') {
+               s->rate_client = rate;
+          } else {
+               v = 24;
+
+               if (*p == '/' && ((v = strtol(p + 1, &p, 10)) < 0 || v > 32 || *p != '\0')) {
+                    snprintf(err, size, "invalid prefix length");
+                    return -1;
+               }
+
+               s->rate_subnet = rate;
+               s->subnet_prefix = v;
+          }
+
+          return 0;
+     }
+
+     snprintf(err, size, "unknown setting %s", arg[0]);
+     return -1;
+}
+
+/* apply the file at path to s, which holds the defaults; -1 with the
+   reason in err if the file cannot be read or is not valid */
+static int settings_load(const char *path, struct settings *s, char *err, size_t size)
+{
+     char line[SETTINGS_LINE], why[128];
+     FILE *f;
+     int n = 0;
+
+     if ((f = fopen(path, "r")) == NULL) {
+          snprintf(err, size, "%s: %s", path, strerror(errno));
+          return -1;
+     }
+
+     while (fgets(line, sizeof(line), f) != NULL) {
+          n++;
+
+          if (strchr(line, '\n') == NULL && !feof(f)) {
+               snprintf(err, size, "%s:%d: line too long", path, n);
+               fclose(f);
+               return -1;
+          }
+
+          if (settings_line(s, line, why, sizeof(why)) < 0) {
+               snprintf(err, size, "%s:%d: %s", path, n, why);
+               fclose(f);
+               return -1;
+          }
+     }
+
+     fclose(f);
+
+     if (s->rto_min > s->rto_max) {
+          snprintf(err, size, "%s: rto_min above rto_max", path);
+          return -1;
+     }
+
+     return 0;
+}
+
+static void settings_lock(void)
+{
+     /* a process that died holding the lock did so during a copy, which
+        leaves nothing half written */
+
+     if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+          pthread_mutex_consistent(&shared->lock);
+     }
+}
+
+static void settings_unlock(void)
+{
+     pthread_mutex_unlock(&shared->lock);
+}
+
+/* a child forked while another thread swapped the copy of its process
+   must not inherit local_lock held */
+static void local_prepare(void)
+{
+     pthread_mutex_lock(&local_lock);
+}
+
+static void local_done(void)
+{
+     pthread_mutex_unlock(&local_lock);
+}
+
+/* read the settings file, if there is one, before the server starts;
+   a file that is not valid stops it */
+void settings_init(const char *path)
+{
+     pthread_mutexattr_t attr;
+     char err[SETTINGS_LINE + PATH_MAX];
+
+     shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (shared == MAP_FAILED) {
+          perror("server: mmap()");
+          exit(1);
+     }
+
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&shared->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+
+     pthread_atfork(local_prepare, local_done, local_done);
+
+     settings_defaults(&shared->current);
+
+     /* the server changes to the base directory before any reload */
+
+     if (path != NULL && (settings_path = realpath(path, NULL)) == NULL) {
+          fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+          exit(1);
+     }
+
+     if (settings_path != NULL && settings_load(settings_path, &shared->current, err, sizeof(err)) < 0) {
+          fprintf(stderr, "error: %s\n", err);
+          exit(1);
+     }
+
+     shared->current.generation = 1;
+     atomic_store(&shared->generation, 1);
+     stats.generation = 1;
+     stats.last_ok = 1;
+}
+
+/* the settings new transfers run under, to be given back with
+   settings_put() */
+struct settings *settings_get(void)
+{
+     struct settings *s, *old = NULL;
+
+     pthread_mutex_lock(&local_lock);
+
+     if (local == NULL ||
+         local->generation != atomic_load_explicit(&shared->generation, memory_order_acquire)) {
+          if ((s = malloc(sizeof(*s))) != NULL) {
+               settings_lock();
+               memcpy(s, &shared->current, sizeof(*s));
+               settings_unlock();
+               atomic_init(&s->refs, 1);
+               old = local;
+               local = s;
+          } else if (local == NULL) {
+               fprintf(stderr, "server: out of memory\n");
+               exit(1);
+          }
+     }
+
+     s = local;
+     atomic_fetch_add(&s->refs, 1);
+
+     pthread_mutex_unlock(&local_lock);
+
+     if (old != NULL) {
+          settings_put(old);
+     }
+
+     return s;
+}
+
+void settings_put(struct settings *s)
+{
+     if (atomic_fetch_sub(&s->refs, 1) == 1) {
+          free(s);
+     }
+}
+
+/* read the settings file again and put it in force for the transfers that
+   start from now on; -1, with the settings left as they were, if it is
+   not valid */
+int settings_reload(void)
+{
+     struct settings s;
+     char err[SETTINGS_LINE + PATH_MAX], msg[sizeof(err) + 64];
+     uint64_t start = now_us();
+     int ok;
+
+     settings_defaults(&s);
+
+     ok = settings_path == NULL || settings_load(settings_path, &s, err, sizeof(err)) == 0;
+
+     if (ok) {
+          settings_lock();
+          s.generation = shared->current.generation + 1;
+          memcpy(&shared->current, &s, sizeof(s));
+          atomic_store_explicit(&shared->generation, s.generation, memory_order_release);
+          settings_unlock();
+
+          cache_limit((size_t) s.cache_mb << 20);
+          stats.generation = s.generation;
+          stats.reloads++;
+     } else {
+          stats.failures++;
+     }
+
+     stats.last_us = now_us() - start;
+     stats.last_ok = ok;
+
+     if (ok) {
+          snprintf(msg, sizeof(msg), "settings reloaded, generation %llu, in %llu us",
+                   (unsigned long long) stats.generation, (unsigned long long) stats.last_us);
+          log_event(LOG_INFO, LOG_MESSAGE, NULL, msg, NULL, 0, 0, 0);
+     } else {
+          snprintf(msg, sizeof(msg), "settings not reloaded, in %llu us: %s",
+                   (unsigned long long) stats.last_us, err);
+          log_event(LOG_ERROR, LOG_MESSAGE, NULL, msg, NULL, 0, 0, 0);
+     }
+
+     return ok ? 0 : -1;
+}
+
+/* may the client at addr make a request with opcode? The first rule that
+   matches decides, a request no rule matches is allowed */
+int settings_allow(struct settings *s, int opcode, struct sockaddr_in *addr)
+{
+     uint32_t a = ntohl(addr->sin_addr.s_addr);
+     int i;
+
+     for (i = 0; i < s->rules; i++) {
+          if ((s->rule[i].ops & 1 << opcode) && (a & s->rule[i].mask) == s->rule[i].net) {
+               return s->rule[i].allow;
+          }
+     }
+
+     return 1;
+}
+
+void settings_report(struct settings_stats *st)
+{
+     *st = stats;
+}
@@ -0,0 +1,1007 @@
+#include "tftpserv.h"
+
+/* tftp load generator: keeps n clients busy with RRQs or WRQs against a
+   server, starting a new transfer whenever one ends, and reports the
+   aggregate throughput, the spread of transfer times and of the time to
+   the server's first reply (the first DATA, OACK or ACK), and, given the pid
+   of the server, the cpu time it spent per GB moved. Every datagram the
+   clients send or receive goes through a shim that drops, delays and
+   reorders it as asked, to stand in for a lossy network over loopback.
+
+   With -M the clients ask for the rfc 2090 multicast option: each joins
+   the group the oack names on a socket of its own, keeps the blocks it
+   sees go by, and acks as a unicast client does once the server makes it
+   the master, from the last block it holds in order. A client that has
+   the whole file before its turn waits to be made master and acks the
+   last block, which is how the server learns it is done */
+
+#define LOAD_RETRIES 5
+#define LOAD_BLOCKS 65536            /* block numbers of a multicast session, which never wrap */
+
+enum load_state {
+     LOAD_IDLE,
+     LOAD_RUNNING
+};
+
+struct load_client {
+     int state;
+     int s;
+     int have_tid;                   /* peer is the server's transfer socket */
+     struct sockaddr_in peer;
+     uint64_t start_us;
+     uint64_t first_us;              /* time to the first reply of the server */
+     uint64_t deadline;              /* in us */
+     int retries;
+
+     uint8_t ctl[600];               /* request or last ack, for retransmission */
+     size_t ctl_len;
+
+     /* RRQ: next block expected, blocks since the last ack, and whether
+        a gap was already reported since the last block in order; for a
+        WRQ, whether the window was resent since the last ack that moved it */
+     uint64_t expected;
+     int in_window;
+     int gap_acked;
+
+     /* WRQ: blocks acked and sent, counted from 1 without wrapping */
+     uint64_t acked;
+     uint64_t sent;
+
+     uint64_t bytes;
+
+     /* multicast: the group socket, -1 before the oack or when the server
+        chose unicast, and a bit per block held. expected is the first
+        block missing, last the final block once seen, and acked the last
+        ack sent as master */
+     int mcast;
+     int ms;
+     int master;
+     uint8_t *have;
+     uint64_t last;
+     uint64_t mcast_acked;
+};
+
+/* a datagram held back by the shim */
+struct delayed {
+     uint64_t due;                   /* in us */
+     int client;
+     uint64_t start_us;              /* of the transfer it belongs to */
+     int outgoing;
+     struct sockaddr_in addr;
+     size_t len;
+     struct delayed *next;
+     uint8_t data[];
+};
+
+static struct {
+     int put;
+     int clients;
+     int transfers;
+     const char *file;
+     uint64_t size;                  /* of the files written with put */
+     int check_size;                 /* get: a transfer of another size fails */
+     int blksize;
+     int windowsize;
+     int rollover;                   /* block number after 65535, -1 to not send the option */
+     int mcast;
+     struct in_addr mcast_if;        /* interface the groups are joined on */
+     int timeout_ms;
+     double loss;                    /* probabilities, per datagram */
+     double reorder;
+     int delay_ms;
+     int jitter_ms;
+     pid_t server;
+     struct sockaddr_in addr;
+} opt = {
+     .clients = 8,
+     .transfers = 64,
+     .file = "load.bin",
+     .size = 1 << 20,
+     .blksize = SEGSIZE,
+     .windowsize = 1,
+     .rollover = -1,
+     .timeout_ms = 1000
+};
+
+static struct load_client *clients;
+static struct delayed *held;         /* sorted by due time */
+static uint8_t *payload;             /* blksize bytes of data for put */
+
+static int started, completed, failed;
+static uint64_t total_bytes, timeouts;
+static int mcast_joined, mcast_masters, mcast_unicast;
+static uint64_t *times;              /* of completed transfers, in us */
+static uint64_t *firsts;             /* and their first replies */
+
+static uint64_t load_us(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int chance(double p)
+{
+     return p > 0 && drand48() < p;
+}
+
+static void deliver(int i, uint8_t *buf, size_t len, struct sockaddr_in *from);
+
+/* block b as numbered on the wire, wrapping to 0 after 65535 unless the
+   rollover option asked for 1 */
+static uint16_t load_wire(uint64_t b)
+{
+     return opt.rollover != 1 || b == 0 ? (uint16_t) b : (b - 1) % 65535 + 1;
+}
+
+/* how many blocks after block from the one numbered wire comes */
+static uint32_t load_ahead(uint16_t wire, uint64_t from)
+{
+     if (opt.rollover != 1) {
+          return (uint16_t) (wire - (uint16_t) from);
+     }
+
+     return wire == 0 ? (from == 0 ? 0 : 0xffff) : (wire + 65535 - load_wire(from)) % 65535;
+}
+
+/* pass a datagram through the shim: dropped, held back for the delay
+   plus jitter, a reordered one for longer than anything sent after it,
+   or handled at once */
+static void shim(int i, int outgoing, uint8_t *buf, size_t len, struct sockaddr_in *addr)
+{
+     struct delayed *d, **p;
+     uint64_t wait;
+
+     if (chance(opt.loss)) {
+          return;
+     }
+
+     wait = opt.delay_ms + (opt.jitter_ms ? lrand48() % (opt.jitter_ms + 1) : 0);
+
+     if (chance(opt.reorder)) {
+          wait += opt.jitter_ms + 2;
+     }
+
+     if (wait == 0) {
+          if (!outgoing) {
+               deliver(i, buf, len, addr);
+          } else if (sendto(clients[i].s, buf, len, 0, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+               perror("tftpload: sendto()");
+          }
+          return;
+     }
+
+     if ((d = malloc(sizeof(*d) + len)) == NULL) {
+          return;
+     }
+
+     d->due = load_us() + wait * 1000;
+     d->client = i;
+     d->start_us = clients[i].start_us;
+     d->outgoing = outgoing;
+     d->addr = *addr;
+     d->len = len;
+     memcpy(d->data, buf, len);
+
+     for (p = &held; *p != NULL && (*p)->due <= d->due; p = &(*p)->next)
+          ;
+
+     d->next = *p;
+     *p = d;
+}
+
+static void send_packet(int i, uint8_t *buf, size_t len)
+{
+     shim(i, 1, buf, len, &clients[i].peer);
+}
+
+/* send a request or an ack, and keep it for retransmission */
+static void send_ctl(int i, uint8_t *buf, size_t len)
+{
+     struct load_client *c = &clients[i];
+
+     if (buf != c->ctl) {
+          memcpy(c->ctl, buf, len);
+     }
+     c->ctl_len = len;
+
+     send_packet(i, c->ctl, len);
+}
+
+static void load_ack(int i, uint64_t block)
+{
+     uint16_t ack[2] = { htons(ACK), htons(load_wire(block)) };
+
+     send_ctl(i, (uint8_t *) ack, sizeof(ack));
+}
+
+static void end_transfer(int i, int ok)
+{
+     struct load_client *c = &clients[i];
+
+     if (ok) {
+          firsts[completed] = c->first_us;
+          times[completed++] = load_us() - c->start_us;
+          total_bytes += c->bytes;
+     } else {
+          failed++;
+     }
+
+     close(c->s);
+
+     if (c->ms >= 0) {
+          close(c->ms);
+     }
+
+     free(c->have);
+     c->have = NULL;
+     c->state = LOAD_IDLE;
+}
+
+/* WRQ: send the blocks the window has room for, from after sent */
+static void load_window(int i)
+{
+     struct load_client *c = &clients[i];
+     uint64_t last = opt.size / opt.blksize + 1, b, off;
+     uint8_t pkt[4 + MAX_BLKSIZE];
+     size_t len;
+
+     while (c->sent < last && c->sent < c->acked + opt.windowsize) {
+          b = ++c->sent;
+          off = (b - 1) * opt.blksize;
+          len = opt.size - off < opt.blksize ? opt.size - off : opt.blksize;
+
+          ((uint16_t *) pkt)[0] = htons(DATA);
+          ((uint16_t *) pkt)[1] = htons(load_wire(b));
+          memcpy(pkt + 4, payload, len);
+
+          send_packet(i, pkt, 4 + len);
+     }
+}
+
+static void start_transfer(int i)
+{
+     struct load_client *c = &clients[i];
+     uint8_t req[600];
+     char name[256];
+     size_t len;
+     int n;
+
+     memset(c, 0, sizeof(*c));
+
+     if ((c->s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+          perror("tftpload: socket()");
+          exit(1);
+     }
+
+     fcntl(c->s, F_SETFL, O_NONBLOCK);
+
+     /* room for a whole window of large blocks, as the server makes */
+
+     n = 2 * opt.windowsize * (4 + opt.blksize);
+     setsockopt(c->s, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+
+     c->state = LOAD_RUNNING;
+     c->peer = opt.addr;
+     c->start_us = load_us();
+     c->deadline = c->start_us + opt.timeout_ms * 1000;
+     c->expected = 1;
+     c->ms = -1;
+
+     if (opt.mcast && (c->have = calloc(LOAD_BLOCKS / 8, 1)) == NULL) {
+          fprintf(stderr, "tftpload: out of memory\n");
+          exit(1);
+     }
+
+     c->mcast = opt.mcast;
+
+     /* uploads of one client slot replace each other's file */
+
+     if (opt.put) {
+          snprintf(name, sizeof(name), "%s.%d", opt.file, i);
+     } else {
+          snprintf(name, sizeof(name), "%s", opt.file);
+     }
+
+     ((uint16_t *) req)[0] = htons(opt.put ? WRQ : RRQ);
+     len = 2;
+     len += sprintf((char *) req + len, "%s", name) + 1;
+     len += sprintf((char *) req + len, "octet") + 1;
+
+     if (opt.blksize != SEGSIZE) {
+          len += sprintf((char *) req + len, "blksize") + 1;
+          len += sprintf((char *) req + len, "%d", opt.blksize) + 1;
+     }
+
+     if (opt.windowsize != 1) {
+          len += sprintf((char *) req + len, "windowsize") + 1;
+          len += sprintf((char *) req + len, "%d", opt.windowsize) + 1;
+     }
+
+     if (opt.rollover >= 0) {
+          len += sprintf((char *) req + len, "rollover") + 1;
+          len += sprintf((char *) req + len, "%d", opt.rollover) + 1;
+     }
+
+     if (opt.mcast) {
+          len += sprintf((char *) req + len, "multicast") + 1;
+          len += sprintf((char *) req + len, "%s", "") + 1;
+     }
+
+     started++;
+     send_ctl(i, req, len);
+}
+
+/* the transfer moved forward: rearm its timer */
+static void progress(int i)
+{
+     clients[i].deadline = load_us() + opt.timeout_ms * 1000;
+     clients[i].retries = 0;
+}
+
+static void deliver_rrq(int i, uint8_t *buf, size_t len)
+{
+     struct load_client *c = &clients[i];
+     uint16_t op = ntohs(((uint16_t *) buf)[0]), block = ntohs(((uint16_t *) buf)[1]);
+
+     if (op == OACK) {
+          if (c->expected == 1) {
+               progress(i);
+               load_ack(i, 0);
+          }
+          return;
+     }
+
+     if (op != DATA || len < 4) {
+          return;
+     }
+
+     /* out of order: ack the last block received in order, once per gap,
+        for the server to resend from there */
+
+     if (block != load_wire(c->expected)) {
+          if (!c->gap_acked) {
+               c->gap_acked = 1;
+               c->in_window = 0;
+               load_ack(i, c->expected - 1);
+          }
+          return;
+     }
+
+     progress(i);
+     c->gap_acked = 0;
+     c->bytes += len - 4;
+     c->expected++;
+
+     if (len - 4 < opt.blksize) {
+          load_ack(i, c->expected - 1);
+
+          if (opt.check_size && c->bytes != opt.size) {
+               fprintf(stderr, "tftpload: client %d: got %llu bytes\n", i, (unsigned long long) c->bytes);
+               end_transfer(i, 0);
+               return;
+          }
+
+          end_transfer(i, 1);
+          return;
+     }
+
+     if (++c->in_window == opt.windowsize) {
+          c->in_window = 0;
+          load_ack(i, c->expected - 1);
+     }
+}
+
+static void deliver_wrq(int i, uint8_t *buf, size_t len)
+{
+     struct load_client *c = &clients[i];
+     uint16_t op = ntohs(((uint16_t *) buf)[0]);
+     uint64_t last = opt.size / opt.blksize + 1, acked;
+
+     if (op == OACK) {
+          acked = 0;
+     } else if (op == ACK && len >= 4) {
+          acked = c->acked + load_ahead(ntohs(((uint16_t *) buf)[1]), c->acked);
+     } else {
+          return;
+     }
+
+     if (acked > c->sent || (op == OACK && c->sent > 0)) {
+          return;
+     }
+
+     if (acked > c->acked || (c->sent == 0 && acked == 0)) {
+          progress(i);
+          c->acked = acked;
+          c->gap_acked = 0;
+     } else if (!c->gap_acked) {
+
+          /* the server lost a block, or timed out, and acks the last one
+             it has in order: resend from there, once, since it may ack
+             every block that follows the gap */
+
+          c->gap_acked = 1;
+          c->sent = c->acked;
+     } else {
+          return;
+     }
+
+     if (c->acked == last) {
+          c->bytes = opt.size;
+          end_transfer(i, 1);
+          return;
+     }
+
+     load_window(i);
+}
+
+/* the value of option name in an oack, NULL if it is not there */
+static const char *oack_value(uint8_t *buf, size_t len, const char *name)
+{
+     const char *p = (const char *) buf + 2, *end = (const char *) buf + len, *value;
+
+     if (buf[len - 1] != '\0') {
+          return NULL;
+     }
+
+     while (p < end) {
+          value = p + strlen(p) + 1;
+
+          if (value >= end) {
+               break;
+          }
+
+          if (strcasecmp(p, name) == 0) {
+               return value;
+          }
+
+          p = value + strlen(value) + 1;
+     }
+
+     return NULL;
+}
+
+/* join the group of an oack's "addr,port,mc" on a socket of the client's
+   own; bound to the group, so it gets only what is sent to it */
+static int load_join(int i, const char *value)
+{
+     struct load_client *c = &clients[i];
+     struct sockaddr_in group = { .sin_family = AF_INET };
+     struct ip_mreq mreq;
+     char addr[INET_ADDRSTRLEN];
+     int n, port, on = 1;
+
+     if (sscanf(value, "%15[0-9.],%d,", addr, &port) != 2 || inet_aton(addr, &group.sin_addr) == 0 ||
+         port < 1 || port > 65535) {
+          fprintf(stderr, "tftpload: client %d: invalid multicast option %s\n", i, value);
+          return -1;
+     }
+
+     group.sin_port = htons(port);
+     mreq.imr_multiaddr = group.sin_addr;
+     mreq.imr_interface = opt.mcast_if;
+     n = 2 * opt.windowsize * (4 + opt.blksize);
+
+     if ((c->ms = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+         setsockopt(c->ms, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+         bind(c->ms, (struct sockaddr *) &group, sizeof(group)) < 0 ||
+         setsockopt(c->ms, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+          perror("tftpload: multicast socket");
+          return -1;
+     }
+
+     fcntl(c->ms, F_SETFL, O_NONBLOCK);
+     setsockopt(c->ms, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+     mcast_joined++;
+
+     return 0;
+}
+
+/* as master, ack the last block held in order */
+static void mcast_ack(int i)
+{
+     struct load_client *c = &clients[i];
+
+     c->mcast_acked = c->expected - 1;
+     c->in_window = 0;
+     load_ack(i, c->mcast_acked);
+}
+
+/* the whole file is here: done as master once the last block is acked */
+static int mcast_complete(int i)
+{
+     struct load_client *c = &clients[i];
+
+     if (c->last == 0 || c->expected <= c->last) {
+          return 0;
+     }
+
+     if (c->master) {
+          mcast_ack(i);
+
+          if (opt.check_size && c->bytes != opt.size) {
+               fprintf(stderr, "tftpload: client %d: got %llu bytes\n", i, (unsigned long long) c->bytes);
+               end_transfer(i, 0);
+          } else {
+               end_transfer(i, 1);
+          }
+     }
+
+     return 1;
+}
+
+/* RRQ with the multicast option: blocks come from the group in any
+   order, and from where the client joined */
+static void deliver_mcast(int i, uint8_t *buf, size_t len)
+{
+     struct load_client *c = &clients[i];
+     uint16_t op = ntohs(((uint16_t *) buf)[0]), block = ntohs(((uint16_t *) buf)[1]);
+     const char *value;
+
+     if (op == OACK) {
+
+          /* an oack without the option: the server serves this one by unicast */
+
+          if ((value = oack_value(buf, len, "multicast")) == NULL) {
+               c->mcast = 0;
+               mcast_unicast++;
+               deliver_rrq(i, buf, len);
+               return;
+          }
+
+          if (c->ms < 0 && load_join(i, value) < 0) {
+               end_transfer(i, 0);
+               return;
+          }
+
+          progress(i);
+
+          if (!c->master && strlen(value) > 2 && strcmp(value + strlen(value) - 2, ",1") == 0) {
+               c->master = 1;
+               mcast_masters++;
+          }
+
+          if (c->master && !mcast_complete(i)) {
+               mcast_ack(i);
+          }
+          return;
+     }
+
+     if (op != DATA || len < 4 || block == 0) {
+          return;
+     }
+
+     if (!(c->have[block / 8] & 1 << block % 8)) {
+          c->have[block / 8] |= 1 << block % 8;
+          c->bytes += len - 4;
+          progress(i);
+
+          if (len - 4 < opt.blksize) {
+               c->last = block;
+          }
+
+          while (c->expected < LOAD_BLOCKS && (c->have[c->expected / 8] & 1 << c->expected % 8)) {
+               c->expected++;
+          }
+     }
+
+     if (mcast_complete(i) || !c->master) {
+          return;
+     }
+
+     /* as in unicast: a gap or a block sent again, the ack having been
+        lost, is acked once, from the last block in order, and so is the
+        end of each window the server sends */
+
+     if (block > c->expected || block <= c->mcast_acked) {
+          if (!c->gap_acked) {
+               c->gap_acked = 1;
+               mcast_ack(i);
+          }
+          return;
+     }
+
+     c->gap_acked = 0;
+
+     if (block >= c->mcast_acked + opt.windowsize) {
+          mcast_ack(i);
+     }
+}
+
+static void deliver(int i, uint8_t *buf, size_t len, struct sockaddr_in *from)
+{
+     struct load_client *c = &clients[i];
+
+     if (c->state != LOAD_RUNNING || len < 2) {
+          return;
+     }
+
+     /* the first reply names the server's transfer socket */
+
+     if (!c->have_tid) {
+          c->peer = *from;
+          c->have_tid = 1;
+          c->first_us = load_us() - c->start_us;
+     } else if (from->sin_port != c->peer.sin_port) {
+
+          /* a multicast client that asked again after its session ended
+             is in a new one, where the blocks it holds are as good */
+
+          if (!c->mcast || c->master || ntohs(((uint16_t *) buf)[0]) != OACK) {
+               return;
+          }
+
+          c->peer = *from;
+
+          if (c->ms >= 0) {
+               close(c->ms);
+               c->ms = -1;
+          }
+     }
+
+     if (ntohs(((uint16_t *) buf)[0]) == ERROR) {
+          buf[len - 1] = '\0';
+          fprintf(stderr, "tftpload: client %d: error %u %s\n", i,
+                  len >= 4 ? ntohs(((uint16_t *) buf)[1]) : 0, len > 4 ? (char *) buf + 4 : "");
+          end_transfer(i, 0);
+          return;
+     }
+
+     if (opt.put) {
+          deliver_wrq(i, buf, len);
+     } else if (c->mcast) {
+          deliver_mcast(i, buf, len);
+     } else {
+          deliver_rrq(i, buf, len);
+     }
+}
+
+static void timeout(int i)
+{
+     struct load_client *c = &clients[i];
+
+     timeouts++;
+
+     if (++c->retries > LOAD_RETRIES) {
+          fprintf(stderr, "tftpload: client %d: transfer timed out\n", i);
+          end_transfer(i, 0);
+          return;
+     }
+
+     c->deadline = load_us() + opt.timeout_ms * 1000;
+
+     /* the request, the last ack, or the unacked part of the window. A
+        multicast client that is not the master asks again, as rfc 2090
+        has it, and the server answers with the session's oack */
+
+     if (c->mcast && c->have_tid && !c->master) {
+          shim(i, 1, c->ctl, c->ctl_len, &opt.addr);
+          return;
+     }
+
+     if (opt.put && c->have_tid) {
+          c->sent = c->acked;
+          load_window(i);
+     } else {
+          send_packet(i, c->ctl, c->ctl_len);
+     }
+}
+
+/* user and system time of pid and of its children it has waited for, in
+   seconds, or -1 if unknown */
+static double cpu_seconds(pid_t pid)
+{
+     unsigned long long t[4];
+     char path[64], buf[1024], *p;
+     FILE *f;
+     int n;
+
+     snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+
+     if ((f = fopen(path, "r")) == NULL) {
+          return -1;
+     }
+
+     n = fread(buf, 1, sizeof(buf) - 1, f);
+     fclose(f);
+     buf[n > 0 ? n : 0] = '\0';
+
+     /* fields 14 to 17, counted after the command name in parentheses */
+
+     if ((p = strrchr(buf, ')')) == NULL ||
+         sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                &t[0], &t[1], &t[2], &t[3]) != 4) {
+          return -1;
+     }
+
+     return (double) (t[0] + t[1] + t[2] + t[3]) / sysconf(_SC_CLK_TCK);
+}
+
+static int compare_times(const void *a, const void *b)
+{
+     uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+     return x < y ? -1 : x > y;
+}
+
+static void usage(char *prog)
+{
+     printf("usage:\n\t%s [-o get|put] [-n clients] [-c transfers] [-f file] [-s size] [-b blksize] "
+            "[-w windowsize] [-R 0|1] [-M] [-i address] [-t timeout] [-l loss] [-r reorder] [-d delay] "
+            "[-j jitter] [-p pid] host port\n", prog);
+     printf("\t-o\tget (RRQ, default) or put (WRQ)\n");
+     printf("\t-n\tconcurrent clients (default 8)\n");
+     printf("\t-c\ttransfers in all (default 64)\n");
+     printf("\t-f\tfile to get, or name prefix of the files put (default load.bin)\n");
+     printf("\t-s\tsize of the files put, with an optional K, M or G suffix (default 1M), or of the file got\n");
+     printf("\t-b\tblksize option (default %d, not sent)\n", SEGSIZE);
+     printf("\t-w\twindowsize option (default 1, not sent)\n");
+     printf("\t-R\trollover option, the block number after 65535 (default 0, not sent)\n");
+     printf("\t-M\tget with the rfc 2090 multicast option, the server needs -e and -M\n");
+     printf("\t-i\taddress of the interface the multicast groups are joined on\n");
+     printf("\t-t\tretransmission timeout of the clients, in ms (default 1000)\n");
+     printf("\t-l\tpercent of datagrams dropped, each way\n");
+     printf("\t-r\tpercent of datagrams reordered, each way\n");
+     printf("\t-d\tdelay added to every datagram, in ms\n");
+     printf("\t-j\trandom jitter added to the delay, up to this many ms\n");
+     printf("\t-p\tpid of the server, to report its cpu time per GB\n");
+     exit(1);
+}
+
+static uint64_t parse_size(const char *s)
+{
+     char *end;
+     uint64_t v = strtoull(s, &end, 10);
+
+     switch (*end) {
+     case 'G': case 'g':
+          v <<= 10;
+          /* fall through */
+     case 'M': case 'm':
+          v <<= 10;
+          /* fall through */
+     case 'K': case 'k':
+          v <<= 10;
+     }
+
+     return v;
+}
+
+int main(int argc, char *argv[])
+{
+     struct pollfd *pfd;
+     struct sockaddr_in from;
+     socklen_t flen;
+     struct delayed *d;
+     uint8_t buf[4 + MAX_BLKSIZE];
+     uint64_t start, now, next, elapsed;
+     double cpu = -1;
+     ssize_t c;
+     int i, n, o, running, wait;
+     char *prog = argv[0];
+
+     while ((o = getopt(argc, argv, "o:n:c:f:s:b:w:R:Mi:t:l:r:d:j:p:")) != -1) {
+          switch (o) {
+          case 'o':
+               if (strcmp(optarg, "get") != 0 && strcmp(optarg, "put") != 0) {
+                    usage(prog);
+               }
+               opt.put = strcmp(optarg, "put") == 0;
+               break;
+          case 'n':
+               opt.clients = atoi(optarg);
+               break;
+          case 'c':
+               opt.transfers = atoi(optarg);
+               break;
+          case 'f':
+               opt.file = optarg;
+               break;
+          case 's':
+               opt.size = parse_size(optarg);
+               opt.check_size = 1;
+               break;
+          case 'b':
+               opt.blksize = atoi(optarg);
+               break;
+          case 'w':
+               opt.windowsize = atoi(optarg);
+               break;
+          case 'R':
+               if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0) {
+                    usage(prog);
+               }
+               opt.rollover = optarg[0] - '0';
+               break;
+          case 'M':
+               opt.mcast = 1;
+               break;
+          case 'i':
+               if (inet_aton(optarg, &opt.mcast_if) == 0) {
+                    usage(prog);
+               }
+               break;
+          case 't':
+               opt.timeout_ms = atoi(optarg);
+               break;
+          case 'l':
+               opt.loss = atof(optarg) / 100;
+               break;
+          case 'r':
+               opt.reorder = atof(optarg) / 100;
+               break;
+          case 'd':
+               opt.delay_ms = atoi(optarg);
+               break;
+          case 'j':
+               opt.jitter_ms = atoi(optarg);
+               break;
+          case 'p':
+               opt.server = atoi(optarg);
+               break;
+          default:
+               usage(prog);
+          }
+     }
+
+     if (argc - optind != 2 || opt.clients < 1 || opt.transfers < 1 || opt.timeout_ms < 1 ||
+         opt.blksize < MIN_BLKSIZE || opt.blksize > MAX_BLKSIZE ||
+         opt.windowsize < 1 || opt.windowsize > MAX_WINDOWSIZE || (opt.mcast && opt.put)) {
+          usage(prog);
+     }
+
+     opt.addr.sin_family = AF_INET;
+     opt.addr.sin_port = htons(atoi(argv[optind + 1]));
+
+     if (inet_aton(argv[optind], &opt.addr.sin_addr) == 0) {
+          fprintf(stderr, "tftpload: invalid address %s\n", argv[optind]);
+          exit(1);
+     }
+
+     clients = calloc(opt.clients, sizeof(*clients));
+     pfd = calloc(2 * opt.clients, sizeof(*pfd));
+     times = calloc(opt.transfers, sizeof(*times));
+     firsts = calloc(opt.transfers, sizeof(*firsts));
+     payload = malloc(opt.blksize);
+
+     if (clients == NULL || pfd == NULL || times == NULL || firsts == NULL || payload == NULL) {
+          fprintf(stderr, "tftpload: out of memory\n");
+          exit(1);
+     }
+
+     for (i = 0; i < opt.blksize; i++) {
+          payload[i] = i * 131;
+     }
+
+     srand48(getpid());
+
+     if (opt.server > 0) {
+          cpu = cpu_seconds(opt.server);
+     }
+
+     start = load_us();
+
+     while (1) {
+          now = load_us();
+          next = now + 1000000;
+          running = 0;
+
+          for (i = 0; i < opt.clients; i++) {
+               if (clients[i].state == LOAD_IDLE && started < opt.transfers) {
+                    start_transfer(i);
+               }
+
+               if (clients[i].state == LOAD_RUNNING) {
+                    if (clients[i].deadline <= now) {
+                         timeout(i);
+                    }
+               }
+
+               pfd[2 * i].fd = clients[i].state == LOAD_RUNNING ? clients[i].s : -1;
+               pfd[2 * i].events = POLLIN;
+               pfd[2 * i + 1].fd = clients[i].state == LOAD_RUNNING ? clients[i].ms : -1;
+               pfd[2 * i + 1].events = POLLIN;
+
+               if (clients[i].state == LOAD_RUNNING) {
+                    running++;
+                    next = clients[i].deadline < next ? clients[i].deadline : next;
+               }
+          }
+
+          if (running == 0 && held == NULL) {
+               break;
+          }
+
+          if (held != NULL && held->due < next) {
+               next = held->due;
+          }
+
+          wait = next > now ? (next - now + 999) / 1000 : 0;
+
+          if ((n = poll(pfd, 2 * opt.clients, wait)) < 0 && errno != EINTR) {
+               perror("tftpload: poll()");
+               exit(1);
+          }
+
+          /* the transfer socket, then the group's; a client may end, and
+             close both, on any datagram */
+
+          for (i = 0; i < 2 * opt.clients && n > 0; i++) {
+               if (pfd[i].fd < 0 || !(pfd[i].revents & POLLIN)) {
+                    continue;
+               }
+
+               flen = sizeof(from);
+
+               while (clients[i / 2].state == LOAD_RUNNING && pfd[i].fd >= 0 &&
+                      (c = recvfrom(pfd[i].fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &flen)) >= 0) {
+                    shim(i / 2, 0, buf, c, &from);
+                    flen = sizeof(from);
+
+                    if (clients[i / 2].state != LOAD_RUNNING) {
+                         break;
+                    }
+               }
+          }
+
+          /* datagrams the shim held back, to clients still in the same
+             transfer; a socket closed since then drops them */
+
+          now = load_us();
+
+          while ((d = held) != NULL && d->due <= now) {
+               held = d->next;
+
+               if (clients[d->client].state == LOAD_RUNNING && clients[d->client].start_us == d->start_us) {
+                    if (!d->outgoing) {
+                         deliver(d->client, d->data, d->len, &d->addr);
+                    } else if (sendto(clients[d->client].s, d->data, d->len, 0,
+                                      (struct sockaddr *) &d->addr, sizeof(d->addr)) < 0) {
+                         perror("tftpload: sendto()");
+                    }
+               }
+
+               free(d);
+          }
+     }
+
+     elapsed = load_us() - start;
+
+     if (opt.server > 0 && cpu >= 0) {
+          cpu = cpu_seconds(opt.server) - cpu;
+     }
+
+     qsort(times, completed, sizeof(*times), compare_times);
+     qsort(firsts, completed, sizeof(*firsts), compare_times);
+
+     printf("%s, %d clients, blksize %d, windowsize %d, loss %g%%, reorder %g%%, delay %d+%d ms\n",
+            opt.put ? "put" : "get", opt.clients, opt.blksize, opt.windowsize,
+            opt.loss * 100, opt.reorder * 100, opt.delay_ms, opt.jitter_ms);
+     printf("transfers: %d completed, %d failed, %llu client timeouts\n", completed, failed,
+            (unsigned long long) timeouts);
+
+     if (opt.mcast) {
+          printf("multicast: %d joined a group, %d made master, %d served by unicast\n",
+                 mcast_joined, mcast_masters, mcast_unicast);
+     }
+     printf("throughput: %llu bytes in %.3f s, %.1f MB/s\n", (unsigned long long) total_bytes,
+            elapsed / 1e6, (double) total_bytes / elapsed);
+
+     if (completed > 0) {
+          printf("transfer time: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+                 times[completed / 2] / 1e3, times[(completed - 1) * 99 / 100] / 1e3,
+                 times[completed - 1] / 1e3);
+          printf("first reply: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                 firsts[completed / 2] / 1e3, firsts[(completed - 1) * 99 / 100] / 1e3,
+                 firsts[completed - 1] / 1e3);
+     }
+
+     if (opt.server > 0 && cpu >= 0) {
+          printf("server cpu: %.2f s, %.2f s per GB\n", cpu,
+                 total_bytes ? cpu / (total_bytes / 1e9) : 0);
+     }
+
+     return failed > 0;
+}
@@ -1,351 +1,1568 @@
 #include "tftpserv.h"
- 
-void cld_handler(int sig) {
-     int status;
-     wait(&status);
+
+char *base_directory;
+
+struct server_config config = {
+     .event_mode = 0,
+     .workers = 1,
+     .pin_cpus = 0,
+     .rto_min = RTO_MIN,
+     .rto_max = RTO_MAX,
+     .log_level = LOG_INFO,
+     .log_sample = 1,
+     .subnet_prefix = 24,
+     .queue_len = 64
+};
+
+uint64_t now_ms(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t now_us(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
- 
+
 ssize_t tftp_send_data(int s, uint16_t block_number, uint8_t *data, ssize_t dlen, struct sockaddr_in *sock, socklen_t slen)
 {
      tftp_message message;
      ssize_t c;
- 
+
      message.opcode = htons(DATA);
      message.data.block_number = htons(block_number);
      memcpy(message.data.data, data, dlen);
- 
+
      if ((c = sendto(s, &message, 4 + dlen, 0, (struct sockaddr *) sock, slen)) < 0) {
           perror("server: sendto()");
      }
- 
+
      return c;
 }
- 
+
 ssize_t send_ack(int s, uint16_t block_number, struct sockaddr_in *sock, socklen_t slen)
 {
      tftp_message message;
      ssize_t c;
- 
+
      message.opcode = htons(ACK);
      message.ack.block_number = htons(block_number);
- 
+
      if ((c = sendto(s, &message, sizeof(message.ack), 0, (struct sockaddr *) sock, slen)) < 0) {
           perror("server: sendto()");
      }
- 
+
      return c;
 }
- 
-ssize_t send_error(int s, int error_code, char *error_string, struct sockaddr_in *sock, socklen_t slen)
+
+/* the tftp error code for a failed system call */
+int tftp_error(int err)
+{
+     switch (err) {
+     case ENOENT:
+     case ENOTDIR:
+          return ENOTFOUND;
+     case EACCES:
+     case EPERM:
+     case EROFS:
+          return EACCESS;
+     case ENOSPC:
+     case EDQUOT:
+     case EFBIG:
+          return ENOSPACE;
+     case EEXIST:
+          return EEXISTS;
+     default:
+          return EUNDEF;
+     }
+}
+
+ssize_t send_error(int s, int error_code, const char *error_string, struct sockaddr_in *sock, socklen_t slen)
 {
      tftp_message m;
      ssize_t c;
- 
+
      if(strlen(error_string) >= 512) {
           fprintf(stderr, "server: send_error(): error string too long\n");
           return -1;
      }
- 
+
+     worker_count(errors_sent[error_code < ERROR_CODES ? error_code : EUNDEF]);
+
      m.opcode = htons(ERROR);
-     m.error.error_code = error_code;
-     strcpy(m.error.error_string, error_string);
- 
+     m.error.error_code = htons(error_code);
+     strcpy((char *) m.error.error_string, error_string);
+
      if ((c = sendto(s, &m, 4 + strlen(error_string) + 1, 0,
                      (struct sockaddr *) sock, slen)) < 0) {
           perror("server: sendto()");
      }
- 
+
      return c;
 }
- 
+
 ssize_t recv_message(int s, tftp_message *m, struct sockaddr_in *sock, socklen_t *slen)
 {
      ssize_t c;
- 
+
      if ((c = recvfrom(s, m, sizeof(*m), 0, (struct sockaddr *) sock, slen)) < 0
           && errno != EAGAIN) {
           perror("server: recvfrom()");
      }
- 
+
      return c;
 }
- 
-void handle_request(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen)
+
+/* validate a datagram received on the listening socket, returns its opcode
+   if it starts a transfer and 0 if it was rejected */
+int check_request(int s, tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen)
 {
-     int s;
-     struct protoent *pp;
-     struct timeval tv;
- 
-     char *filename, *mode_s, *end;
-     FILE *fd;
- 
-     int mode;
      uint16_t opcode;
- 
-     /* open new socket, on new port, to handle client request */
- 
-     if ((pp = getprotobyname("udp")) == 0) {
-          fprintf(stderr, "server: getprotobyname() error\n");
-          exit(1);
+
+     if (len < 4) {
+          log_event(LOG_WARN, LOG_MESSAGE, client_sock, "request with invalid size received",
+                    NULL, 0, 0, 0);
+          send_error(s, 0, "invalid request size", client_sock, slen);
+          return 0;
      }
- 
-     if ((s = socket(AF_INET, SOCK_DGRAM, pp->p_proto)) == -1) {
-          perror("server: socket()");
-          exit(1);
+
+     opcode = ntohs(m->opcode);
+
+     if (opcode != RRQ && opcode != WRQ) {
+          log_event(LOG_WARN, LOG_BAD_OPCODE, client_sock, NULL, NULL, opcode, 0, 0);
+          send_error(s, 0, "invalid opcode", client_sock, slen);
+          return 0;
      }
- 
-     tv.tv_sec  = RECV_TIMEOUT;
-     tv.tv_usec = 0;
- 
-     if(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-          perror("server: setsockopt()");
-          exit(1);
+
+     return opcode;
+}
+
+/* a transfer failing, or a client misbehaving */
+static void transfer_log(tftp_transfer *t, const char *what)
+{
+     log_event(LOG_WARN, LOG_MESSAGE, &t->client_sock, what, NULL, 0, 0, 0);
+}
+
+/* log a completed transfer with its statistics and account for it */
+static void transfer_done(tftp_transfer *t)
+{
+     uint64_t us = now_us() - t->start_us;
+
+     log_event(LOG_INFO, LOG_COMPLETED, &t->client_sock, NULL, NULL, t->bytes, us, t->resent);
+
+     metrics_transfer_done(t);
+}
+
+static int transfer_sendto(tftp_transfer *t, void *pkt, size_t len)
+{
+     if (sendto(t->s, pkt, len, 0, (struct sockaddr *) &t->client_sock, t->slen) < 0) {
+          perror("server: sendto()");
+          transfer_log(t, "transfer killed");
+          return -1;
      }
- 
-     /* parse client request */
- 
-     filename = m->request.filename_and_mode;
-     end = &filename[len - 2 - 1];
- 
-     if (*end != '\0') {
-          printf("%s.%u: invalid filename or mode\n",
-                 inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-          send_error(s, 0, "invalid filename or mode", client_sock, slen);
-          exit(1);
+
+     t->deadline = now_ms() + t->rto;
+
+     return 0;
+}
+
+/* time the packet just sent, unless a measurement is already running;
+   block is what the reply must cover for the sample to count */
+static void transfer_rtt_start(tftp_transfer *t, uint64_t block)
+{
+     if (t->rtt_start == 0) {
+          t->rtt_start = now_us();
+          t->rtt_block = block;
      }
- 
-     mode_s = strchr(filename, '\0') + 1; 
- 
-     if (mode_s > end) {
-          printf("%s.%u: transfer mode not specified\n",
-                 inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-          send_error(s, 0, "transfer mode not specified", client_sock, slen);
-          exit(1);
+}
+
+/* fold the running measurement into the retransmission timeout, as in
+   rfc 6298; rtts are kept in microseconds, the timeout in milliseconds */
+static void transfer_rtt_sample(tftp_transfer *t)
+{
+     int64_t r = now_us() - t->rtt_start, delta;
+
+     t->rtt_start = 0;
+     worker_observe(rtt, r);
+
+     if (t->rto_fixed) {
+          return;
      }
- 
-     if(strncmp(filename, "../", 3) == 0 || strstr(filename, "/../") != NULL ||
-        (filename[0] == '/' && strncmp(filename, base_directory, strlen(base_directory)) != 0)) {
-          printf("%s.%u: filename outside base directory\n",
-                 inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-          send_error(s, 0, "filename outside base directory", client_sock, slen);
-          exit(1);
+
+     if (t->srtt == 0) {
+          t->srtt = r;
+          t->rttvar = r / 2;
+     } else {
+          delta = t->srtt > r ? t->srtt - r : r - t->srtt;
+          t->rttvar = (3 * t->rttvar + delta) / 4;
+          t->srtt = (7 * t->srtt + r) / 8;
      }
- 
-     opcode = ntohs(m->opcode);
-     fd = fopen(filename, opcode == RRQ ? "r" : "w"); 
- 
-     if (fd == NULL) {
-          perror("server: fopen()");
-          send_error(s, errno, strerror(errno), client_sock, slen);
-          exit(1);
+
+     t->rto = (t->srtt + (4 * t->rttvar > 1000 ? 4 * t->rttvar : 1000) + 999) / 1000;
+
+     if (t->rto < t->cfg->rto_min) {
+          t->rto = t->cfg->rto_min;
      }
- 
-     mode = strcasecmp(mode_s, "netascii") ? NETASCII :
-          strcasecmp(mode_s, "octet")    ? OCTET    :
-          0;
- 
-     if (mode == 0) {
-          printf("%s.%u: invalid transfer mode\n",
-                 inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-          send_error(s, 0, "invalid transfer mode", client_sock, slen);
-          exit(1);
+
+     if (t->rto > t->cfg->rto_max) {
+          t->rto = t->cfg->rto_max;
+     }
+}
+
+/* send the packet held in t->pkt and rearm the retransmission timer */
+static int transfer_send(tftp_transfer *t)
+{
+     return transfer_sendto(t, t->pkt, t->last_len);
+}
+
+/* RRQ: window slot holding the DATA packet of block b */
+static uint8_t *transfer_slot(tftp_transfer *t, uint64_t b)
+{
+     return t->window + (b % t->windowsize) * (4 + t->blksize);
+}
+
+/* the number block b goes by on the wire. Blocks are counted from 1 and
+   wrap around after 65535 to 0, or to 1 if the rollover option asks, so a
+   file of any size can be sent whatever block size the client picks */
+static uint16_t transfer_wire(tftp_transfer *t, uint64_t b)
+{
+     if (t->rollover == 0 || b == 0) {
+          return (uint16_t) b;
+     }
+
+     return (b - 1) % 65535 + 1;
+}
+
+/* how many blocks after block from the one numbered wire comes, modulo
+   the number space; block 0 is only ever acked before block 1 when the
+   numbers roll over to 1, later it counts as an old ack */
+static uint32_t transfer_ahead(tftp_transfer *t, uint16_t wire, uint64_t from)
+{
+     if (t->rollover == 0) {
+          return (uint16_t) (wire - (uint16_t) from);
+     }
+
+     if (wire == 0) {
+          return from == 0 ? 0 : 0xffff;
+     }
+
+     return (wire + 65535 - transfer_wire(t, from)) % 65535;
+}
+
+/* RRQ: send blocks first to last in one batch. Mapped files are sent
+   straight from the mapping, the header and the payload of each block
+   going out as two iovecs so the data is never copied in user space.
+   Blocks beyond what the rate limits allow now are held back, and sent
+   when the transfer's timer fires instead of retransmitting */
+static int transfer_send_blocks(tftp_transfer *t, uint64_t first, uint64_t last)
+{
+     uint16_t hdr[MAX_WINDOWSIZE][2];
+     struct iovec iov[2 * MAX_WINDOWSIZE];
+     uint64_t b, off, bytes = 0, wait = 0;
+     uint8_t *slot;
+     int i, sent = 0;
+
+     /* blocks held back before go first, they are always right before or
+        among these */
+
+     if (t->pace_last != 0) {
+          first = first < t->pace_first ? first : t->pace_first;
+          last = last > t->pace_last ? last : t->pace_last;
+          t->pace_last = 0;
+     }
+
+     for (b = first, i = 0; b <= last; b++, i++) {
+          if (t->map != NULL) {
+
+               hdr[i][0] = htons(DATA);
+               hdr[i][1] = htons(transfer_wire(t, b));
+               off = (b - 1) * t->blksize;
+
+               iov[2 * i].iov_base = hdr[i];
+               iov[2 * i].iov_len = 4;
+               iov[2 * i + 1].iov_base = (uint8_t *) t->map + off;
+               iov[2 * i + 1].iov_len = off < t->size ?
+                    (t->size - off < t->blksize ? t->size - off : t->blksize) : 0;
+          } else {
+               slot = transfer_slot(t, b);
+
+               iov[2 * i].iov_base = slot;
+               iov[2 * i].iov_len = 4;
+               iov[2 * i + 1].iov_base = slot + 4;
+               iov[2 * i + 1].iov_len = t->wlen[b % t->windowsize] - 4;
+          }
+
+          if ((wait = pace_take(t->cfg, t->data_to, 4 + iov[2 * i + 1].iov_len)) != 0) {
+               break;
+          }
+
+          bytes += iov[2 * i + 1].iov_len;
+     }
+
+     /* a file truncated under the mapping makes the kernel fail the copy
+        with EFAULT, it never raises SIGBUS in the server */
+
+     if (i > 0 && (sent = send_batch(t->s, t->data_to, sizeof(*t->data_to), iov, i, 2,
+                                     4 + t->blksize)) < 0) {
+          transfer_log(t, "transfer killed");
+          return -1;
+     }
+
+     /* blocks the socket had no room for are lost as on the wire, the
+        timer below sends them again */
+
+     if (sent < i) {
+          worker_add(send_drops, i - sent);
+          b = first + sent;
+
+          while (i > sent) {
+               bytes -= iov[2 * --i + 1].iov_len;
+          }
+     }
+
+     worker_add(bytes_sent, bytes);
+
+     if (wait != 0) {
+          worker_count(paced);
+          t->pace_first = b;
+          t->pace_last = last;
+          t->deadline = now_ms() + (wait + 999999) / 1000000;
+          return 0;
+     }
+
+     t->deadline = now_ms() + t->rto;
+
+     return 0;
+}
+
+/* RRQ: copy block b, sent for the first time, into the cache entry being
+   filled; it is read with pread() rather than copied from the mapping so
+   that a truncated file cannot fault the server */
+static void transfer_fill_cache(tftp_transfer *t, uint64_t b)
+{
+     uint64_t off = (b - 1) * t->blksize;
+     size_t len;
+
+     if (off >= t->size) {
+          return;
+     }
+
+     len = t->size - off < t->blksize ? t->size - off : t->blksize;
+
+     if (pread(fileno(t->fd), t->cache_fill + off, len, off) != len) {
+          cache_release(t->cache_entry);
+          t->cache_entry = -1;
+          t->cache_fill = NULL;
      }
- 
-     printf("%s.%u: request received: %s '%s' %s\n", 
-            inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port),
-            ntohs(m->opcode) == RRQ ? "get" : "put", filename, mode_s);
- 
-     if (opcode == RRQ) {
-          tftp_message m;
- 
-          uint8_t data[512];
-          ssize_t dlen, c;
- 
-          uint16_t block_number = 0;
-          
-          int countdown;
-          int to_close = 0;
-          
-          while (!to_close) {
- 
-               dlen = fread(data, 1, sizeof(data), fd);
-               block_number++;
-               
-               if (dlen < 512) { // last data block to send
-                    to_close = 1;
+}
+
+/* RRQ: read the next block of a netascii transfer into out. Lines ends
+   expand on the wire, so the file is read through xbuf, blksize bytes at
+   a time, and translated until the block is full or the file ends */
+static size_t transfer_read_netascii(tftp_transfer *t, uint8_t *out)
+{
+     size_t len = 0, in;
+     ssize_t c;
+
+     while (len < t->blksize) {
+          if (t->xpos == t->xlen && t->na.pending < 0) {
+               if ((c = prefetch_read(t, t->xbuf, t->blksize, t->xoff)) <= 0) {
+                    break;
                }
- 
-               for (countdown = RECV_RETRIES; countdown; countdown--) {
- 
-                    c = tftp_send_data(s, block_number, data, dlen, client_sock, slen);
-                
-                    if (c < 0) {
-                         printf("%s.%u: transfer killed\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         exit(1);
-                    }
- 
-                    c = recv_message(s, &m, client_sock, &slen);
-                     
-                    if (c >= 0 && c < 4) {
-                         printf("%s.%u: message with invalid size received\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         send_error(s, 0, "invalid request size", client_sock, slen);
-                         exit(1);
-                    }
- 
-                    if (c >= 4) {
-                         break;
-                    }
- 
-                    if (errno != EAGAIN) {
-                         printf("%s.%u: transfer killed\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         exit(1);
+               t->xlen = c;
+               t->xoff += c;
+               t->xpos = 0;
+          }
+
+          in = t->xlen - t->xpos;
+          len += netascii_encode(&t->na, t->xbuf + t->xpos, &in, out + len, t->blksize - len);
+          t->xpos += in;
+     }
+
+     return len;
+}
+
+/* RRQ: read and send blocks until windowsize of them are unacknowledged
+   or the end of the file is reached */
+static int transfer_fill_window(tftp_transfer *t)
+{
+     tftp_message *m;
+     uint64_t b, off, first = t->sent + 1;
+     ssize_t dlen;
+     int ready, err;
+
+     while (!t->to_close && t->sent < t->acked + t->windowsize) {
+          b = t->sent + 1;
+
+          if (t->map != NULL) {
+
+               /* the last block is the first one shorter than blksize */
+
+               if (b == t->size / t->blksize + 1) {
+                    t->to_close = 1;
+               }
+
+               t->bytes += t->to_close ? t->size % t->blksize : t->blksize;
+
+               if (t->cache_fill != NULL) {
+                    transfer_fill_cache(t, b);
+               }
+
+          } else {
+
+               /* a file still being fetched is sent as far as it has come */
+
+               if (t->relay != NULL && (ready = relay_ready(t, b * t->blksize)) <= 0) {
+                    if (ready < 0) {
+                         transfer_log(t, "upstream fetch failed");
+                         send_error(t->s, t->sent == 0 ? ENOTFOUND : EUNDEF,
+                                    t->sent == 0 ? "file not found" : "upstream transfer failed",
+                                    &t->client_sock, t->slen);
+                         return -1;
                     }
- 
+                    break;
+               }
+
+               m = (tftp_message *) transfer_slot(t, b);
+
+               if (t->mode == NETASCII) {
+                    dlen = transfer_read_netascii(t, m->data.data);
+               } else {
+                    dlen = prefetch_read(t, m->data.data, t->blksize, (b - 1) * t->blksize);
+               }
+
+               /* a file that cannot be read, or a manifest whose chunks
+                  cannot, ends the transfer rather than cutting it short */
+
+               if (dlen < 0) {
+                    err = errno;
+                    perror("server: pread()");
+                    transfer_log(t, "read failed");
+                    send_error(t->s, EUNDEF, strerror(err), &t->client_sock, t->slen);
+                    return -1;
                }
- 
-               if (!countdown) {
-                    printf("%s.%u: transfer timed out\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    exit(1);
+
+               if (dlen < t->blksize) { // last data block to send
+                    t->to_close = 1;
                }
- 
-               if (ntohs(m.opcode) == ERROR)  {
-                    printf("%s.%u: error message received: %u %s\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port),
-                           ntohs(m.error.error_code), m.error.error_string);
-                    exit(1);
+
+               t->bytes += dlen;
+
+               m->opcode = htons(DATA);
+               m->data.block_number = htons(transfer_wire(t, b));
+               t->wlen[b % t->windowsize] = 4 + dlen;
+          }
+
+          t->sent = b;
+     }
+
+     if (first > t->sent) {
+
+          /* caught up with the fetch and nothing in flight for an ack to
+             come back: look again shortly */
+
+          if (t->relay != NULL && t->sent == t->acked) {
+               t->relay_wait = 1;
+               t->deadline = now_ms() + RELAY_POLL;
+          }
+
+          return 0;
+     }
+
+     /* fresh blocks from the mapping are copied by the kernel as they are
+        sent, see whether it has them in memory and keep reading ahead */
+
+     off = (first - 1) * t->blksize;
+
+     if (t->mapping != NULL && off < t->size) {
+          prefetch_advance(t, off);
+          prefetch_check(t, off, (t->sent - first + 1) * t->blksize);
+     }
+
+     if (transfer_send_blocks(t, first, t->sent) < 0) {
+          return -1;
+     }
+
+     /* a block held back would be timed with its wait */
+
+     if (t->pace_last == 0) {
+          transfer_rtt_start(t, first);
+     }
+
+     return 0;
+}
+
+/* RRQ: send every unacknowledged block again */
+static int transfer_resend_window(tftp_transfer *t)
+{
+     t->rtt_start = 0; // karn: never time a retransmission
+     t->resent += t->sent - t->acked;
+     worker_add(retransmits, t->sent - t->acked);
+
+     return transfer_send_blocks(t, t->acked + 1, t->sent);
+}
+
+/* RRQ: serve a regular file from the shared cache when it holds the
+   current version, without reading it */
+static int transfer_cached(tftp_transfer *t, const char *filename)
+{
+     struct stat st;
+     int fd, r;
+
+     /* the entry is checked against the file the resolver would open */
+
+     if ((fd = resolve_open(filename, O_PATH)) < 0) {
+          return -1;
+     }
+
+     r = fstat(fd, &st);
+     close(fd);
+
+     if (r < 0 || !S_ISREG(st.st_mode)) {
+          return -1;
+     }
+
+     if ((t->cache_entry = cache_lookup(filename, &st, &t->map)) < 0) {
+          return -1;
+     }
+
+     t->size = st.st_size;
+
+     return 0;
+}
+
+/* RRQ: map a regular file so blocks can be sent from, and resent by, their
+   offset; on failure blocks are read into the window ring instead. A file
+   the cache has room for is copied into it while it is sent */
+static void transfer_map(tftp_transfer *t, const char *filename)
+{
+     struct stat st;
+     void *map;
+
+     /* a file larger than the address space is read block by block */
+
+     if (fstat(fileno(t->fd), &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+         (uint64_t) st.st_size > SIZE_MAX) {
+          return;
+     }
+
+     if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(t->fd), 0)) == MAP_FAILED) {
+          return;
+     }
+
+     madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+     t->map = t->mapping = map;
+     t->size = st.st_size;
+     t->cache_entry = cache_reserve(filename, &st, &t->cache_fill);
+}
+
+static int transfer_ack(tftp_transfer *t)
+{
+     tftp_message *m = (tftp_message *) t->pkt;
+
+     m->opcode = htons(ACK);
+     m->ack.block_number = htons(transfer_wire(t, t->received));
+     t->last_len = sizeof(m->ack);
+
+     return transfer_send(t);
+}
+
+/* parse the rfc 2347 options that follow the mode string, writing the
+   accepted ones to oack; returns the oack length, 0 if no option was
+   accepted or -1 if an option value is unacceptable */
+static ssize_t transfer_options(tftp_transfer *t, char *opt, char *end, char *oack, size_t size)
+{
+     char *name, *value, *e;
+     size_t olen = 0;
+     long n;
+
+     while (opt < end) {
+          name = opt;
+          value = strchr(name, '\0') + 1;
+
+          if (value > end) {
+               return -1;
+          }
+
+          opt = strchr(value, '\0') + 1;
+
+          if (strcasecmp(name, "blksize") == 0) {
+
+               /* rfc 2348: the server may answer with a smaller size */
+
+               n = strtol(value, &e, 10);
+
+               if (*value == '\0' || *e != '\0' || n < MIN_BLKSIZE) {
+                    return -1;
                }
- 
-               if (ntohs(m.opcode) != ACK)  {
-                    printf("%s.%u: invalid message during transfer received\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    send_error(s, 0, "invalid message during transfer", client_sock, slen);
-                    exit(1);
+
+               t->blksize = n < t->cfg->blksize_max ? n : t->cfg->blksize_max;
+               olen += snprintf(oack + olen, size - olen, "blksize%c%d", '\0', t->blksize) + 1;
+          }
+
+          if (strcasecmp(name, "windowsize") == 0) {
+
+               /* rfc 7440: the server may answer with a smaller window */
+
+               n = strtol(value, &e, 10);
+
+               if (*value == '\0' || *e != '\0' || n < 1 || n > 65535) {
+                    return -1;
                }
-               
-               if (ntohs(m.ack.block_number) != block_number) { // the ack number is too high
-                    printf("%s.%u: invalid ack number received\n", 
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    send_error(s, 0, "invalid ack number", client_sock, slen);
-                    exit(1);
+
+               t->windowsize = n < t->cfg->windowsize_max ? n : t->cfg->windowsize_max;
+               olen += snprintf(oack + olen, size - olen, "windowsize%c%d", '\0', t->windowsize) + 1;
+          }
+
+          if (strcasecmp(name, "timeout") == 0) {
+
+               /* rfc 2349: a fixed retransmission timeout, in seconds */
+
+               n = strtol(value, &e, 10);
+
+               if (*value == '\0' || *e != '\0' || n < 1 || n > 255) {
+                    return -1;
                }
- 
-          }
- 
-     }
- 
-     else if (opcode == WRQ) {
- 
-          tftp_message m;
- 
-          ssize_t c;
- 
-          uint16_t block_number = 0;
-          
-          int countdown;
-          int to_close = 0;
- 
-          c = send_ack(s, block_number, client_sock, slen);
-           
-          if (c < 0) {
-               printf("%s.%u: transfer killed\n",
-                      inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-               exit(1);
-          }
- 
-          while (!to_close) {
- 
-               for (countdown = RECV_RETRIES; countdown; countdown--) {
- 
-                    c = recv_message(s, &m, client_sock, &slen);
- 
-                    if (c >= 0 && c < 4) {
-                         printf("%s.%u: message with invalid size received\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         send_error(s, 0, "invalid request size", client_sock, slen);
-                         exit(1);
-                    }
- 
-                    if (c >= 4) {
-                         break;
-                    }
- 
-                    if (errno != EAGAIN) {
-                         printf("%s.%u: transfer killed\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         exit(1);
-                    }
- 
-                    c = send_ack(s, block_number, client_sock, slen);
-               
-                    if (c < 0) {
-                         printf("%s.%u: transfer killed\n",
-                                inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                         exit(1);
-                    }
- 
+
+               t->rto = n * 1000;
+               t->rto_fixed = 1;
+               olen += snprintf(oack + olen, size - olen, "timeout%c%ld", '\0', n) + 1;
+          }
+
+          if (strcasecmp(name, "tsize") == 0) {
+
+               /* rfc 2349: the size is added once the file is opened, a
+                  RRQ gets the file size and a WRQ has its own echoed */
+
+               t->tsize = strtoll(value, &e, 10);
+
+               if (*value == '\0' || *e != '\0' || t->tsize < 0) {
+                    return -1;
                }
- 
-               if (!countdown) {
-                    printf("%s.%u: transfer timed out\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    exit(1);
+
+               t->tsize_requested = 1;
+          }
+
+          if (strcasecmp(name, "rollover") == 0) {
+
+               /* the block number that follows 65535, as tftp-hpa and
+                  others negotiate it */
+
+               if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                    return -1;
                }
- 
-               block_number++;
- 
-               if (c < sizeof(m.data)) {
-                    to_close = 1;
+
+               t->rollover = value[0] - '0';
+               olen += snprintf(oack + olen, size - olen, "rollover%c%d", '\0', t->rollover) + 1;
+          }
+
+          if (strcasecmp(name, "multicast") == 0 && config.event_mode &&
+              config.mcast_group.s_addr != INADDR_ANY) {
+
+               /* rfc 2090: answered with the group once the session is
+                  known, left out of the oack to fall back to unicast */
+
+               t->mcast_requested = 1;
+          }
+
+          /* unknown options are ignored, as rfc 2347 requires */
+
+          if (olen >= size) {
+               return -1;
+          }
+     }
+
+     return olen;
+}
+
+/* a socket opened ahead of the request it will serve, see transfer_prepare() */
+static __thread int spare_socket = -1;
+
+/* a non-blocking udp socket for a transfer id */
+static int transfer_socket(void)
+{
+     int s;
+
+     if ((s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) == -1) {
+          perror("server: socket()");
+     }
+
+     return s;
+}
+
+/* open and bind the socket of the next transfer this thread starts while
+   there is nothing else to do, so that the request does not wait for it */
+void transfer_prepare(void)
+{
+     struct sockaddr_in any = { .sin_family = AF_INET };
+
+     if (spare_socket >= 0 || (spare_socket = transfer_socket()) < 0) {
+          return;
+     }
+
+     if (bind(spare_socket, (struct sockaddr *) &any, sizeof(any)) < 0) {
+          perror("server: bind()");
+          close(spare_socket);
+          spare_socket = -1;
+     }
+}
+
+/* set up a transfer for a request and send its first packet; returns 0
+   when t is running, -1 on failure and 1 when the request joined a
+   multicast session, with t already released */
+int transfer_start(tftp_transfer *t, tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen)
+{
+     char *filename, *mode_s, *end;
+     char oack[sizeof(m->request.filename_and_mode)];
+     ssize_t olen;
+     int err;
+
+     memset(t, 0, sizeof(*t));
+     t->cfg = settings_get();
+     t->s = -1;
+     t->client_sock = *client_sock;
+     t->requester = *client_sock;
+     t->slen = slen;
+     t->data_to = &t->client_sock;
+     t->opcode = ntohs(m->opcode);
+     t->blksize = SEGSIZE;
+     t->windowsize = 1;
+     t->rollover = config.rollover;
+     t->cache_entry = -1;
+     t->rto = RTO_INIT < t->cfg->rto_max ? RTO_INIT : t->cfg->rto_max;
+     t->start_us = now_us();
+     worker_count(active);
+
+     /* new socket, on new port, to handle client request */
+
+     if (spare_socket >= 0) {
+          t->s = spare_socket;
+          spare_socket = -1;
+     } else if ((t->s = transfer_socket()) == -1) {
+          transfer_end(t);
+          return -1;
+     }
+
+     /* parse client request */
+
+     filename = (char *) m->request.filename_and_mode;
+     end = &filename[len - 2 - 1];
+
+     if (*end != '\0') {
+          transfer_log(t, "invalid filename or mode");
+          send_error(t->s, EUNDEF, "invalid filename or mode", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     mode_s = strchr(filename, '\0') + 1;
+
+     if (mode_s > end) {
+          transfer_log(t, "transfer mode not specified");
+          send_error(t->s, EUNDEF, "transfer mode not specified", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     if ((olen = transfer_options(t, strchr(mode_s, '\0') + 1, end, oack, sizeof(oack))) < 0) {
+          transfer_log(t, "invalid option");
+          send_error(t->s, EOPTNEG, "invalid option", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     /* from here on the name is relative to the base directory, and files
+        are only ever opened beneath it, see resolve.c */
+
+     if ((filename = (char *) resolve_name(filename, base_directory)) == NULL) {
+          transfer_log(t, "filename outside base directory");
+          send_error(t->s, EUNDEF, "filename outside base directory", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     t->mode = strcasecmp(mode_s, "netascii") == 0 ? NETASCII :
+          strcasecmp(mode_s, "octet") == 0    ? OCTET    :
+          0;
+
+     if (t->mode == 0) {
+          transfer_log(t, "invalid transfer mode");
+          send_error(t->s, EUNDEF, "invalid transfer mode", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     if (!settings_allow(t->cfg, t->opcode, client_sock)) {
+          worker_count(denied);
+          transfer_log(t, "access denied");
+          send_error(t->s, EACCESS, "access denied", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     /* only octet files go out byte for byte, from the cache or a mapping */
+
+     if (t->opcode == WRQ) {
+
+          /* written behind the transfer, to a file that replaces the
+             destination only once the upload is complete */
+
+          resolve_forget(filename);
+
+          if ((t->wb = wb_open(filename, t->blksize, t->windowsize)) == NULL) {
+               err = errno;
+               perror("server: wb_open()");
+               send_error(t->s, tftp_error(err), strerror(err), client_sock, slen);
+               transfer_end(t);
+               return -1;
+          }
+     } else if (vfile_open(t, filename) == 0) {
+          /* rendered in memory, nothing is read from disk */
+     } else if (t->mode == OCTET && transfer_cached(t, filename) == 0) {
+          /* from the cache, the file is not read */
+     } else if ((t->fd = resolve_fopen(filename)) == NULL &&
+                (errno != ENOENT || relay_open(t, filename) < 0)) {
+
+          /* in relay mode a missing file is fetched from upstream */
+
+          err = errno;
+          perror("server: resolve_fopen()");
+          send_error(t->s, tftp_error(err), strerror(err), client_sock, slen);
+          transfer_end(t);
+          return -1;
+     } else if (t->fd != NULL && dedup_open(t) < 0) {
+
+          /* an upload kept as a manifest is read back from its chunks */
+
+          err = errno;
+          perror("server: dedup_open()");
+          send_error(t->s, tftp_error(err), strerror(err), client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     /* the size of a file sent as netascii is not known before it is
+        translated, nor that of one still being fetched, the option is
+        left out as if it were not supported */
+
+     if (t->tsize_requested && !(t->opcode == RRQ && t->mode == NETASCII) && t->relay == NULL) {
+          struct stat st;
+
+          if (t->opcode == RRQ && (t->fd == NULL || fileno(t->fd) < 0)) {
+               t->tsize = t->size;
+          } else if (t->opcode == RRQ && fstat(fileno(t->fd), &st) == 0) {
+               t->tsize = st.st_size;
+          }
+
+          olen += snprintf(oack + olen, sizeof(oack) - olen, "tsize%c%lld", '\0', (long long) t->tsize) + 1;
+
+          if (olen >= sizeof(oack)) {
+               transfer_log(t, "invalid option");
+               send_error(t->s, EOPTNEG, "invalid option", client_sock, slen);
+               transfer_end(t);
+               return -1;
+          }
+     }
+
+     /* packets are built in and received into buffers sized for the
+        negotiated block size, but never smaller than a request */
+
+     t->pkt = malloc(4 + t->blksize + sizeof(tftp_message));
+
+     /* a WRQ receives up to a window of DATA per system call, a RRQ only
+        ever gets acks and errors */
+
+     t->rsize = t->opcode == WRQ ? 4 + t->blksize : sizeof(tftp_message);
+     t->rslots = t->opcode == WRQ && t->windowsize < RECV_BATCH ? t->windowsize : RECV_BATCH;
+     t->rbuf = malloc(t->rslots * t->rsize);
+
+     /* a window of large blocks comes in one burst that the default socket
+        buffer cannot hold, its tail would be dropped every time. A datagram
+        takes up to twice its size in the buffer, the kernel caps the size
+        at net.core.rmem_max */
+
+     if (t->opcode == WRQ && t->windowsize > 1) {
+          int rcvbuf = 2 * t->windowsize * (4 + t->blksize);
+
+          setsockopt(t->s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+     }
+
+     if (t->opcode == RRQ && t->mode == OCTET && t->map == NULL && t->relay == NULL) {
+          transfer_map(t, filename);
+     }
+
+     if (t->opcode == RRQ && t->fd != NULL) {
+          prefetch_start(t);
+     }
+
+     if (t->opcode == RRQ && t->map == NULL) {
+          t->window = malloc(t->windowsize * (4 + t->blksize));
+          t->wlen = malloc(t->windowsize * sizeof(*t->wlen));
+     }
+
+     if (t->mode == NETASCII) {
+          netascii_reset(&t->na);
+     }
+
+     if (t->opcode == RRQ && t->mode == NETASCII) {
+          t->xbuf = malloc(t->blksize);
+     }
+
+     if (t->pkt == NULL || t->rbuf == NULL ||
+         (t->opcode == RRQ && t->map == NULL && (t->window == NULL || t->wlen == NULL)) ||
+         (t->opcode == RRQ && t->mode == NETASCII && t->xbuf == NULL)) {
+          fprintf(stderr, "server: out of memory\n");
+          send_error(t->s, ENOSPACE, "out of memory", client_sock, slen);
+          transfer_end(t);
+          return -1;
+     }
+
+     log_event(LOG_INFO, LOG_REQUEST, client_sock, filename, mode_s, t->opcode, 0, 0);
+
+     if (t->mcast_requested && t->relay == NULL && t->rendered == NULL) {
+          int joined = mcast_start(t, filename, oack, &olen, sizeof(oack));
+
+          if (joined != 0) {
+               transfer_end(t);
+               return joined;
+          }
+     }
+
+     /* answer accepted options with an oack, which the client acknowledges
+        with ack 0 (RRQ) or with data block 1 (WRQ) */
+
+     if (olen > 0) {
+          ((tftp_message *) t->pkt)->opcode = htons(OACK);
+          memcpy(t->pkt + 2, oack, olen);
+          t->last_len = 2 + olen;
+          t->countdown = t->cfg->retries;
+          t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+          t->oack_pending = 1;
+
+          if (transfer_send(t) < 0) {
+               transfer_end(t);
+               return -1;
+          }
+
+          transfer_rtt_start(t, t->opcode == RRQ ? 0 : 1);
+
+          return 0;
+     }
+
+     t->countdown = t->cfg->retries;
+     t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+
+     if ((t->opcode == RRQ ? transfer_fill_window(t) : transfer_ack(t)) < 0) {
+          transfer_end(t);
+          return -1;
+     }
+
+     if (t->opcode == WRQ) {
+          transfer_rtt_start(t, 1);
+     }
+
+     return 0;
+}
+
+/* RRQ: an ack that moves nothing, a stale one from before the last ack
+   or a repeat of it. Resending on every duplicate is the sorcerer's
+   apprentice bug, each block going out once more per copy of the ack
+   that crossed it, so only a repeat with a window is answered: rfc 7440,
+   the client lost part of the window and acks the last block it received
+   in order. That happens once per ack, further copies and a lost resend
+   wait for the retransmission timer */
+static int transfer_dup_ack(tftp_transfer *t, int stale)
+{
+     if (stale || t->windowsize == 1 || t->dup_answered) {
+          return TRANSFER_RUNNING;
+     }
+
+     t->dup_answered = 1;
+
+     return transfer_resend_window(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+}
+
+/* RRQ, multicast: the master acks the last block it holds in order. One
+   promoted mid-session may hold blocks beyond the window or miss some
+   behind it, so its first ack moves the window to wherever it says; block
+   numbers never wrap in a multicast session */
+static int transfer_mcast_ack(tftp_transfer *t, uint16_t block)
+{
+     uint64_t last = t->size / t->blksize + 1;
+
+     if (block > last) {
+          transfer_log(t, "invalid ack number received");
+          send_error(t->s, EBADOP, "invalid ack number", &t->client_sock, t->slen);
+          return mcast_next(t, TRANSFER_FAILED);
+     }
+
+     if (!t->oack_pending && block <= t->acked) {
+          return transfer_dup_ack(t, block < t->acked);
+     }
+
+     if (t->oack_pending || block > t->sent) {
+          t->sent = block;
+          t->to_close = block == last;
+     }
+
+     t->oack_pending = 0;
+     t->dup_answered = 0;
+     t->acked = block;
+     t->countdown = t->cfg->retries;
+     t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+
+     if (t->rtt_start && t->acked >= t->rtt_block) {
+          transfer_rtt_sample(t);
+     }
+
+     if (t->to_close && t->acked == t->sent) {
+          if (t->cache_fill != NULL) {
+               cache_commit(t->cache_entry);
+               t->cache_fill = NULL;
+          }
+          transfer_done(t);
+          return mcast_next(t, TRANSFER_DONE);
+     }
+
+     return transfer_fill_window(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+}
+
+/* process one datagram received on the transfer socket */
+static int transfer_packet(tftp_transfer *t, uint8_t *buf, ssize_t c, struct sockaddr_in *from)
+{
+     tftp_message *m = (tftp_message *) buf;
+     uint8_t *data;
+     size_t dlen;
+     uint32_t n;
+
+     if (from->sin_addr.s_addr != t->client_sock.sin_addr.s_addr ||
+         from->sin_port != t->client_sock.sin_port) {
+          if (t->mcast != NULL) {
+               return mcast_packet(t, buf, c, from);
+          }
+          send_error(t->s, EBADID, "unknown transfer id", from, sizeof(*from));
+          return TRANSFER_RUNNING;
+     }
+
+     if (c < 4) {
+          transfer_log(t, "message with invalid size received");
+          send_error(t->s, EUNDEF, "invalid request size", &t->client_sock, t->slen);
+          return TRANSFER_FAILED;
+     }
+
+     if (ntohs(m->opcode) == ERROR)  {
+          n = ntohs(m->error.error_code);
+          worker_count(errors_received[n < ERROR_CODES ? n : EUNDEF]);
+          buf[c - 1] = '\0';
+          log_event(LOG_WARN, LOG_PEER_ERROR, &t->client_sock, (char *) m->error.error_string,
+                    NULL, n, 0, 0);
+          return t->mcast != NULL ? mcast_next(t, TRANSFER_FAILED) : TRANSFER_FAILED;
+     }
+
+     if (t->opcode == RRQ) {
+
+          if (ntohs(m->opcode) != ACK)  {
+               transfer_log(t, "invalid message during transfer received");
+               send_error(t->s, EBADOP, "invalid message during transfer", &t->client_sock, t->slen);
+               return TRANSFER_FAILED;
+          }
+
+          if (t->mcast != NULL) {
+               return transfer_mcast_ack(t, ntohs(m->ack.block_number));
+          }
+
+          /* acks are cumulative, n is how many blocks this one covers;
+             compared modulo the number space so that rollover works */
+
+          n = transfer_ahead(t, ntohs(m->ack.block_number), t->acked);
+
+          if (n > t->sent - t->acked) {
+
+               /* half the number space behind is an old ack delayed or
+                  repeated by the network, ahead is a broken client */
+
+               if (n > 0x8000) {
+                    return transfer_dup_ack(t, 1);
                }
- 
-               if (ntohs(m.opcode) == ERROR)  {
-                    printf("%s.%u: error message received: %u %s\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port),
-                           ntohs(m.error.error_code), m.error.error_string);
-                    exit(1);
+
+               transfer_log(t, "invalid ack number received");
+               send_error(t->s, EBADOP, "invalid ack number", &t->client_sock, t->slen);
+               return TRANSFER_FAILED;
+          }
+
+          if (n == 0 && !t->oack_pending) {
+               return transfer_dup_ack(t, 0);
+          }
+
+          t->oack_pending = 0;
+          t->dup_answered = 0;
+          t->acked += n;
+          t->countdown = t->cfg->retries;
+          t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+
+          if (t->rtt_start && t->acked >= t->rtt_block) {
+               transfer_rtt_sample(t);
+          }
+
+          if (t->to_close && t->acked == t->sent) {
+               if (t->cache_fill != NULL) {
+                    cache_commit(t->cache_entry);
+                    t->cache_fill = NULL;
                }
- 
-               if (ntohs(m.opcode) != DATA)  {
-                    printf("%s.%u: invalid message during transfer received\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    send_error(s, 0, "invalid message during transfer", client_sock, slen);
-                    exit(1);
+               transfer_done(t);
+               return TRANSFER_DONE;
+          }
+
+          return transfer_fill_window(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+
+     }
+
+     if (ntohs(m->opcode) != DATA)  {
+          transfer_log(t, "invalid message during transfer received");
+          send_error(t->s, EBADOP, "invalid message during transfer", &t->client_sock, t->slen);
+          return TRANSFER_FAILED;
+     }
+
+     worker_add(bytes_received, c - 4);
+     t->oack_pending = 0;
+
+     /* once the last block is queued, repeats of it wait for the commit */
+
+     if (t->committing) {
+          return TRANSFER_RUNNING;
+     }
+
+     if (ntohs(m->data.block_number) != transfer_wire(t, t->received + 1)) {
+
+          /* a retransmission or a block after a lost one, ack the last block
+             received in order so that the client resends from there */
+
+          t->in_window = 0;
+          t->rtt_start = 0;
+
+          return transfer_ack(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+     }
+
+     /* the block goes to the write-behind ring, transfer_input() only
+        reads as many datagrams as it has free slots */
+
+     data = wb_slot(t->wb);
+
+     if (t->mode == NETASCII) {
+
+          /* the last block also carries out a CR held back from the one
+             before, since no LF or NUL can follow it any more */
+
+          dlen = netascii_decode(&t->na, buf + 4, c - 4, data);
+
+          if (c - 4 < t->blksize) {
+               dlen += netascii_flush(&t->na, data + dlen);
+          }
+     } else {
+          dlen = c - 4;
+          memcpy(data, buf + 4, dlen);
+     }
+
+     wb_push(t->wb, dlen, c - 4 < t->blksize);
+     t->bytes += c - 4;
+
+     t->received++;
+     t->countdown = t->cfg->retries;
+     t->idle_deadline = now_ms() + t->cfg->idle_timeout;
+
+     if (t->rtt_start && t->received == t->rtt_block) {
+          transfer_rtt_sample(t);
+     }
+
+     /* the last block is acked once the file is committed */
+
+     if (c - 4 < t->blksize) {
+          t->committing = 1;
+          t->deadline = now_ms() + t->rto;
+          return TRANSFER_RUNNING;
+     }
+
+     /* ack once per window */
+
+     if (++t->in_window < t->windowsize) {
+          t->deadline = now_ms() + t->rto;
+          return TRANSFER_RUNNING;
+     }
+
+     t->in_window = 0;
+
+     if (transfer_ack(t) < 0) {
+          return TRANSFER_FAILED;
+     }
+
+     transfer_rtt_start(t, t->received + 1);
+
+     return TRANSFER_RUNNING;
+}
+
+/* WRQ: see what the write-behind stage did, the final ack goes out once
+   the upload is committed */
+static int transfer_writer(tftp_transfer *t)
+{
+     int err;
+
+     switch (wb_poll(t->wb)) {
+     case WB_FAILED:
+          err = errno;
+          perror("server: write-behind");
+          if (tftp_error(err) == ENOSPACE) {
+               send_error(t->s, ENOSPACE, "disk full or allocation exceeded", &t->client_sock, t->slen);
+          } else {
+               send_error(t->s, tftp_error(err), strerror(err), &t->client_sock, t->slen);
+          }
+          transfer_log(t, "transfer killed");
+          return TRANSFER_FAILED;
+
+     case WB_DONE:
+          if (transfer_ack(t) < 0) {
+               return TRANSFER_FAILED;
+          }
+          transfer_done(t);
+          return TRANSFER_DONE;
+     }
+
+     return TRANSFER_RUNNING;
+}
+
+/* the transfer socket or the write-behind eventfd is readable, process
+   what the client sent: batches of datagrams, as many as a window, are
+   taken per system call until the socket is drained. A WRQ takes no more
+   than its write-behind ring has room for and stalls when it is full */
+int transfer_input(tftp_transfer *t)
+{
+     struct sockaddr_in from[RECV_BATCH];
+     ssize_t lens[RECV_BATCH];
+     int i, n, slots, status = TRANSFER_RUNNING;
+
+     if (t->wb != NULL && (status = transfer_writer(t)) != TRANSFER_RUNNING) {
+          return status;
+     }
+
+     do {
+          slots = t->rslots;
+
+          if (t->wb != NULL && !t->committing) {
+               n = wb_space(t->wb);
+               slots = n < slots ? n : slots;
+
+               if ((t->stalled = slots == 0)) {
+                    break;
                }
-               
-               if (ntohs(m.ack.block_number) != block_number) {
-                    printf("%s.%u: invalid block number received\n", 
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    send_error(s, 0, "invalid block number", client_sock, slen);
-                    exit(1);
+          }
+
+          if ((n = recv_batch(t->s, t->rbuf, t->rsize, slots, from, lens, 0)) < 0) {
+               transfer_log(t, "transfer killed");
+               return TRANSFER_FAILED;
+          }
+
+          for (i = 0; i < n && status == TRANSFER_RUNNING; i++) {
+               status = transfer_packet(t, t->rbuf + i * t->rsize, lens[i], &from[i]);
+          }
+
+     } while (n > 0 && status == TRANSFER_RUNNING);
+
+     return status;
+}
+
+/* the retransmission or the idle timer expired */
+int transfer_timeout(tftp_transfer *t)
+{
+     uint64_t now = now_ms();
+
+     /* a slow disk is not the client's fault: while the writer catches up
+        or commits, the timers only wait */
+
+     if (t->stalled || t->committing) {
+          t->deadline = now + t->rto;
+          t->idle_deadline = now + t->cfg->idle_timeout;
+          return TRANSFER_RUNNING;
+     }
+
+     /* a client that keeps the transfer going without it ever advancing */
+
+     if (now >= t->idle_deadline) {
+          transfer_log(t, "transfer idle");
+          return t->mcast != NULL ? mcast_next(t, TRANSFER_FAILED) : TRANSFER_FAILED;
+     }
+
+     if (now < t->deadline) {
+          return TRANSFER_RUNNING;
+     }
+
+     /* the fetch a transfer follows may have got further */
+
+     if (t->relay_wait) {
+          t->relay_wait = 0;
+          return transfer_fill_window(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+     }
+
+     /* the rate limits let blocks held back go now */
+
+     if (t->pace_last != 0) {
+          return transfer_send_blocks(t, t->pace_first, t->pace_last) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+     }
+
+     worker_count(timeouts);
+
+     if (--t->countdown <= 0) {
+          transfer_log(t, "transfer timed out");
+          return t->mcast != NULL ? mcast_next(t, TRANSFER_FAILED) : TRANSFER_FAILED;
+     }
+
+     /* back off exponentially until a fresh sample is taken */
+
+     t->rtt_start = 0;
+
+     if (!t->rto_fixed) {
+          t->rto = 2 * t->rto < t->cfg->rto_max ? 2 * t->rto : t->cfg->rto_max;
+     }
+
+     /* resend what is outstanding: the oack, the unacknowledged part of
+        the window, or the last ack; a duplicate may be answered again */
+
+     t->dup_answered = 0;
+
+     if (t->opcode == RRQ && !t->oack_pending) {
+          return transfer_resend_window(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+     }
+
+     t->in_window = 0;
+     t->resent++;
+     worker_count(retransmits);
+
+     /* a WRQ whose window was cut short acks the blocks it got, the oack
+        may still be the last packet sent */
+
+     if (t->opcode == WRQ && !t->oack_pending) {
+          return transfer_ack(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+     }
+
+     return transfer_send(t) < 0 ? TRANSFER_FAILED : TRANSFER_RUNNING;
+}
+
+void transfer_end(tftp_transfer *t)
+{
+     if (t->start_us != 0) {
+          worker_add(active, -1);
+          t->start_us = 0;
+     }
+
+     if (t->wb != NULL) {
+          wb_close(t->wb);
+          t->wb = NULL;
+     }
+
+     if (t->mcast != NULL) {
+          mcast_end(t);
+     }
+
+     if (t->mapping != NULL) {
+          munmap(t->mapping, t->size);
+          t->mapping = NULL;
+     }
+
+     if (t->cache_entry >= 0) {
+          cache_release(t->cache_entry);
+          t->cache_entry = -1;
+     }
+
+     t->map = NULL;
+
+     if (t->fd != NULL) {
+          fclose(t->fd);
+          t->fd = NULL;
+     }
+
+     if (t->s >= 0) {
+          close(t->s);
+          t->s = -1;
+     }
+
+     free(t->pkt);
+     free(t->rbuf);
+     free(t->window);
+     free(t->wlen);
+     free(t->xbuf);
+     free(t->relay);
+     free(t->rendered);
+     t->pkt = t->rbuf = t->window = t->xbuf = NULL;
+     t->relay = NULL;
+     t->rendered = NULL;
+     t->wlen = NULL;
+
+     if (t->cfg != NULL) {
+          settings_put(t->cfg);
+          t->cfg = NULL;
+     }
+}
+
+/* serve a single transfer to completion, in a forked child or a process
+   of the pool; returns TRANSFER_DONE or TRANSFER_FAILED */
+int transfer_serve(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen)
+{
+     tftp_transfer t;
+     struct pollfd pfd[2];
+     uint64_t now, deadline;
+     int status = TRANSFER_RUNNING, n;
+
+     if (transfer_start(&t, m, len, client_sock, slen) < 0) {
+          worker_count(failed);
+          return TRANSFER_FAILED;
+     }
+
+     pfd[0].fd = t.s;
+     pfd[1].fd = t.wb != NULL ? wb_eventfd(t.wb) : -1;
+     pfd[1].events = POLLIN;
+
+     do {
+          /* the socket is left alone while the write-behind ring is full */
+
+          pfd[0].events = t.stalled ? 0 : POLLIN;
+          now = now_ms();
+          deadline = t.deadline < t.idle_deadline ? t.deadline : t.idle_deadline;
+          n = poll(pfd, 2, deadline > now ? deadline - now : 0);
+
+          if (n < 0 && errno == EINTR) {
+               continue;
+          }
+
+          if (n < 0) {
+               perror("server: poll()");
+               status = TRANSFER_FAILED;
+               break;
+          }
+
+          status = n ? transfer_input(&t) : transfer_timeout(&t);
+
+     } while (status == TRANSFER_RUNNING);
+
+     transfer_end(&t);
+
+     if (status == TRANSFER_DONE) {
+          worker_count(completed);
+          return TRANSFER_DONE;
+     }
+
+     worker_count(failed);
+     return TRANSFER_FAILED;
+}
+
+/* the fork-per-request model: the child serves one transfer and exits,
+   once an upstream fetch it started is done */
+void handle_request(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen)
+{
+     int status = transfer_serve(m, len, client_sock, slen);
+
+     relay_wait();
+     exit(status == TRANSFER_DONE ? 0 : 1);
+}
+
+/* fork a child to serve a request admitted against the limit; the main
+   thread reaps it and gives its place back */
+static void fork_start(int s, struct session_table *sessions, tftp_message *m, ssize_t len,
+                       struct sockaddr_in *from)
+{
+     struct session *ss;
+     sigset_t none;
+     pid_t pid;
+
+     worker_count(requests);
+
+     if ((pid = fork()) == 0) {
+          sigemptyset(&none);
+          pthread_sigmask(SIG_SETMASK, &none, NULL);
+          close(s);
+          handle_request(m, len, from, sizeof(*from));
+          exit(0);
+     }
+
+     if (pid < 0) {
+          perror("server: fork()");
+          admit_release();
+          return;
+     }
+
+     if ((ss = session_find(sessions, from)) != NULL || (ss = session_add(sessions, from)) != NULL) {
+          ss->pid = pid;
+     }
+
+     if (sessions->count >= sessions->sweep_at) {
+          session_sweep(sessions);
+     }
+}
+
+/* read requests from s and fork a child process for each of them */
+void fork_loop(int s)
+{
+     tftp_message messages[RECV_BATCH];
+     struct sockaddr_in from[RECV_BATCH];
+     ssize_t lens[RECV_BATCH];
+     struct session_table sessions;
+     struct request_queue queue;
+     struct queued_request r;
+     struct session *ss;
+     struct pollfd pfd = { s, POLLIN, 0 };
+     int i, n;
+
+     session_init(&sessions);
+
+     if (queue_init(&queue, config.queue_len) < 0) {
+          fprintf(stderr, "server: out of memory\n");
+          exit(1);
+     }
+
+     while (1) {
+
+          /* with requests waiting, look for room for them now and then */
+
+          if (queue.count > 0) {
+               n = poll(&pfd, 1, QUEUE_POLL) > 0 ?
+                    recv_batch(s, (uint8_t *) messages, sizeof(*messages), RECV_BATCH, from, lens, 0) : 0;
+          } else {
+               n = recv_batch(s, (uint8_t *) messages, sizeof(*messages), RECV_BATCH, from, lens, 1);
+          }
+
+          for (i = 0; i < n; i++) {
+
+               if (!check_request(s, &messages[i], lens[i], &from[i], sizeof(from[i]))) {
+                    continue;
                }
- 
-               c = fwrite(m.data.data, 1, c - 4, fd);
- 
-               if (c < 0) {
-                    perror("server: fwrite()");
-                    exit(1);
+
+               /* the client repeated its request before the reply of the
+                  child serving it arrived, or while it waits */
+
+               if (((ss = session_find(&sessions, &from[i])) != NULL &&
+                    (kill(ss->pid, 0) == 0 || errno != ESRCH)) || queue_find(&queue, &from[i])) {
+                    worker_count(duplicates);
+                    log_event(LOG_DEBUG, LOG_MESSAGE, &from[i], "duplicate request ignored",
+                              NULL, 0, 0, 0);
+                    continue;
                }
- 
-               c = send_ack(s, block_number, client_sock, slen);
-           
-               if (c < 0) {
-                    printf("%s.%u: transfer killed\n",
-                           inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
-                    exit(1);
+
+               if (queue.count > 0 || !admit_take()) {
+                    queue_hold(&queue, s, &messages[i], lens[i], &from[i]);
+                    continue;
                }
- 
-          }
- 
-     }
- 
-     printf("%s.%u: transfer completed\n",
-            inet_ntoa(client_sock->sin_addr), ntohs(client_sock->sin_port));
- 
-     fclose(fd);
-     close(s);
- 
-     exit(0);
-}
\ No newline at end of file
+
+               fork_start(s, &sessions, &messages[i], lens[i], &from[i]);
+          }
+
+          while (queue_next(&queue, &r)) {
+               fork_start(s, &sessions, &r.m, r.len, &r.from);
+          }
+     }
+}
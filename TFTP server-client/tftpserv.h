@@ -1,7 +1,14 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/errno.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -11,62 +18,615 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/wait.h>
- 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 /* base directory */
-char *base_directory;
- 
-#define RECV_TIMEOUT 5
+extern char *base_directory;
+
+/* runtime settings, filled in from the command line */
+struct server_config {
+     int event_mode;                 /* -e: one event loop per worker instead of fork per request */
+     int workers;                    /* -w: listening sockets, one thread each */
+     int pin_cpus;                   /* -c: pin worker n to cpu n */
+     int rto_min;                    /* -t: retransmission timeout bounds, in ms */
+     int rto_max;                    /* -T */
+     int cache_mb;                   /* -m: shared file cache size, 0 to disable */
+     struct in_addr mcast_group;     /* -M: first group of multicast sessions, INADDR_ANY if off */
+     int mcast_port;
+     struct in_addr mcast_if;        /* -i: address of the interface multicast goes out of */
+     int fsync_policy;               /* -F: when uploads are synced to disk */
+     int fsync_mb;                   /* and how often, for FSYNC_PERIODIC */
+     char *metrics_path;             /* -P: file the metrics are written to, NULL if off */
+     int log_level;                  /* -L: most verbose level logged */
+     int log_sample;                 /* -S: log one in this many info events */
+     int log_format;                 /* -O: how the log is written out */
+     uint64_t rate_global;           /* -B: DATA rate limits in bytes/s, 0 for none: overall */
+     uint64_t rate_client;           /* -C: per client address */
+     uint64_t rate_subnet;           /* -N: per subnet */
+     int subnet_prefix;              /* of those subnets */
+     int max_transfers;              /* -A: transfers at once, 0 for no limit */
+     int queue_len;                  /* -Q: requests per worker waiting for one to end */
+     int rollover;                   /* -R: block number after 65535, unless a client asks */
+     struct sockaddr_in relay_upstream; /* -U: server missing files are fetched from, port 0 if off */
+     char *vfile_table;              /* -V: patterns of the virtual files, NULL if none */
+     char *dedup_store;              /* -D: uploads are deduplicated into this store, NULL if off */
+     int prefork;                    /* -p: processes each worker keeps ready, 0 to fork per request */
+     char *settings_file;            /* -f: settings reloaded on SIGHUP, NULL if none */
+};
+
+/* fsync policies for uploads */
+enum fsync_policy {
+     FSYNC_COMMIT,                   /* once, before the file replaces the destination */
+     FSYNC_NONE,                     /* never, left to the kernel */
+     FSYNC_PERIODIC                  /* every fsync_mb MB written, and at the commit */
+};
+
+extern struct server_config config;
+
 #define RECV_RETRIES 5
- 
+
+/* retransmission timeout, in ms: the initial value and the default bounds
+   for the one adapted from measured rtts */
+#define RTO_INIT 1000
+#define RTO_MIN 20
+#define RTO_MAX 10000
+
+/* data block sizes, rfc 1350 and rfc 2348 */
+#define SEGSIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+
+/* largest window granted to a client, rfc 7440 */
+#define MAX_WINDOWSIZE 64
+
+/* datagrams per recvmmsg() and sendmmsg() call, and the limits of one
+   udp gso send */
+#define RECV_BATCH 16
+#define SEND_BATCH 64
+#define GSO_SEGMENTS 64
+#define GSO_BYTES 65000
+
+/* least read-ahead of a RRQ, in bytes, beyond the block being sent */
+#define READAHEAD_BYTES (1 << 20)
+
+/* write-behind ring of a WRQ: its size in bytes, and at most that many
+   blocks whatever the block size */
+#define WB_RING_BYTES (4 << 20)
+#define WB_SLOTS 1024
+
+/* writer threads per process, shared by its uploads, and the blocks a
+   writer writes out of one upload before the next gets its turn */
+#define WB_THREADS 16
+#define WB_BURST 64
+
+/* multicast sessions, rfc 2090: groups handed out from the configured one
+   before reusing it, and the ttl of the datagrams sent to them */
+#define MCAST_GROUPS 256
+#define MCAST_TTL 1
+
+/* a transfer is dropped when nothing is heard from its client for this
+   long, in ms, whatever it is waiting for */
+#define IDLE_TIMEOUT 60000
+
+/* timing wheel: levels of slots, each slot of a level spanning all the
+   slots of the level below */
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS 64
+
+struct timer {
+     uint64_t expires;               /* in ms */
+     struct timer *prev, *next;      /* NULL when not armed */
+     int slot;                       /* level * WHEEL_SLOTS + slot, -1 once expired */
+     void *data;
+};
+
+struct timer_wheel {
+     uint64_t now;                   /* the next tick to process */
+     int count;                      /* armed timers */
+     uint64_t occupied[WHEEL_LEVELS];
+     struct timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+     struct timer expired;           /* taken off the wheel, not returned yet */
+};
+
+/* a request is dropped from the admission queue after waiting this long,
+   in ms, when its client has probably given up */
+#define QUEUE_TIMEOUT 10000
+
+/* how often, in ms, a worker with requests waiting looks for a transfer
+   that ended elsewhere */
+#define QUEUE_POLL 10
+
+/* how often, in ms, a worker with a process pool checks that none of its
+   processes has died */
+#define PREFORK_CHECK 1000
+
+/* most processes of a worker's pool, spares started for a burst
+   included, and how long in ms a spare waits for a request before it
+   ends */
+#define PREFORK_MAX 64
+#define PREFORK_IDLE 5000
+
+/* relay mode: the options asked of upstream, its retransmission timeout
+   in ms, and how often, in ms, a transfer that caught up with a fetch
+   looks whether it got further */
+#define RELAY_BLKSIZE 1428
+#define RELAY_WINDOWSIZE 8
+#define RELAY_TIMEOUT 1000
+#define RELAY_POLL 5
+
+/* access rules of the reloadable settings, the first rule matching a
+   request decides */
+#define ACCESS_RULES 64
+
+struct access_rule {
+     int allow;
+     int ops;                        /* 1 << RRQ, 1 << WRQ or both */
+     uint32_t net;                   /* host byte order */
+     uint32_t mask;
+};
+
+/* settings a transfer runs under from its start to its end, reloaded from
+   the -f file on SIGHUP, see settings.c; they default to the command line */
+struct settings {
+     _Atomic int refs;               /* transfers using this copy, plus one while it is current */
+     uint64_t generation;
+     int rto_min;                    /* retransmission timeout bounds, in ms */
+     int rto_max;
+     int retries;                    /* times the last packet is sent again before giving up */
+     int idle_timeout;               /* in ms, see IDLE_TIMEOUT */
+     int blksize_max;                /* largest blksize and windowsize granted */
+     int windowsize_max;
+     int cache_mb;                   /* at most the size the cache started with */
+     uint64_t rate_global;           /* DATA rate limits in bytes/s, 0 for none */
+     uint64_t rate_client;
+     uint64_t rate_subnet;
+     int subnet_prefix;
+     int max_transfers;              /* 0 for no limit */
+     int rules;
+     struct access_rule rule[ACCESS_RULES];
+};
+
+/* reloads so far, see settings_report() */
+struct settings_stats {
+     uint64_t generation;
+     uint64_t reloads;
+     uint64_t failures;
+     uint64_t last_us;               /* time the last reload took */
+     int last_ok;                    /* and whether the file was valid */
+};
+
+/* a client with a transfer running for it, see session.c */
+struct session {
+     uint32_t addr;                  /* network byte order, 0 in a free slot */
+     uint16_t port;
+     pid_t pid;                      /* fork mode: the child serving it */
+     void *data;                     /* event mode: its transfer */
+};
+
+struct session_table {
+     struct session *slots;
+     size_t size;                    /* a power of two */
+     size_t count;
+     size_t sweep_at;                /* fork mode: count at which ended children are dropped */
+};
+
 /* tftp opcode mnemonic */
 enum opcode {
      RRQ=1,
      WRQ,
      DATA,
      ACK,
-     ERROR
+     ERROR,
+     OACK
 };
- 
+
+/* tftp error codes */
+enum error_code {
+     EUNDEF,                         /* not defined, see error message */
+     ENOTFOUND,                      /* file not found */
+     EACCESS,                        /* access violation */
+     ENOSPACE,                       /* disk full or allocation exceeded */
+     EBADOP,                         /* illegal tftp operation */
+     EBADID,                         /* unknown transfer id */
+     EEXISTS,                        /* file already exists */
+     ENOUSER,                        /* no such user */
+     EOPTNEG                         /* option negotiation failed, rfc 2347 */
+};
+
+#define ERROR_CODES (EOPTNEG + 1)
+
 /* tftp transfer mode */
 enum mode {
      NETASCII=1,
      OCTET
 };
- 
- 
- 
+
+/* netascii translation state, carried over from one block to the next */
+struct netascii {
+     int pending;                    /* encoder: second byte of a pair cut by the block end, -1 if none */
+     int cr;                         /* decoder: the last block ended with a CR */
+};
+
+/* instruction sets netascii_init() can scan text with */
+enum netascii_isa {
+     NETASCII_SCALAR,
+     NETASCII_SSE2,
+     NETASCII_AVX2
+};
+
+/* how resolve_init() has paths opened beneath the base directory */
+enum resolver {
+     RESOLVER_OPENAT2,               /* openat2() with RESOLVE_BENEATH, when the kernel has it */
+     RESOLVER_WALK                   /* openat() of one component after the other */
+};
+
 /* tftp message structure */
 typedef union {
- 
+
      uint16_t opcode;
- 
+
      struct {
-          uint16_t opcode; /* RRQ or WRQ */            
+          uint16_t opcode; /* RRQ or WRQ */
           uint8_t filename_and_mode[514];
-     } request;     
- 
+     } request;
+
      struct {
           uint16_t opcode; /* DATA */
           uint16_t block_number;
           uint8_t data[512];
      } data;
- 
+
      struct {
-          uint16_t opcode; /* ACK */            
+          uint16_t opcode; /* ACK */
           uint16_t block_number;
      } ack;
- 
+
      struct {
-          uint16_t opcode; /* ERROR */    
+          uint16_t opcode; /* ERROR */
           uint16_t error_code;
           int8_t error_string[512];
      } error;
- 
+
 } tftp_message;
- 
-void cld_handler(int sig);
+
+/* transfer state, one per RRQ or WRQ being served */
+typedef struct tftp_transfer {
+
+     int s;                          /* socket bound to our transfer id */
+     FILE *fd;
+
+     int opcode;
+     int mode;
+
+     struct sockaddr_in client_sock;
+     socklen_t slen;
+     struct sockaddr_in requester;   /* who sent the request, its session's key */
+     struct settings *cfg;           /* settings in force when it started */
+
+     int blksize;                    /* negotiated data block size */
+     int rollover;                   /* block number on the wire after 65535, 0 or 1 */
+     int windowsize;                 /* negotiated blocks per ack, rfc 7440 */
+     uint64_t pace_first;            /* RRQ: blocks held back by pacing, none if pace_last is 0 */
+     uint64_t pace_last;
+     int oack_pending;               /* oack sent, no reply from the client yet */
+     int dup_answered;               /* RRQ: the window was resent for a duplicate ack, the
+                                        next ones wait for progress or the timer */
+     int countdown;                  /* retransmissions left for the last packet */
+     int to_close;                   /* last block is in flight */
+     uint64_t deadline;              /* when the last packet times out, in ms */
+     uint64_t idle_deadline;         /* when the client counts as gone, in ms */
+     struct timer timer;             /* event loop timers for the two deadlines */
+     struct timer idle_timer;
+
+     /* rtt estimation (rfc 6298, with karn's rule), rtts in microseconds */
+     int rto;                        /* retransmission timeout, in ms */
+     int rto_fixed;                  /* set by the timeout option (rfc 2349) */
+     int64_t srtt;
+     int64_t rttvar;
+     uint64_t rtt_start;             /* send time of the packet being timed, 0 if none */
+     uint64_t rtt_block;             /* block the reply to it must cover */
+
+     int tsize_requested;            /* tsize option (rfc 2349) */
+     long long tsize;
+
+     /* netascii mode: translation state, and for a RRQ a buffer of blksize
+        bytes the file is read into before it is translated */
+     struct netascii na;
+     uint8_t *xbuf;
+     size_t xpos;
+     size_t xlen;
+     uint64_t xoff;                  /* file offset of the next read */
+
+     int mcast_requested;            /* multicast option (rfc 2090) */
+     struct mcast_session *mcast;    /* session this transfer sends for, NULL if unicast */
+     struct sockaddr_in *data_to;    /* where DATA goes: the client or the multicast group */
+
+     /* RRQ: blocks are counted from 1 without wrapping; blocks of a cached
+        or mapped regular file are sent from map by offset, otherwise the
+        window holds the packets of blocks acked + 1 to sent */
+     uint64_t acked;
+     uint64_t sent;
+     const uint8_t *map;
+     void *mapping;                  /* the file mapping, NULL when served from the cache */
+     uint64_t size;
+     int cache_entry;                /* pin of a cached or reserved entry, -1 if none */
+     uint8_t *cache_fill;            /* reserved entry being filled as blocks go out */
+     uint8_t *window;
+     size_t *wlen;
+     char *relay;                    /* partial file of the upstream fetch the file is read
+                                        from as it grows, NULL if none, see relay.c */
+     int relay_wait;                 /* the fetch is behind, the timer looks again */
+     uint8_t *rendered;              /* a virtual file, map points to it, see vfile.c */
+
+     /* RRQ read-ahead: bytes kept ahead of the sender, 0 when the file is
+        not read ahead, the offset read ahead up to, and the file size */
+     size_t ra_size;
+     uint64_t ra_next;
+     uint64_t ra_end;
+
+     /* WRQ: blocks received in order, counted from 1 without wrapping, and
+        since our last ack; blocks go to the disk through the write-behind
+        stage */
+     uint64_t received;
+     int in_window;
+     struct write_behind *wb;
+     int stalled;                    /* its ring is full, the socket is not read */
+     int committing;                 /* the last block is queued, the final ack waits for the commit */
+
+     uint8_t *pkt;                   /* last packet sent, kept for retransmission */
+     ssize_t last_len;
+     uint8_t *rbuf;                  /* receive buffers, rslots of rsize bytes */
+     size_t rsize;
+     int rslots;
+
+     /* statistics: start time in microseconds, 0 once the transfer has
+        ended, data bytes moved and packets sent again */
+     uint64_t start_us;
+     uint64_t bytes;
+     uint64_t resent;
+
+     struct tftp_transfer *prev, *next;
+
+} tftp_transfer;
+
+/* histogram buckets: bucket i counts the values up to 2^i units, the last
+   one everything above */
+#define HIST_BUCKETS 32
+
+struct histogram {
+     _Atomic uint64_t bucket[HIST_BUCKETS];
+     _Atomic uint64_t sum;
+     _Atomic uint64_t count;
+};
+
+/* log levels, output formats and what a record tells, see log_event() */
+enum log_level {
+     LOG_ERROR,
+     LOG_WARN,
+     LOG_INFO,
+     LOG_DEBUG
+};
+
+enum log_format {
+     LOG_FORMAT_TEXT,                /* the client and a message per line */
+     LOG_FORMAT_JSON,                /* an object per line */
+     LOG_FORMAT_BINARY               /* the records as they are */
+};
+
+enum log_kind {
+     LOG_MESSAGE,                    /* text */
+     LOG_REQUEST,                    /* a: opcode, text: filename, arg: mode */
+     LOG_COMPLETED,                  /* a: bytes, b: us, c: packets resent */
+     LOG_PEER_ERROR,                 /* a: error code, text: its message */
+     LOG_BAD_OPCODE,                 /* a: opcode */
+     LOG_MCAST                       /* text, a: group address, b: port */
+};
+
+/* records the log ring holds before events are dropped, and the room for
+   strings in one, which are cut short to fit */
+#define LOG_SLOTS 8192
+#define LOG_TEXT 100
+
+struct log_record {
+     _Atomic uint64_t seq;           /* turn of the ring the slot is in */
+     uint64_t time_us;               /* wall clock */
+     uint64_t a, b, c;
+     uint32_t addr;                  /* client, network byte order */
+     uint16_t port;
+     uint8_t level;
+     uint8_t kind;
+     int32_t pid;
+     char text[LOG_TEXT];
+     char arg[16];
+};
+
+/* a request waiting for admission */
+struct queued_request {
+     tftp_message m;
+     ssize_t len;
+     struct sockaddr_in from;
+     uint64_t since;                 /* in ms */
+};
+
+struct request_queue {
+     struct queued_request *entries;
+     int size;
+     int head;
+     int count;
+};
+
+/* per worker counters, these live in shared memory so that children forked
+   by a worker can update them too. Only the worker and its children write
+   them, with relaxed atomics, and they are summed up when read */
+struct worker_stats {
+     _Atomic uint64_t requests;
+     _Atomic uint64_t duplicates;    /* requests repeated while their transfer runs, dropped */
+     _Atomic uint64_t queued;        /* requests that waited for a transfer to end */
+     _Atomic uint64_t rejected;      /* requests turned away with the queue full */
+     _Atomic uint64_t denied;        /* requests refused by an access rule */
+     _Atomic uint64_t paced;         /* sends held back by a rate limit */
+     _Atomic uint64_t send_drops;    /* DATA blocks the socket had no room for */
+     _Atomic uint64_t relay_fetches; /* relay: files fetched from upstream */
+     _Atomic uint64_t relay_joined;  /* requests that followed a fetch already running */
+     _Atomic uint64_t relay_failed;  /* fetches that failed */
+     _Atomic uint64_t vfile_hits;    /* virtual files taken from the render cache */
+     _Atomic uint64_t vfile_renders; /* and rendered from their template */
+     _Atomic uint64_t dedup_chunks;  /* chunks of uploads new to the store */
+     _Atomic uint64_t dedup_duplicates; /* and those it had already */
+     _Atomic uint64_t dedup_bytes_stored;
+     _Atomic uint64_t dedup_bytes_saved;
+     _Atomic uint64_t completed;
+     _Atomic uint64_t failed;
+     _Atomic uint64_t disk_reads;    /* RRQ sends and reads from a file */
+     _Atomic uint64_t disk_stalls;   /* of them, those that waited for the disk */
+     _Atomic uint64_t active;        /* transfers started and not ended yet */
+     _Atomic uint64_t bytes_sent;    /* DATA payload, retransmissions included */
+     _Atomic uint64_t bytes_received;
+     _Atomic uint64_t retransmits;   /* blocks, oacks and acks sent again */
+     _Atomic uint64_t timeouts;      /* retransmission timer expirations */
+     _Atomic uint64_t errors_sent[ERROR_CODES];
+     _Atomic uint64_t errors_received[ERROR_CODES];
+     struct histogram duration;      /* of completed transfers, in us */
+     struct histogram rtt;           /* per block round trip, in us */
+     struct histogram throughput;    /* of completed transfers, in bytes/s */
+     struct histogram vfile_render;  /* time to produce a virtual file, in ns */
+} __attribute__((aligned(64)));
+
+/* a listening socket bound with SO_REUSEPORT and the thread reading it */
+struct worker {
+     int id;
+     int cpu;                        /* -1 when not pinned */
+     int s;
+     pthread_t thread;
+     struct worker_stats *stats;
+};
+
+extern __thread struct worker *current_worker;
+
+#define worker_add(field, n) \
+     atomic_fetch_add_explicit(&current_worker->stats->field, n, memory_order_relaxed)
+#define worker_count(field) worker_add(field, 1)
+#define worker_observe(field, value) \
+     metrics_observe(&current_worker->stats->field, value)
+
+/* wb_poll() results */
+enum wb_state {
+     WB_RUNNING,
+     WB_DONE,                        /* written, synced and renamed over the destination */
+     WB_FAILED
+};
+
+/* transfer_input() and transfer_timeout() results */
+enum transfer_status {
+     TRANSFER_FAILED = -1,
+     TRANSFER_RUNNING,
+     TRANSFER_DONE
+};
+
+uint64_t now_ms(void);
+uint64_t now_us(void);
 ssize_t tftp_send_data(int s, uint16_t block_number, uint8_t *data, ssize_t dlen, struct sockaddr_in *sock, socklen_t slen);
 ssize_t send_ack(int s, uint16_t block_number, struct sockaddr_in *sock, socklen_t slen);
-ssize_t send_error(int s, int error_code, char *error_string, struct sockaddr_in *sock, socklen_t slen);
+int tftp_error(int err);
+ssize_t send_error(int s, int error_code, const char *error_string, struct sockaddr_in *sock, socklen_t slen);
 ssize_t recv_message(int s, tftp_message *m, struct sockaddr_in *sock, socklen_t *slen);
-void handle_request(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen);
\ No newline at end of file
+int check_request(int s, tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen);
+int transfer_start(tftp_transfer *t, tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen);
+int transfer_input(tftp_transfer *t);
+int transfer_timeout(tftp_transfer *t);
+void transfer_end(tftp_transfer *t);
+int recv_batch(int s, uint8_t *bufs, size_t size, int n, struct sockaddr_in *from, ssize_t *lens, int wait);
+int send_batch(int s, struct sockaddr_in *to, socklen_t tolen, struct iovec *iov, int n, int iovs, size_t seg);
+void cache_init(size_t bytes);
+int cache_lookup(const char *path, struct stat *st, const uint8_t **data);
+int cache_reserve(const char *path, struct stat *st, uint8_t **data);
+void cache_commit(int p);
+void cache_release(int p);
+void cache_reap(pid_t pid);
+void cache_limit(size_t bytes);
+void report_cache(FILE *f);
+void session_init(struct session_table *st);
+struct session *session_find(struct session_table *st, struct sockaddr_in *sock);
+struct session *session_add(struct session_table *st, struct sockaddr_in *sock);
+void session_del(struct session_table *st, struct sockaddr_in *sock);
+void session_sweep(struct session_table *st);
+void timer_init(struct timer_wheel *w, uint64_t now);
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+struct timer *timer_expired(struct timer_wheel *w, uint64_t now);
+int timer_next(struct timer_wheel *w, uint64_t now);
+struct write_behind *wb_open(const char *path, size_t blksize, int windowsize);
+int wb_eventfd(struct write_behind *w);
+int wb_space(struct write_behind *w);
+uint8_t *wb_slot(struct write_behind *w);
+void wb_push(struct write_behind *w, size_t len, int last);
+int wb_poll(struct write_behind *w);
+void wb_close(struct write_behind *w);
+const char *netascii_init(int isa);
+void netascii_reset(struct netascii *n);
+size_t netascii_encode(struct netascii *n, const uint8_t *in, size_t *inlen, uint8_t *out, size_t outlen);
+size_t netascii_decode(struct netascii *n, const uint8_t *in, size_t len, uint8_t *out);
+size_t netascii_flush(struct netascii *n, uint8_t *out);
+void prefetch_start(tftp_transfer *t);
+void prefetch_advance(tftp_transfer *t, uint64_t off);
+void prefetch_check(tftp_transfer *t, uint64_t off, size_t len);
+ssize_t prefetch_read(tftp_transfer *t, void *buf, size_t len, uint64_t off);
+int mcast_start(tftp_transfer *t, const char *filename, char *oack, ssize_t *olen, size_t size);
+int mcast_packet(tftp_transfer *t, uint8_t *buf, ssize_t c, struct sockaddr_in *from);
+int mcast_next(tftp_transfer *t, int status);
+void mcast_end(tftp_transfer *t);
+void transfer_prepare(void);
+int transfer_serve(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen);
+void handle_request(tftp_message *m, ssize_t len, struct sockaddr_in *client_sock, socklen_t slen);
+void fork_loop(int s);
+void prefork_loop(int s);
+void event_loop(int s);
+void start_workers(struct sockaddr_in *server_sock);
+void report_workers(FILE *f);
+struct worker_stats *worker_stats(int i);
+void metrics_observe(struct histogram *h, uint64_t value);
+void metrics_transfer_done(tftp_transfer *t);
+void report_metrics(FILE *f);
+void write_metrics(const char *path);
+void pace_init(void);
+uint64_t pace_take(struct settings *s, struct sockaddr_in *client, size_t bytes);
+int admit_take(void);
+void admit_release(void);
+int queue_init(struct request_queue *q, int size);
+int queue_find(struct request_queue *q, struct sockaddr_in *sock);
+void queue_hold(struct request_queue *q, int s, tftp_message *m, ssize_t len, struct sockaddr_in *from);
+int queue_next(struct request_queue *q, struct queued_request *r);
+int relay_open(tftp_transfer *t, const char *filename);
+int relay_ready(tftp_transfer *t, uint64_t end);
+void relay_wait(void);
+void vfile_init(const char *path);
+void dedup_init(const char *dir);
+struct dedup_writer *dedup_writer_open(int fd);
+int dedup_write(struct dedup_writer *d, const uint8_t *p, size_t len);
+int dedup_finish(struct dedup_writer *d);
+void dedup_writer_free(struct dedup_writer *d);
+int dedup_open(tftp_transfer *t);
+int vfile_open(tftp_transfer *t, const char *filename);
+uint64_t parse_rate(const char *s, char **end);
+void settings_init(const char *path);
+struct settings *settings_get(void);
+void settings_put(struct settings *s);
+int settings_reload(void);
+int settings_allow(struct settings *s, int opcode, struct sockaddr_in *addr);
+void settings_report(struct settings_stats *st);
+const char *resolve_init(const char *dir, int mode, int cache);
+const char *resolve_name(const char *name, const char *base);
+int resolve_open(const char *name, int flags);
+int resolve_at(int dfd, const char *name, int flags);
+int resolve_dir(const char *name, const char **leaf);
+void resolve_forget(const char *name);
+FILE *resolve_fopen(const char *name);
+void log_init(int fd, int level, int sample, int format);
+void log_event(int level, int kind, struct sockaddr_in *addr, const char *text, const char *arg,
+               uint64_t a, uint64_t b, uint64_t c);
+void log_stop(void);
+uint64_t log_dropped(void);
@@ -0,0 +1,242 @@
+#include "tftpserv.h"
+
+/* hierarchical timing wheel with millisecond ticks. Level 0 has a slot
+   for each of the next 64 ms, each level above a slot for 64 times as
+   long; a timer goes into the level its distance calls for, at the slot
+   its expiry falls in, and moves down a level every time the wheel below
+   comes round to that slot. Arming and cancelling are O(1), expiring
+   costs one step per tick that has a timer, empty stretches of the wheel
+   are skipped through the per-level occupancy bitmaps */
+
+#define WHEEL_BITS 6
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) (1ULL << (WHEEL_BITS * (level)))
+
+static void list_init(struct timer *head)
+{
+     head->next = head->prev = head;
+}
+
+static void list_add(struct timer *head, struct timer *t)
+{
+     t->prev = head->prev;
+     t->next = head;
+     head->prev->next = t;
+     head->prev = t;
+}
+
+static void list_del(struct timer *t)
+{
+     t->prev->next = t->next;
+     t->next->prev = t->prev;
+     t->next = t->prev = NULL;
+}
+
+void timer_init(struct timer_wheel *w, uint64_t now)
+{
+     int l, s;
+
+     memset(w, 0, sizeof(*w));
+     w->now = now;
+
+     for (l = 0; l < WHEEL_LEVELS; l++) {
+          for (s = 0; s < WHEEL_SLOTS; s++) {
+               list_init(&w->slots[l][s]);
+          }
+     }
+
+     list_init(&w->expired);
+}
+
+/* file t at the level and slot of its expiry, seen from the current tick */
+static void wheel_add(struct timer_wheel *w, struct timer *t)
+{
+     uint64_t expires = t->expires < w->now ? w->now : t->expires;
+     uint64_t delta = expires - w->now;
+     int level, slot;
+
+     for (level = 0; level < WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1); level++)
+          ;
+
+     /* beyond the top level, wait in its furthest slot and be filed again */
+
+     if (delta >= WHEEL_SPAN(WHEEL_LEVELS)) {
+          expires = w->now + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+     }
+
+     slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+     list_add(&w->slots[level][slot], t);
+     w->occupied[level] |= 1ULL << slot;
+     t->slot = level * WHEEL_SLOTS + slot;
+}
+
+static void wheel_del(struct timer_wheel *w, struct timer *t)
+{
+     struct timer *head;
+
+     list_del(t);
+
+     if (t->slot < 0) {
+          return;                    // on the expired list
+     }
+
+     head = &w->slots[t->slot / WHEEL_SLOTS][t->slot % WHEEL_SLOTS];
+
+     if (head->next == head) {
+          w->occupied[t->slot / WHEEL_SLOTS] &= ~(1ULL << (t->slot % WHEEL_SLOTS));
+     }
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires)
+{
+     if (t->next != NULL) {
+          if (t->expires == expires) {
+               return;
+          }
+          wheel_del(w, t);
+          w->count--;
+     }
+
+     t->expires = expires;
+     wheel_add(w, t);
+     w->count++;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+     if (t->next != NULL) {
+          wheel_del(w, t);
+          w->count--;
+     }
+}
+
+/* move every timer of a slot of an upper level down to where it belongs
+   now that the level below has come round to it */
+static void wheel_cascade(struct timer_wheel *w, int level, int slot)
+{
+     struct timer *head = &w->slots[level][slot], *t;
+
+     while ((t = head->next) != head) {
+          list_del(t);
+          wheel_add(w, t);
+     }
+
+     w->occupied[level] &= ~(1ULL << slot);
+}
+
+/* the tick after now, or the earliest one with a timer in level 0 or a
+   slot to cascade, whichever comes first */
+static uint64_t wheel_next_tick(struct timer_wheel *w)
+{
+     uint64_t rest = w->occupied[0] & (~0ULL << (w->now & WHEEL_MASK));
+
+     if ((w->now & WHEEL_MASK) == 0) {
+          return w->now;
+     }
+
+     if (rest) {
+          return (w->now & ~(uint64_t) WHEEL_MASK) + __builtin_ctzll(rest);
+     }
+
+     return (w->now | WHEEL_MASK) + 1;
+}
+
+/* return a timer whose expiry is at or before now, taken off the wheel,
+   or NULL when there is none left. Timers may be armed and cancelled
+   between calls, including the ones returned */
+struct timer *timer_expired(struct timer_wheel *w, uint64_t now)
+{
+     struct timer *t;
+     uint64_t tick;
+     int level, slot;
+
+     while (w->expired.next == &w->expired) {
+          if (w->count == 0) {
+               w->now = now + 1;
+               return NULL;
+          }
+
+          if ((tick = wheel_next_tick(w)) > now) {
+               w->now = now + 1;
+               return NULL;
+          }
+
+          w->now = tick;
+
+          /* at the start of a turn of level 0, the slots of the upper
+             levels that it has come round to move down */
+
+          for (level = 1; level < WHEEL_LEVELS && (tick & (WHEEL_SPAN(level) - 1)) == 0; level++) {
+               slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+               if (w->occupied[level] & (1ULL << slot)) {
+                    wheel_cascade(w, level, slot);
+               }
+          }
+
+          /* the slot of this tick is due; the clock moves past it first so
+             that timers armed for now meanwhile go to the next tick */
+
+          slot = tick & WHEEL_MASK;
+          w->now = tick + 1;
+
+          if (w->occupied[0] & (1ULL << slot)) {
+               while ((t = w->slots[0][slot].next) != &w->slots[0][slot]) {
+                    list_del(t);
+                    list_add(&w->expired, t);
+                    t->slot = -1;
+               }
+               w->occupied[0] &= ~(1ULL << slot);
+          }
+     }
+
+     t = w->expired.next;
+     list_del(t);
+     w->count--;
+
+     return t;
+}
+
+/* milliseconds from now until a timer may expire, -1 if none is armed.
+   Timers above level 0 count from the tick their slot cascades at, an
+   early wake up that only moves them down */
+int timer_next(struct timer_wheel *w, uint64_t now)
+{
+     uint64_t occ, rest, base, when = UINT64_MAX, tick;
+     int level, shift, cur, first;
+
+     if (w->count == 0) {
+          return -1;
+     }
+
+     if (w->expired.next != &w->expired) {
+          return 0;
+     }
+
+     for (level = 0; level < WHEEL_LEVELS; level++) {
+          if ((occ = w->occupied[level]) == 0) {
+               continue;
+          }
+
+          shift = WHEEL_BITS * level;
+          cur = (w->now >> shift) & WHEEL_MASK;
+          base = (w->now >> shift) & ~(uint64_t) WHEEL_MASK;
+
+          /* the current slot of an upper level is still to cascade only
+             when the clock stands right at its start, otherwise it holds
+             timers for the next turn */
+
+          first = level == 0 || (w->now & (WHEEL_SPAN(level) - 1)) == 0 ? cur : cur + 1;
+          rest = first < WHEEL_SLOTS ? occ & (~0ULL << first) : 0;
+
+          if (rest) {
+               tick = (base + __builtin_ctzll(rest)) << shift;
+          } else {
+               tick = (base + WHEEL_SLOTS + __builtin_ctzll(occ)) << shift;
+          }
+
+          when = tick < when ? tick : when;
+     }
+
+     return when > now ? (when - now < INT32_MAX ? when - now : INT32_MAX) : 0;
+}
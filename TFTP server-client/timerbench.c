@@ -0,0 +1,168 @@
+#include "tftpserv.h"
+
+/* timer microbenchmark: the timing wheel in timer.c against the linear
+   scan the event loop used to do, a minimum over every transfer for the
+   epoll_wait() timeout and a pass over all of them for the expired ones.
+   Both run the same simulated load, one step per millisecond: a share of
+   the sessions hear from their client and move their deadline, the due
+   ones expire and are armed again, a few end and are replaced. The counts
+   of expirations must match */
+
+#define SESSIONS 100000
+#define STEPS 5000
+#define ACTIVE 200                   /* sessions moving their deadline per step */
+#define CHURN 50                     /* sessions replaced per step */
+
+/* the deadline session i moves to at step: a retransmission timeout of
+   200 ms to a few seconds, the same for both runs */
+static uint64_t rearm(int i, uint64_t step)
+{
+     return step + 200 + (i * 7919ULL + step * 31) % 2800;
+}
+
+/* the timeouts are computed as the event loop would, and kept here */
+static volatile uint64_t sink;
+
+static uint64_t bench_us(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t run_wheel(struct timer *timers, uint64_t *us, uint64_t *arm_ns)
+{
+     struct timer_wheel *w = malloc(sizeof(*w));
+     struct timer *tm;
+     uint64_t now, start, expired = 0, idle = 0, armed;
+     int i, k;
+
+     memset(timers, 0, SESSIONS * sizeof(*timers));
+     timer_init(w, 0);
+
+     start = bench_us();
+
+     for (i = 0; i < SESSIONS; i++) {
+          timers[i].data = (void *) (intptr_t) i;
+          timer_arm(w, &timers[i], rearm(i, 0));
+     }
+
+     armed = bench_us() - start;
+
+     for (now = 1; now <= STEPS; now++) {
+          for (k = 0; k < ACTIVE; k++) {
+               i = (now * ACTIVE + k) * 48271 % SESSIONS;
+               timer_arm(w, &timers[i], rearm(i, now));
+          }
+
+          for (k = 0; k < CHURN; k++) {
+               i = (now * CHURN + k) * 16807 % SESSIONS;
+               timer_cancel(w, &timers[i]);
+               timer_arm(w, &timers[i], rearm(i, now));
+          }
+
+          idle += timer_next(w, now);
+
+          while ((tm = timer_expired(w, now)) != NULL) {
+               if (tm->expires > now) {
+                    fprintf(stderr, "timerbench: timer expired %llu ms early\n",
+                            (unsigned long long) (tm->expires - now));
+                    exit(1);
+               }
+               i = (intptr_t) tm->data;
+               timer_arm(w, tm, rearm(i, now));
+               expired++;
+          }
+     }
+
+     *us = bench_us() - start;
+     *arm_ns = armed * 1000 / SESSIONS;
+
+     for (i = 0; i < SESSIONS; i++) {
+          if (timers[i].expires <= STEPS) {
+               fprintf(stderr, "timerbench: timer missed\n");
+               exit(1);
+          }
+     }
+
+     free(w);
+
+     sink = idle;
+
+     return expired;
+}
+
+static uint64_t run_linear(uint64_t *deadlines, uint64_t *us)
+{
+     uint64_t now, start, expired = 0, idle = 0, timeout, d;
+     int i, k;
+
+     start = bench_us();
+
+     for (i = 0; i < SESSIONS; i++) {
+          deadlines[i] = rearm(i, 0);
+     }
+
+     for (now = 1; now <= STEPS; now++) {
+          for (k = 0; k < ACTIVE; k++) {
+               i = (now * ACTIVE + k) * 48271 % SESSIONS;
+               deadlines[i] = rearm(i, now);
+          }
+
+          for (k = 0; k < CHURN; k++) {
+               i = (now * CHURN + k) * 16807 % SESSIONS;
+               deadlines[i] = rearm(i, now);
+          }
+
+          for (i = 0, timeout = UINT64_MAX; i < SESSIONS; i++) {
+               d = deadlines[i] > now ? deadlines[i] - now : 0;
+               timeout = d < timeout ? d : timeout;
+          }
+          idle += timeout;
+
+          for (i = 0; i < SESSIONS; i++) {
+               if (deadlines[i] <= now) {
+                    deadlines[i] = rearm(i, now);
+                    expired++;
+               }
+          }
+     }
+
+     *us = bench_us() - start;
+
+     sink = idle;
+
+     return expired;
+}
+
+int main(void)
+{
+     struct timer *timers = malloc(SESSIONS * sizeof(*timers));
+     uint64_t *deadlines = malloc(SESSIONS * sizeof(*deadlines));
+     uint64_t wheel, linear, wheel_us, linear_us, arm_ns;
+
+     if (timers == NULL || deadlines == NULL) {
+          fprintf(stderr, "timerbench: out of memory\n");
+          return 1;
+     }
+
+     wheel = run_wheel(timers, &wheel_us, &arm_ns);
+     linear = run_linear(deadlines, &linear_us);
+
+     if (wheel != linear) {
+          fprintf(stderr, "timerbench: %llu expirations on the wheel, %llu by linear scan\n",
+                  (unsigned long long) wheel, (unsigned long long) linear);
+          return 1;
+     }
+
+     printf("%d sessions, %d steps, %d rearmed and %d replaced per step, %llu expirations\n",
+            SESSIONS, STEPS, ACTIVE, CHURN, (unsigned long long) wheel);
+     printf("%-8s %12s %12s\n", "impl", "total ms", "us/step");
+     printf("%-8s %12.1f %12.2f\n", "wheel", wheel_us / 1000.0, (double) wheel_us / STEPS);
+     printf("%-8s %12.1f %12.2f\n", "linear", linear_us / 1000.0, (double) linear_us / STEPS);
+     printf("initial arm: %llu ns per timer\n", (unsigned long long) arm_ns);
+
+     return 0;
+}
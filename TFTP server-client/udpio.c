@@ -0,0 +1,217 @@
+#include "tftpserv.h"
+#include <netinet/udp.h>
+
+/* batched datagram i/o: recvmmsg()/sendmmsg() and udp gso where the kernel
+   has them, cleared the first time the kernel refuses them and replaced by
+   one system call per datagram. A gso send the route cannot take, a
+   segment above its mtu, only falls back for that batch */
+
+static atomic_int have_mmsg = 1;
+static atomic_int have_gso = 1;
+
+/* receive up to n datagrams of at most size bytes into consecutive slots
+   of bufs; with wait set, block until the first one arrives. Returns the
+   number received, 0 if none is pending and -1 on error */
+int recv_batch(int s, uint8_t *bufs, size_t size, int n, struct sockaddr_in *from, ssize_t *lens, int wait)
+{
+     struct mmsghdr msgs[RECV_BATCH];
+     struct iovec iov[RECV_BATCH];
+     socklen_t flen;
+     ssize_t c;
+     int i;
+
+     if (n > RECV_BATCH) {
+          n = RECV_BATCH;
+     }
+
+     if (atomic_load_explicit(&have_mmsg, memory_order_relaxed)) {
+          memset(msgs, 0, n * sizeof(*msgs));
+
+          for (i = 0; i < n; i++) {
+               iov[i].iov_base = bufs + i * size;
+               iov[i].iov_len = size;
+               msgs[i].msg_hdr.msg_name = &from[i];
+               msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+               msgs[i].msg_hdr.msg_iov = &iov[i];
+               msgs[i].msg_hdr.msg_iovlen = 1;
+          }
+
+          if ((c = recvmmsg(s, msgs, n, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL)) >= 0) {
+               for (i = 0; i < c; i++) {
+                    lens[i] = msgs[i].msg_len;
+               }
+               return c;
+          }
+
+          if (errno != ENOSYS) {
+               if (errno == EAGAIN || errno == EINTR) {
+                    return 0;
+               }
+               perror("server: recvmmsg()");
+               return -1;
+          }
+
+          atomic_store(&have_mmsg, 0);
+     }
+
+     flen = sizeof(*from);
+
+     if ((c = recvfrom(s, bufs, size, wait ? 0 : MSG_DONTWAIT, (struct sockaddr *) from, &flen)) < 0) {
+          if (errno == EAGAIN || errno == EINTR) {
+               return 0;
+          }
+          perror("server: recvfrom()");
+          return -1;
+     }
+
+     lens[0] = c;
+
+     return 1;
+}
+
+/* send n datagrams of the same size seg (the last one may be shorter) as
+   one gso super-datagram, the kernel splits it into seg-sized packets */
+static int send_gso(int s, struct sockaddr_in *to, socklen_t tolen, struct iovec *iov, int n, int iovs, size_t seg)
+{
+     char control[CMSG_SPACE(sizeof(uint16_t))];
+     struct msghdr msg;
+     struct cmsghdr *cm;
+
+     memset(&msg, 0, sizeof(msg));
+     msg.msg_name = to;
+     msg.msg_namelen = tolen;
+     msg.msg_iov = iov;
+     msg.msg_iovlen = n * iovs;
+     msg.msg_control = control;
+     msg.msg_controllen = sizeof(control);
+
+     cm = CMSG_FIRSTHDR(&msg);
+     cm->cmsg_level = SOL_UDP;
+     cm->cmsg_type = UDP_SEGMENT;
+     cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+     *(uint16_t *) CMSG_DATA(cm) = seg;
+
+     return sendmsg(s, &msg, 0) < 0 ? -1 : 0;
+}
+
+static size_t msg_len(struct iovec *iov, int iovs)
+{
+     size_t len = 0;
+     int i;
+
+     for (i = 0; i < iovs; i++) {
+          len += iov[i].iov_len;
+     }
+
+     return len;
+}
+
+/* a send that failed for want of room, in the socket buffer or the
+   device queue, or was interrupted: the datagrams left are dropped as the
+   network could have, and the retransmit timer sends them again */
+static int send_transient(void)
+{
+     return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR;
+}
+
+/* send n datagrams to the same peer, datagram i made of the iovs iovecs
+   starting at iov[i * iovs]; seg is the size of a full datagram, 0 if the
+   datagrams may not be coalesced with gso. Returns the number of datagrams
+   sent, fewer than n when the socket cannot take more now, or -1 on error */
+int send_batch(int s, struct sockaddr_in *to, socklen_t tolen, struct iovec *iov, int n, int iovs, size_t seg)
+{
+     struct mmsghdr msgs[SEND_BATCH];
+     struct msghdr msg;
+     int i, k, sent, done = 0, gso = 1;
+
+     while (n > 0) {
+
+          /* as many full datagrams as fit in one gso send, plus a short last one */
+
+          if (seg && gso && n > 1 && atomic_load_explicit(&have_gso, memory_order_relaxed)) {
+               for (k = 0; k < n && k < GSO_SEGMENTS && (k + 1) * seg <= GSO_BYTES; k++) {
+                    if (msg_len(&iov[k * iovs], iovs) != seg) {
+                         k++;
+                         break;
+                    }
+               }
+
+               if (k > 1) {
+                    if (send_gso(s, to, tolen, iov, k, iovs, seg) == 0) {
+                         iov += k * iovs;
+                         n -= k;
+                         done += k;
+                         continue;
+                    }
+
+                    if (send_transient()) {
+                         return done;
+                    }
+
+                    if (errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+                         if (atomic_exchange(&have_gso, 0)) {
+                              fprintf(stderr, "server: udp gso unavailable, falling back to sendmmsg()\n");
+                         }
+                    } else if (errno == EIO || errno == EINVAL) {
+                         gso = 0;
+                    } else {
+                         perror("server: sendmsg()");
+                         return -1;
+                    }
+               }
+          }
+
+          k = n < SEND_BATCH ? n : SEND_BATCH;
+
+          if (atomic_load_explicit(&have_mmsg, memory_order_relaxed)) {
+               memset(msgs, 0, k * sizeof(*msgs));
+
+               for (i = 0; i < k; i++) {
+                    msgs[i].msg_hdr.msg_name = to;
+                    msgs[i].msg_hdr.msg_namelen = tolen;
+                    msgs[i].msg_hdr.msg_iov = &iov[i * iovs];
+                    msgs[i].msg_hdr.msg_iovlen = iovs;
+               }
+
+               if ((sent = sendmmsg(s, msgs, k, 0)) > 0) {
+                    iov += sent * iovs;
+                    n -= sent;
+                    done += sent;
+                    continue;
+               }
+
+               if (sent < 0 && send_transient()) {
+                    return done;
+               }
+
+               if (sent == 0 || errno != ENOSYS) {
+                    perror("server: sendmmsg()");
+                    return -1;
+               }
+
+               if (atomic_exchange(&have_mmsg, 0)) {
+                    fprintf(stderr, "server: sendmmsg() unavailable, sending datagrams one by one\n");
+               }
+          }
+
+          memset(&msg, 0, sizeof(msg));
+          msg.msg_name = to;
+          msg.msg_namelen = tolen;
+          msg.msg_iov = iov;
+          msg.msg_iovlen = iovs;
+
+          if (sendmsg(s, &msg, 0) < 0) {
+               if (send_transient()) {
+                    return done;
+               }
+               perror("server: sendmsg()");
+               return -1;
+          }
+
+          iov += iovs;
+          n--;
+          done++;
+     }
+
+     return done;
+}
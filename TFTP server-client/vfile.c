@@ -0,0 +1,680 @@
+#include "tftpserv.h"
+#include <ctype.h>
+#include <limits.h>
+#include <libgen.h>
+
+/* virtual files (-V): a RRQ matching a pattern of the table is answered
+   with a file rendered in memory from a template and a row of a host
+   table, and the disk is never touched. A line of the table is
+
+       pattern  template  hosts
+
+   with the template and host table relative to the table's directory,
+   where a * in the pattern stands for the key of the host table row, as
+   in pxelinux.cfg/01-*, and a pattern without one is keyed by the client
+   address. A row of the host table is a key followed by name=value
+   pairs, values with blanks in double quotes; the row keyed * holds the
+   values of rows that leave them out. A template refers to ${name}, to
+   ${key}, ${ip} and ${file}, and $$ is a dollar sign. Templates are
+   compiled into literal and variable pieces when the table is loaded,
+   and rendered files are cached per client, rule and filename in a shared
+   mapping that workers, forked children and pool processes all use. A
+   request matching a pattern whose key is neither in the host table nor
+   covered by a * row is served from the disk as usual */
+
+#define VFILE_SLOTS 1024             /* render cache entries, a multiple of the ways */
+#define VFILE_WAYS 4                 /* entries a file may go in */
+#define VFILE_NAMELEN 128            /* longest filename cached */
+#define VFILE_MAX 8192               /* largest rendered file cached */
+
+/* variables every template has, before those of its host table */
+enum vfile_builtin {
+     VAR_KEY,
+     VAR_IP,
+     VAR_FILE,
+     VAR_BUILTIN
+};
+
+static const char *builtin_names[VAR_BUILTIN] = { "key", "ip", "file" };
+
+struct vfile_value {
+     const char *s;
+     size_t len;
+};
+
+/* a piece of a compiled template: literal text, or a variable if var >= 0 */
+struct vfile_op {
+     int var;
+     const char *s;
+     size_t len;
+};
+
+struct vfile_host {
+     char *key;
+     struct vfile_value *values;     /* by variable, those past the builtins */
+};
+
+struct vfile_rule {
+     char *prefix;                   /* of the pattern, up to the * */
+     char *suffix;                   /* after it, NULL without a * */
+     char *text;                     /* template the ops point into */
+     struct vfile_op *ops;
+     int nops;
+     char **vars;                    /* names, the builtins first */
+     int nvars;
+     struct vfile_host *hosts;       /* sorted by key */
+     int nhosts;
+     struct vfile_host *fallback;    /* the row keyed *, NULL if none */
+};
+
+struct vfile_slot {
+     int rule;                       /* -1 when free */
+     uint32_t addr;                  /* of the client */
+     char name[VFILE_NAMELEN];       /* as requested */
+     uint64_t used;                  /* cache clock when last hit */
+     size_t len;
+     uint8_t data[VFILE_MAX];
+};
+
+struct vfile_cache {
+     pthread_mutex_t lock;
+     uint64_t clock;
+     struct vfile_slot slots[VFILE_SLOTS];
+};
+
+static struct vfile_rule *rules;
+static int nrules;
+static struct vfile_cache *vcache;
+
+static uint64_t vfile_ns(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void vfile_fail(const char *path, int line, const char *what)
+{
+     fprintf(stderr, "server: %s:%d: %s\n", path, line, what);
+     exit(1);
+}
+
+/* the next blank separated word of *p, a double quoted string as one;
+   NULL at the end of the line or a comment */
+static char *vfile_word(char **p)
+{
+     char *s = *p, *w;
+
+     while (isspace((uint8_t) *s)) {
+          s++;
+     }
+
+     if (*s == '\0' || *s == '#') {
+          return NULL;
+     }
+
+     w = s;
+
+     while (*s != '\0' && !isspace((uint8_t) *s)) {
+          if (*s == '"') {
+               memmove(s, s + 1, strlen(s));
+               s = strchrnul(s, '"');
+               if (*s == '"') {
+                    memmove(s, s + 1, strlen(s));
+               }
+               continue;
+          }
+          s++;
+     }
+
+     if (*s != '\0') {
+          *s++ = '\0';
+     }
+
+     *p = s;
+
+     return w;
+}
+
+static void vfile_lower(char *s)
+{
+     for (; *s; s++) {
+          *s = tolower((uint8_t) *s);
+     }
+}
+
+static int vfile_var(struct vfile_rule *r, const char *name, size_t len, int add)
+{
+     int i;
+
+     for (i = 0; i < r->nvars; i++) {
+          if (strlen(r->vars[i]) == len && strncmp(r->vars[i], name, len) == 0) {
+               return i;
+          }
+     }
+
+     if (!add) {
+          return -1;
+     }
+
+     if ((r->vars = realloc(r->vars, (r->nvars + 1) * sizeof(*r->vars))) == NULL ||
+         (r->vars[r->nvars] = strndup(name, len)) == NULL) {
+          fprintf(stderr, "server: out of memory\n");
+          exit(1);
+     }
+
+     return r->nvars++;
+}
+
+static int host_compare(const void *a, const void *b)
+{
+     return strcmp(((const struct vfile_host *) a)->key, ((const struct vfile_host *) b)->key);
+}
+
+/* read the host table of r: the names are collected on a first pass so
+   that every row can hold its values by variable */
+static void vfile_hosts(struct vfile_rule *r, const char *path)
+{
+     struct vfile_host *h = NULL;
+     FILE *f;
+     char *line = NULL, *p, *w, *eq;
+     size_t size = 0;
+     int pass, n, v, lineno;
+
+     if ((f = fopen(path, "r")) == NULL) {
+          perror(path);
+          exit(1);
+     }
+
+     for (pass = 0; pass < 2; pass++) {
+          rewind(f);
+          n = lineno = 0;
+
+          while (getline(&line, &size, f) >= 0) {
+               lineno++;
+               p = line;
+
+               if ((w = vfile_word(&p)) == NULL) {
+                    continue;
+               }
+
+               n++;
+
+               if (pass == 1) {
+                    h = &r->hosts[n - 1];
+                    h->key = strdup(w);
+                    h->values = calloc(r->nvars, sizeof(*h->values));
+
+                    if (h->key == NULL || h->values == NULL) {
+                         fprintf(stderr, "server: out of memory\n");
+                         exit(1);
+                    }
+
+                    vfile_lower(h->key);
+               }
+
+               while ((w = vfile_word(&p)) != NULL) {
+                    if ((eq = strchr(w, '=')) == NULL || eq == w) {
+                         vfile_fail(path, lineno, "expected name=value");
+                    }
+
+                    v = vfile_var(r, w, eq - w, pass == 0);
+
+                    if (pass == 1 && (h->values[v].s = strdup(eq + 1)) != NULL) {
+                         h->values[v].len = strlen(eq + 1);
+                    }
+               }
+          }
+
+          if (pass == 0 && (r->hosts = calloc(n + 1, sizeof(*r->hosts))) == NULL) {
+               fprintf(stderr, "server: out of memory\n");
+               exit(1);
+          }
+     }
+
+     free(line);
+     fclose(f);
+
+     r->nhosts = n;
+     qsort(r->hosts, n, sizeof(*r->hosts), host_compare);
+
+     /* values a row leaves out come from the row keyed *, resolved once
+        here rather than at every render */
+
+     for (n = 0; n < r->nhosts && strcmp(r->hosts[n].key, "*") != 0; n++)
+          ;
+
+     r->fallback = n < r->nhosts ? &r->hosts[n] : NULL;
+
+     for (n = 0; r->fallback != NULL && n < r->nhosts; n++) {
+          for (v = VAR_BUILTIN; v < r->nvars; v++) {
+               if (r->hosts[n].values[v].s == NULL) {
+                    r->hosts[n].values[v] = r->fallback->values[v];
+               }
+          }
+     }
+}
+
+/* compile the template of r into pieces, variables resolved to their
+   index; a name the host table does not have is an error */
+static void vfile_compile(struct vfile_rule *r, const char *path)
+{
+     struct vfile_op *op;
+     char *p, *end;
+     FILE *f;
+     long len;
+     int line = 1;
+
+     if ((f = fopen(path, "r")) == NULL) {
+          perror(path);
+          exit(1);
+     }
+
+     if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0 ||
+         (r->text = malloc(len + 1)) == NULL || fread(r->text, 1, len, f) != (size_t) len) {
+          perror(path);
+          exit(1);
+     }
+
+     fclose(f);
+     r->text[len] = '\0';
+
+     /* at most a literal and a variable per $ */
+
+     for (p = r->text, r->nops = 1; (p = strchr(p, '$')) != NULL; p++) {
+          r->nops += 2;
+     }
+
+     if ((r->ops = calloc(r->nops, sizeof(*r->ops))) == NULL) {
+          fprintf(stderr, "server: out of memory\n");
+          exit(1);
+     }
+
+     op = r->ops;
+     op->var = -1;
+     op->s = r->text;
+
+     for (p = r->text; *p != '\0'; p++) {
+          if (*p == '\n') {
+               line++;
+          }
+
+          if (*p != '$' || (p[1] != '$' && p[1] != '{')) {
+               op->len++;
+               continue;
+          }
+
+          /* $$ ends the literal after its first $ */
+
+          if (p[1] == '$') {
+               op->len++;
+               p++;
+          } else {
+               if ((end = strchr(p + 2, '}')) == NULL) {
+                    vfile_fail(path, line, "unterminated ${");
+               }
+
+               if (op->len > 0) {
+                    op++;
+               }
+
+               if ((op->var = vfile_var(r, p + 2, end - p - 2, 0)) < 0) {
+                    vfile_fail(path, line, "unknown variable");
+               }
+
+               p = end;
+          }
+
+          op++;
+          op->var = -1;
+          op->s = p + 1;
+     }
+
+     r->nops = op - r->ops + (op->len > 0);
+}
+
+/* a file the table names, relative to the directory of the table */
+static char *vfile_path(const char *table, const char *name)
+{
+     char *dir, *path = NULL;
+
+     if (name[0] == '/' || (dir = strdup(table)) == NULL) {
+          return strdup(name);
+     }
+
+     if (asprintf(&path, "%s/%s", dirname(dir), name) < 0) {
+          path = NULL;
+     }
+
+     free(dir);
+
+     return path;
+}
+
+/* load the virtual file table at path */
+void vfile_init(const char *path)
+{
+     pthread_mutexattr_t attr;
+     struct vfile_rule *r;
+     FILE *f;
+     char *line = NULL, *p, *pattern, *tmpl, *hosts, *star, *file;
+     size_t size = 0;
+     int n = 0, i;
+
+     if (path == NULL) {
+          return;
+     }
+
+     if ((f = fopen(path, "r")) == NULL) {
+          perror(path);
+          exit(1);
+     }
+
+     while (getline(&line, &size, f) >= 0) {
+          n++;
+          p = line;
+
+          if ((pattern = vfile_word(&p)) == NULL) {
+               continue;
+          }
+
+          if ((tmpl = vfile_word(&p)) == NULL || (hosts = vfile_word(&p)) == NULL ||
+              vfile_word(&p) != NULL) {
+               vfile_fail(path, n, "expected pattern, template and host table");
+          }
+
+          if ((star = strchr(pattern, '*')) != NULL && strchr(star + 1, '*') != NULL) {
+               vfile_fail(path, n, "more than one * in the pattern");
+          }
+
+          if ((rules = realloc(rules, (nrules + 1) * sizeof(*rules))) == NULL) {
+               fprintf(stderr, "server: out of memory\n");
+               exit(1);
+          }
+
+          r = &rules[nrules++];
+          memset(r, 0, sizeof(*r));
+
+          for (i = 0; i < VAR_BUILTIN; i++) {
+               vfile_var(r, builtin_names[i], strlen(builtin_names[i]), 1);
+          }
+
+          if (star != NULL) {
+               *star = '\0';
+               r->suffix = strdup(star + 1);
+          }
+
+          r->prefix = strdup(pattern);
+          if ((file = vfile_path(path, hosts)) == NULL) {
+               fprintf(stderr, "server: out of memory\n");
+               exit(1);
+          }
+
+          vfile_hosts(r, file);
+          free(file);
+
+          if ((file = vfile_path(path, tmpl)) == NULL) {
+               fprintf(stderr, "server: out of memory\n");
+               exit(1);
+          }
+
+          vfile_compile(r, file);
+          free(file);
+     }
+
+     free(line);
+     fclose(f);
+
+     if (nrules == 0) {
+          return;
+     }
+
+     vcache = mmap(NULL, sizeof(*vcache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (vcache == MAP_FAILED) {
+          perror("server: mmap()");
+          exit(1);
+     }
+
+     for (i = 0; i < VFILE_SLOTS; i++) {
+          vcache->slots[i].rule = -1;
+     }
+
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&vcache->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+}
+
+static void vfile_lock(void)
+{
+     if (pthread_mutex_lock(&vcache->lock) == EOWNERDEAD) {
+          pthread_mutex_consistent(&vcache->lock);
+     }
+}
+
+/* the first way of the set rule, addr and name hash to */
+static struct vfile_slot *vfile_set(int rule, uint32_t addr, const char *name)
+{
+     uint32_t h = 2166136261u ^ rule;
+
+     h = (h ^ addr) * 16777619u;
+
+     while (*name) {
+          h = (h ^ (uint8_t) *name++) * 16777619u;
+     }
+
+     return &vcache->slots[h % (VFILE_SLOTS / VFILE_WAYS) * VFILE_WAYS];
+}
+
+/* a copy of the cached render, NULL on a miss */
+static uint8_t *vfile_cached(int rule, uint32_t addr, const char *name, size_t *len)
+{
+     struct vfile_slot *set = vfile_set(rule, addr, name), *s;
+     uint8_t *out = NULL;
+     int i;
+
+     vfile_lock();
+
+     for (i = 0; i < VFILE_WAYS; i++) {
+          s = &set[i];
+
+          if (s->rule == rule && s->addr == addr && strcmp(s->name, name) == 0) {
+               if ((out = malloc(s->len ? s->len : 1)) != NULL) {
+                    memcpy(out, s->data, s->len);
+                    *len = s->len;
+                    s->used = ++vcache->clock;
+               }
+               break;
+          }
+     }
+
+     pthread_mutex_unlock(&vcache->lock);
+
+     return out;
+}
+
+/* keep a render, in the least recently used way of its set */
+static void vfile_keep(int rule, uint32_t addr, const char *name, const uint8_t *data, size_t len)
+{
+     struct vfile_slot *set = vfile_set(rule, addr, name), *s = set;
+     int i;
+
+     if (len > VFILE_MAX || strlen(name) >= VFILE_NAMELEN) {
+          return;
+     }
+
+     vfile_lock();
+
+     for (i = 1; i < VFILE_WAYS; i++) {
+          if (set[i].used < s->used) {
+               s = &set[i];
+          }
+     }
+
+     s->rule = rule;
+     s->addr = addr;
+     strcpy(s->name, name);
+     s->len = len;
+     s->used = ++vcache->clock;
+     memcpy(s->data, data, len);
+
+     pthread_mutex_unlock(&vcache->lock);
+}
+
+/* render the template of r for a row and the request */
+static uint8_t *vfile_render(struct vfile_rule *r, struct vfile_host *h, struct vfile_value *builtin,
+                             size_t *len)
+{
+     struct vfile_value *v;
+     struct vfile_op *op;
+     uint8_t *out, *p;
+     size_t n = 0;
+
+     for (op = r->ops; op < r->ops + r->nops; op++) {
+          n += op->var < 0 ? op->len : op->var < VAR_BUILTIN ? builtin[op->var].len : h->values[op->var].len;
+     }
+
+     if ((out = malloc(n ? n : 1)) == NULL) {
+          return NULL;
+     }
+
+     for (op = r->ops, p = out; op < r->ops + r->nops; op++) {
+          if (op->var < 0) {
+               memcpy(p, op->s, op->len);
+               p += op->len;
+          } else {
+               v = op->var < VAR_BUILTIN ? &builtin[op->var] : &h->values[op->var];
+               memcpy(p, v->s, v->len);
+               p += v->len;
+          }
+     }
+
+     *len = n;
+
+     return out;
+}
+
+/* netascii: line ends translated once for the whole file, which is then
+   sent byte for byte */
+static uint8_t *vfile_netascii(uint8_t *in, size_t *len)
+{
+     struct netascii na;
+     uint8_t *out;
+     size_t inlen = *len, n;
+
+     if ((out = malloc(2 * inlen + 2)) == NULL) {
+          return NULL;
+     }
+
+     netascii_reset(&na);
+     n = netascii_encode(&na, in, &inlen, out, 2 * inlen + 2);
+     *len = n + netascii_flush(&na, out + n);
+
+     return out;
+}
+
+/* does filename match the pattern of r? The part a * stands for, a
+   non-empty part of a single path component, goes to key */
+static int vfile_match(struct vfile_rule *r, const char *filename, char *key, size_t size)
+{
+     size_t plen = strlen(r->prefix), len, slen;
+
+     if (strncmp(filename, r->prefix, plen) != 0) {
+          return 0;
+     }
+
+     filename += plen;
+
+     if (r->suffix == NULL) {
+          return *filename == '\0';
+     }
+
+     len = strlen(filename);
+     slen = strlen(r->suffix);
+
+     if (len <= slen || len - slen >= size || strcmp(filename + len - slen, r->suffix) != 0 ||
+         memchr(filename, '/', len - slen) != NULL) {
+          return 0;
+     }
+
+     memcpy(key, filename, len - slen);
+     key[len - slen] = '\0';
+     vfile_lower(key);
+
+     return 1;
+}
+
+/* a RRQ for filename: when it matches a rule and its key is in the host
+   table, render the file or take it from the cache and serve it from
+   memory. Returns 0 with t->map set, -1 to serve the file from disk */
+int vfile_open(tftp_transfer *t, const char *filename)
+{
+     struct vfile_value builtin[VAR_BUILTIN];
+     struct vfile_host *h, k;
+     struct vfile_rule *r = NULL;
+     char ip[INET_ADDRSTRLEN], key[NAME_MAX + 1];
+     uint32_t addr = t->client_sock.sin_addr.s_addr;
+     uint64_t start;
+     uint8_t *out, *na;
+     size_t len;
+     int i;
+
+     for (i = 0; i < nrules && !vfile_match(r = &rules[i], filename, key, sizeof(key)); i++)
+          ;
+
+     if (i == nrules) {
+          return -1;
+     }
+
+     inet_ntop(AF_INET, &t->client_sock.sin_addr, ip, sizeof(ip));
+
+     if (r->suffix == NULL) {
+          strcpy(key, ip);
+     }
+
+     k.key = key;
+
+     if ((h = bsearch(&k, r->hosts, r->nhosts, sizeof(*r->hosts), host_compare)) == NULL &&
+         (h = r->fallback) == NULL) {
+          return -1;
+     }
+
+     start = vfile_ns();
+
+     if ((out = vfile_cached(i, addr, filename, &len)) != NULL) {
+          worker_count(vfile_hits);
+     } else {
+          builtin[VAR_KEY] = (struct vfile_value) { key, strlen(key) };
+          builtin[VAR_IP] = (struct vfile_value) { ip, strlen(ip) };
+          builtin[VAR_FILE] = (struct vfile_value) { filename, strlen(filename) };
+
+          if ((out = vfile_render(r, h, builtin, &len)) == NULL) {
+               return -1;
+          }
+
+          vfile_keep(i, addr, filename, out, len);
+          worker_count(vfile_renders);
+     }
+
+     if (t->mode == NETASCII) {
+          na = vfile_netascii(out, &len);
+          free(out);
+
+          if ((out = na) == NULL) {
+               return -1;
+          }
+     }
+
+     worker_observe(vfile_render, vfile_ns() - start);
+     log_event(LOG_DEBUG, LOG_MESSAGE, &t->client_sock, "virtual file rendered", NULL, 0, 0, 0);
+
+     t->rendered = out;
+     t->map = out;
+     t->size = len;
+
+     return 0;
+}
@@ -0,0 +1,120 @@
+#include "tftpserv.h"
+#include <sched.h>
+
+__thread struct worker *current_worker;
+
+static struct worker *workers;
+
+/* open a udp socket bound to the tftp port, with SO_REUSEPORT when several
+   workers share it so the kernel spreads requests across them */
+static int open_listener(struct sockaddr_in *server_sock, int reuseport)
+{
+     struct protoent *pp;
+     int s, on = 1;
+
+     if ((pp = getprotobyname("udp")) == 0) {
+          fprintf(stderr, "server: getprotobyname() error\n");
+          exit(1);
+     }
+
+     if ((s = socket(AF_INET, SOCK_DGRAM, pp->p_proto)) == -1) {
+          perror("server: socket() error");
+          exit(1);
+     }
+
+     if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+          perror("server: setsockopt()");
+          exit(1);
+     }
+
+     if (bind(s, (struct sockaddr *) server_sock, sizeof(*server_sock)) == -1) {
+          perror("server: bind()");
+          close(s);
+          exit(1);
+     }
+
+     return s;
+}
+
+static void *worker_main(void *arg)
+{
+     struct worker *w = arg;
+     cpu_set_t cpus;
+
+     current_worker = w;
+
+     if (w->cpu >= 0) {
+          CPU_ZERO(&cpus);
+          CPU_SET(w->cpu, &cpus);
+
+          if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+               fprintf(stderr, "server: worker %d: cannot pin to cpu %d\n", w->id, w->cpu);
+          }
+     }
+
+     if (config.event_mode) {
+          event_loop(w->s);
+     } else if (config.prefork > 0) {
+          prefork_loop(w->s);
+     } else {
+          fork_loop(w->s);
+     }
+
+     return NULL;
+}
+
+void start_workers(struct sockaddr_in *server_sock)
+{
+     struct worker_stats *stats;
+     long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+     int i;
+
+     workers = calloc(config.workers, sizeof(*workers));
+     stats = mmap(NULL, config.workers * sizeof(*stats), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     if (workers == NULL || stats == MAP_FAILED) {
+          fprintf(stderr, "server: cannot allocate workers\n");
+          exit(1);
+     }
+
+     /* bind every socket before any worker runs, so none of them sees
+        requests meant for a sibling that failed to start */
+
+     for (i = 0; i < config.workers; i++) {
+          workers[i].id = i;
+          workers[i].cpu = config.pin_cpus ? i % (ncpus > 0 ? ncpus : 1) : -1;
+          workers[i].stats = &stats[i];
+          workers[i].s = open_listener(server_sock, config.workers > 1);
+     }
+
+     for (i = 0; i < config.workers; i++) {
+          if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+               fprintf(stderr, "server: cannot start worker %d\n", i);
+               exit(1);
+          }
+     }
+}
+
+void report_workers(FILE *f)
+{
+     struct worker_stats *st;
+     int i;
+
+     for (i = 0; i < config.workers; i++) {
+          st = workers[i].stats;
+          fprintf(f, "worker %d (cpu %d): %lu requests, %lu completed, %lu failed, "
+                  "%lu of %lu disk reads stalled\n",
+                  i, workers[i].cpu,
+                  (unsigned long) atomic_load_explicit(&st->requests, memory_order_relaxed),
+                  (unsigned long) atomic_load_explicit(&st->completed, memory_order_relaxed),
+                  (unsigned long) atomic_load_explicit(&st->failed, memory_order_relaxed),
+                  (unsigned long) atomic_load_explicit(&st->disk_stalls, memory_order_relaxed),
+                  (unsigned long) atomic_load_explicit(&st->disk_reads, memory_order_relaxed));
+     }
+}
+
+struct worker_stats *worker_stats(int i)
+{
+     return workers[i].stats;
+}
@@ -0,0 +1,554 @@
+#include "tftpserv.h"
+#include <sys/eventfd.h>
+
+/* write-behind for WRQ: the transfer hands each block received in order
+   to a bounded ring and acks it at once, a writer thread writes the ring
+   out to a temporary file next to the destination, in the directory it
+   was resolved to beneath the base directory. Once the last
+   block is written the file is synced, as the fsync policy asks, and
+   renamed over the destination, so a failed upload never leaves a
+   truncated file behind. The writer reports freed slots, while the
+   transfer waits for some, and the end of the commit through an eventfd.
+   With a deduplicating store the writer passes the data to it and the
+   temporary file gets the manifest instead, see dedup.c.
+
+   A process runs at most WB_THREADS writers, started as uploads need
+   them, rather than a thread per upload an event loop could have many of.
+   An upload with blocks queued waits its turn in a run queue, and a
+   writer takes it off, writes out up to WB_BURST of its blocks and puts it
+   back behind the others if it has more. A transfer whose ring is full
+   stops reading from its client until the writer frees a slot, never
+   writing itself */
+
+struct write_behind {
+     int fd;                         /* the temporary file */
+     struct dedup_writer *dedup;     /* chunks data into the store, NULL if off */
+     struct worker *worker;          /* the writer counts for it */
+     int efd;                        /* eventfd the writer signals */
+     int dfd;                        /* directory of the destination */
+     char *path;                     /* destination, in dfd */
+     char *tmp;                      /* temporary file, in dfd */
+
+     struct write_behind *next;      /* in the run queue */
+     int sched;                      /* WB_IDLE, WB_QUEUED or WB_WRITING, under wb_pool */
+
+     pthread_mutex_t lock;
+
+     uint8_t *ring;                  /* nslots slots of ssize bytes */
+     size_t *len;
+     size_t ssize;
+     int nslots;
+     int head;                       /* next slot the transfer fills */
+     int tail;                       /* next slot the writer writes out */
+     int queued;
+     int last;                       /* the block ending the file is queued */
+     int waiting;                    /* the transfer found the ring full */
+     int abort;
+
+     int state;                      /* WB_RUNNING, WB_DONE or WB_FAILED */
+     int error;                      /* errno of the failure */
+     uint64_t written;               /* the offset the next slot goes to */
+     uint64_t synced;                /* bytes written when the file was last synced */
+};
+
+/* where an upload is, as far as the writers are concerned */
+enum {
+     WB_IDLE,                        /* nothing queued, or being closed */
+     WB_QUEUED,                      /* in the run queue */
+     WB_WRITING                      /* a writer has it */
+};
+
+static atomic_uint tmp_serial;
+
+static pthread_mutex_t wb_pool = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_work = PTHREAD_COND_INITIALIZER;   /* an upload was queued */
+static pthread_cond_t wb_idle = PTHREAD_COND_INITIALIZER;   /* a writer let go of one */
+static struct write_behind *run_head, *run_tail;
+static int writers;                  /* threads started */
+static int uploads;                  /* open */
+
+static void wb_signal(struct write_behind *w)
+{
+     uint64_t one = 1;
+
+     if (write(w->efd, &one, sizeof(one)) < 0) {
+          perror("server: write()");
+     }
+}
+
+static void wb_fail(struct write_behind *w, int error)
+{
+     pthread_mutex_lock(&w->lock);
+     w->state = WB_FAILED;
+     w->error = error;
+     pthread_mutex_unlock(&w->lock);
+
+     wb_signal(w);
+}
+
+/* give the file the owner and mode of the destination it replaces, as
+   the upload overwriting it in place used to keep them; the owner only
+   where the server may change it */
+static int wb_keep_mode(struct write_behind *w)
+{
+     struct stat st;
+
+     if (fstatat(w->dfd, w->path, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+          return 0;
+     }
+
+     if (fchown(w->fd, st.st_uid, st.st_gid) < 0 && errno != EPERM) {
+          return -1;
+     }
+
+     return fchmod(w->fd, st.st_mode & 07777);
+}
+
+/* sync the file and rename it over the destination, then sync the
+   directory so that the rename itself survives a crash */
+static int wb_commit(struct write_behind *w)
+{
+     if (wb_keep_mode(w) < 0) {
+          return -1;
+     }
+
+     if (config.fsync_policy != FSYNC_NONE && fsync(w->fd) < 0) {
+          return -1;
+     }
+
+     if (close(w->fd) < 0) {
+          w->fd = -1;
+          return -1;
+     }
+
+     w->fd = -1;
+
+     if (renameat(w->dfd, w->tmp, w->dfd, w->path) < 0) {
+          return -1;
+     }
+
+     free(w->tmp);
+     w->tmp = NULL;
+
+     if (config.fsync_policy != FSYNC_NONE) {
+          fsync(w->dfd);
+     }
+
+     return 0;
+}
+
+/* write out one block, and commit the file after the last one */
+static int wb_write(struct write_behind *w, uint8_t *p, size_t left, int last)
+{
+     ssize_t c;
+
+     if (w->dedup != NULL && dedup_write(w->dedup, p, left) < 0) {
+          return -1;
+     }
+
+     for (; w->dedup == NULL && left > 0; p += c, left -= c) {
+          if ((c = pwrite(w->fd, p, left, w->written)) < 0 && errno != EINTR) {
+               return -1;
+          }
+          c = c < 0 ? 0 : c;
+          w->written += c;
+     }
+
+     if (config.fsync_policy == FSYNC_PERIODIC &&
+         w->written - w->synced >= (uint64_t) config.fsync_mb << 20) {
+          if (fdatasync(w->fd) < 0) {
+               return -1;
+          }
+          w->synced = w->written;
+     }
+
+     if (last && ((w->dedup != NULL && dedup_finish(w->dedup) < 0) || wb_commit(w) < 0)) {
+          return -1;
+     }
+
+     return 0;
+}
+
+static void wb_done(struct write_behind *w)
+{
+     pthread_mutex_lock(&w->lock);
+     w->state = WB_DONE;
+     pthread_mutex_unlock(&w->lock);
+
+     wb_signal(w);
+}
+
+/* append w to the run queue, with wb_pool held */
+static void wb_schedule(struct write_behind *w)
+{
+     w->sched = WB_QUEUED;
+     w->next = NULL;
+
+     if (run_tail != NULL) {
+          run_tail->next = w;
+     } else {
+          run_head = w;
+     }
+
+     run_tail = w;
+     pthread_cond_signal(&wb_work);
+}
+
+/* write out up to WB_BURST of the blocks queued in w; returns 1 when w
+   is done with, committed or failed */
+static int wb_burst(struct write_behind *w)
+{
+     uint8_t *p;
+     size_t left;
+     int n, last, wake;
+
+     for (n = 0; n < WB_BURST; n++) {
+          pthread_mutex_lock(&w->lock);
+
+          if (w->queued == 0 || w->abort || w->state != WB_RUNNING) {
+               pthread_mutex_unlock(&w->lock);
+               return 0;
+          }
+
+          /* the slot at tail is the writer's until it is released below */
+
+          p = w->ring + (size_t) w->tail * w->ssize;
+          left = w->len[w->tail];
+          last = w->last && w->queued == 1;
+
+          pthread_mutex_unlock(&w->lock);
+
+          if (wb_write(w, p, left, last) < 0) {
+               wb_fail(w, errno);
+               return 1;
+          }
+
+          if (last) {
+               wb_done(w);
+               return 1;
+          }
+
+          pthread_mutex_lock(&w->lock);
+
+          w->tail = (w->tail + 1) % w->nslots;
+          w->queued--;
+          wake = w->waiting;
+          w->waiting = 0;
+
+          pthread_mutex_unlock(&w->lock);
+
+          if (wake) {
+               wb_signal(w);
+          }
+     }
+
+     return 0;
+}
+
+static void *wb_main(void *arg)
+{
+     struct write_behind *w;
+     int more;
+
+     (void) arg;
+
+     pthread_mutex_lock(&wb_pool);
+
+     while (1) {
+          while (run_head == NULL) {
+               pthread_cond_wait(&wb_work, &wb_pool);
+          }
+
+          w = run_head;
+
+          if ((run_head = w->next) == NULL) {
+               run_tail = NULL;
+          }
+
+          w->sched = WB_WRITING;
+
+          pthread_mutex_unlock(&wb_pool);
+
+          current_worker = w->worker;
+          more = !wb_burst(w);
+
+          /* back in the queue behind the others while it has blocks, which
+             wb_push() only checks once it is let go of */
+
+          pthread_mutex_lock(&wb_pool);
+          pthread_mutex_lock(&w->lock);
+          more = more && w->queued > 0 && !w->abort && w->state == WB_RUNNING;
+          pthread_mutex_unlock(&w->lock);
+
+          if (more) {
+               wb_schedule(w);
+          } else {
+               w->sched = WB_IDLE;
+               pthread_cond_broadcast(&wb_idle);
+          }
+     }
+
+     return NULL;
+}
+
+/* start writing path behind a transfer of blksize blocks; on failure
+   returns NULL with errno set */
+struct write_behind *wb_open(const char *path, size_t blksize, int windowsize)
+{
+     struct write_behind *w;
+     pthread_attr_t attr;
+     pthread_t thread;
+     const char *leaf;
+     struct stat st;
+     int e, n;
+
+     if ((w = calloc(1, sizeof(*w))) == NULL) {
+          return NULL;
+     }
+
+     w->fd = w->efd = -1;
+
+     if ((w->dfd = resolve_dir(path, &leaf)) < 0) {
+          free(w);
+          return NULL;
+     }
+
+     /* the destination is only replaced at the end, but a file the client
+        may not write to is refused up front as before, and so is a name
+        the file could never be renamed to: one ending in a slash, or a
+        directory */
+
+     if (leaf[0] == '\0' || strcmp(leaf, ".") == 0 ||
+         (fstatat(w->dfd, leaf, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))) {
+          errno = EISDIR;
+          goto fail;
+     }
+
+     if (faccessat(w->dfd, leaf, F_OK, 0) == 0 && faccessat(w->dfd, leaf, W_OK, 0) < 0) {
+          goto fail;
+     }
+
+     n = WB_RING_BYTES / blksize;
+     n = n < WB_SLOTS ? n : WB_SLOTS;
+     w->nslots = n > 2 * windowsize ? n : 2 * windowsize;
+
+     /* netascii decoding may leave one byte more than a block */
+
+     w->ssize = blksize + 2;
+
+     if ((w->path = strdup(leaf)) == NULL ||
+         (w->ring = malloc(w->nslots * w->ssize)) == NULL ||
+         (w->len = malloc(w->nslots * sizeof(*w->len))) == NULL ||
+         (w->tmp = malloc(strlen(leaf) + 64)) == NULL) {
+          errno = ENOMEM;
+          goto fail;
+     }
+
+     /* a hidden name in the destination directory, for the rename to be atomic */
+
+     do {
+          sprintf(w->tmp, ".%s.%d.%u.tmp", leaf, (int) getpid(), atomic_fetch_add(&tmp_serial, 1));
+     } while ((w->fd = openat(w->dfd, w->tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0 && errno == EEXIST);
+
+     if (w->fd < 0) {
+          free(w->tmp);
+          w->tmp = NULL;
+          goto fail;
+     }
+
+     if ((w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+          goto fail;
+     }
+
+     if (config.dedup_store != NULL && (w->dedup = dedup_writer_open(w->fd)) == NULL) {
+          goto fail;
+     }
+
+     w->worker = current_worker;
+
+     /* a writer for each upload open, up to WB_THREADS; an upload only
+        fails for want of one when there is none at all */
+
+     pthread_mutex_lock(&wb_pool);
+
+     if (writers < WB_THREADS && writers <= uploads) {
+          pthread_attr_init(&attr);
+          pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+          if ((e = pthread_create(&thread, &attr, wb_main, NULL)) == 0) {
+               writers++;
+          }
+
+          pthread_attr_destroy(&attr);
+
+          if (writers == 0) {
+               pthread_mutex_unlock(&wb_pool);
+               errno = e;
+               goto fail;
+          }
+     }
+
+     uploads++;
+     pthread_mutex_unlock(&wb_pool);
+
+     pthread_mutex_init(&w->lock, NULL);
+
+     return w;
+
+fail:
+     e = errno;
+
+     if (w->dedup != NULL) {
+          dedup_writer_free(w->dedup);
+     }
+
+     if (w->efd >= 0) {
+          close(w->efd);
+     }
+
+     if (w->fd >= 0) {
+          close(w->fd);
+          unlinkat(w->dfd, w->tmp, 0);
+     }
+
+     close(w->dfd);
+     free(w->tmp);
+     free(w->path);
+     free(w->ring);
+     free(w->len);
+     free(w);
+
+     errno = e;
+
+     return NULL;
+}
+
+/* the descriptor to poll for the writer's signals */
+int wb_eventfd(struct write_behind *w)
+{
+     return w->efd;
+}
+
+/* free slots; with none, the writer signals as soon as one is released */
+int wb_space(struct write_behind *w)
+{
+     int n;
+
+     pthread_mutex_lock(&w->lock);
+
+     if ((n = w->nslots - w->queued) == 0) {
+          w->waiting = 1;
+     }
+
+     pthread_mutex_unlock(&w->lock);
+
+     return n;
+}
+
+/* the next slot to fill, blksize + 2 bytes long */
+uint8_t *wb_slot(struct write_behind *w)
+{
+     return w->ring + (size_t) w->head * w->ssize;
+}
+
+/* queue the slot returned by wb_slot(), holding len bytes; last is set
+   for the block that ends the file */
+void wb_push(struct write_behind *w, size_t len, int last)
+{
+     pthread_mutex_lock(&w->lock);
+
+     w->len[w->head] = len;
+     w->head = (w->head + 1) % w->nslots;
+     w->queued++;
+     w->last = last;
+
+     pthread_mutex_unlock(&w->lock);
+
+     pthread_mutex_lock(&wb_pool);
+
+     if (w->sched == WB_IDLE) {
+          wb_schedule(w);
+     }
+
+     pthread_mutex_unlock(&wb_pool);
+}
+
+/* consume the writer's signals and return its state; after WB_FAILED,
+   errno is set to the cause */
+int wb_poll(struct write_behind *w)
+{
+     uint64_t count;
+     int state;
+
+     while (read(w->efd, &count, sizeof(count)) > 0)
+          ;
+
+     pthread_mutex_lock(&w->lock);
+     state = w->state;
+     errno = w->error;
+     pthread_mutex_unlock(&w->lock);
+
+     return state;
+}
+
+/* stop the writer and free w, removing the temporary file unless the
+   upload was committed */
+void wb_close(struct write_behind *w)
+{
+     struct write_behind *prev = NULL, *q;
+
+     pthread_mutex_lock(&wb_pool);
+
+     pthread_mutex_lock(&w->lock);
+     w->abort = 1;
+     pthread_mutex_unlock(&w->lock);
+
+     /* out of the run queue, or let go of by its writer */
+
+     if (w->sched == WB_QUEUED) {
+          for (q = run_head; q != w; q = q->next) {
+               prev = q;
+          }
+
+          if (prev != NULL) {
+               prev->next = w->next;
+          } else {
+               run_head = w->next;
+          }
+
+          if (run_tail == w) {
+               run_tail = prev;
+          }
+     }
+
+     while (w->sched == WB_WRITING) {
+          pthread_cond_wait(&wb_idle, &wb_pool);
+     }
+
+     w->sched = WB_IDLE;
+     uploads--;
+
+     pthread_mutex_unlock(&wb_pool);
+
+     if (w->fd >= 0) {
+          close(w->fd);
+     }
+
+     if (w->tmp != NULL) {
+          unlinkat(w->dfd, w->tmp, 0);
+     }
+
+     if (w->dedup != NULL) {
+          dedup_writer_free(w->dedup);
+     }
+
+     close(w->efd);
+     close(w->dfd);
+     pthread_mutex_destroy(&w->lock);
+
+     free(w->tmp);
+     free(w->path);
+     free(w->ring);
+     free(w->len);
+     free(w);
+}